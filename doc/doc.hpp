@@ -105,6 +105,8 @@ This is a collection of tutorials that should cover most aspects of the fastcgi+
 
 Our goal here will be to make a FastCGI application that responds to clients with some text, waits five seconds and then sends more. We're going to use threading and boost::asio to handle our timer. Your going to need the boost C++ libraries for this. At least version 1.35.0.
 
+The point here is to show how requests communicate with other threads and libraries through their callback. Should all you need be a delay, Fastcgipp::Request::wakeAfter() has the manager deliver the message itself without any thread or timer object of your own.
+
 All code and data is located in the examples directory of the tarball. You'll have to compile with: `pkg-config --libs --cflags fastcgi++` -lboost_system
 
 \subsection timerError Error Logging
@@ -473,12 +475,6 @@ Fastcgipp::Http::Environment implements the etag variable as an integer for bett
 		}
 \endcode
 
-We will need to call Fastcgipp::Request::setloc() to set a facet in our requests locale regarding how to format the date upon insertion. It needs to conform to the HTTP standard. When setting locales for the streams, make sure to use the Fastcgipp::Request::setloc() function instead of directly imbueing them. This insures that the UTF-8 code conversion still functions properly if used.
-
-\code
-		setloc(locale(getloc(), new posix_time::time_facet("%a, %d %b %Y %H:%M:%S GMT")));
-\endcode
-
 If the modification time of the file is older or equal to the if-modified-since value sent to us from the client and the etag matches, we don't need to send the image to them.
 
 \code
@@ -495,10 +491,10 @@ We're going to use std::fstream to read the file data.
 		ifstream image("gnu.png");
 \endcode
 
-Now we transmit our HTTP header containing the modification data, file size and etag value.
+Now we transmit our HTTP header containing the modification data, file size and etag value. The modification date needs to conform to the HTTP standard so we insert it with the Fastcgipp::httpDate manipulator, which formats it without involving the locale of the stream.
 
 \code
-		out << "Last-Modified: " << modTime << '\n';
+		out << "Last-Modified: " << Fastcgipp::httpDate(modTime) << '\n';
 		out << "Etag: " << etag << '\n';
 		out << "Content-Length: " << fileSize << '\n';
 		out << "Content-Type: image/png\r\n\r\n";
@@ -585,8 +581,6 @@ class ShowGnu: public Fastcgipp::Request<char>
 			etag = fileStat.st_ino;
 		}
 
-		setloc(locale(getloc(), new posix_time::time_facet("%a, %d %b %Y %H:%M:%S GMT")));
-
 		if(!environment().ifModifiedSince.is_not_a_date_time() && etag==environment().etag && modTime<=environment().ifModifiedSince)
 		{
 			out << "Status: 304 Not Modified\r\n\r\n";
@@ -595,7 +589,7 @@ class ShowGnu: public Fastcgipp::Request<char>
 
 		std::ifstream image("gnu.png");
 
-		out << "Last-Modified: " << modTime << '\n';
+		out << "Last-Modified: " << Fastcgipp::httpDate(modTime) << '\n';
 		out << "Etag: " << etag << '\n';
 		out << "Content-Length: " << fileSize << '\n';
 		out << "Content-Type: image/png\r\n\r\n";
@@ -737,7 +731,7 @@ First we will take a look at what path info we were sent
 			out << "<p>No Path Info</p>";
 \endcode
 
-Now let's take a look at the GET data. The GET data is stored in the associative container environment().gets which is of type std::map< std::basic_string< charT >, std::basic_string< charT > > links names to values.
+Now let's take a look at the GET data. The GET data is stored in the associative container environment().gets which is of type Fastcgipp::FlatMap< charT, std::basic_string< charT > > and links names to values in the order they were passed.
 
 \code
 		out << "<h1>GET Data</h1>";
@@ -748,7 +742,7 @@ Now let's take a look at the GET data. The GET data is stored in the associative
 			out << "<p>No GET data</p>";
 \endcode
 
-Now let's take a look at the cookie data. The cookie data is stored in the associative container environment().cookies which is of type std::map< std::basic_string< charT >, std::basic_string< charT > > links names to values.
+Now let's take a look at the cookie data. The cookie data is stored in the associative container environment().cookies which is of type Fastcgipp::FlatMap< charT, std::basic_string< charT > > and links names to values.
 
 \code
 		out << "<h1>Cookie Data</h1>";
@@ -1236,12 +1230,6 @@ In order to get login/logout commands from the client we will use GET informatio
 		std::string command=environment().gets["command"];
 \endcode
 
-Now we're going to need to set our locale to output boost::date_time stuff in a proper cookie expiry way. See Fastcgipp::Request::setloc().
-
-\code
-		setloc(std::locale(getloc(), new boost::posix_time::time_facet("%a, %d-%b-%Y %H:%M:%S GMT")));
-\endcode
-
 Now we do what needs to be done if we received valid session data.
 
 \code
@@ -1254,7 +1242,7 @@ Now we do what needs to be done if we received valid session data.
 If we received a logout command then we need to delete the cookie, remove the session data from the container, reset our session iterator, and then send the response.
 
 \code
-				out << "Set-Cookie: SESSIONID=deleted; expires=Thu, 01-Jan-1970 00:00:00 GMT;\n";
+				out << "Set-Cookie: SESSIONID=deleted; expires=Thu, 01 Jan 1970 00:00:00 GMT;\n";
 				sessions.erase(session);
 				session=sessions.end();
 				handleNoSession();
@@ -1267,7 +1255,7 @@ Otherwise, we just call Fastcgipp::Http::SessionId::refresh() on our session ID
 
 \code
 				session->first.refresh();
-				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				handleSession();
 			}
 		}
@@ -1286,7 +1274,7 @@ Since the client wants to make a new session, we call Fastcgipp::Http::Sessions:
 
 \code
 				session=sessions.generate(environment().posts["data"].value);
-				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				handleSession();
 			}
 			else
@@ -1324,7 +1312,7 @@ Content-Type: text/html; charset=ISO-8859-1\r\n\r\n\
 		<title>fastcgi++: Session Handling example</title>\n\
 	</head>\n\
 	<body>\n\
-		<p>We are currently in a session. The session id is " << session->first << " and the session data is \"" << encoding(HTML) << session->second << encoding(NONE) << "\". It will expire at " << sessions.getExpiry(session) << ".</p>\n\
+		<p>We are currently in a session. The session id is " << session->first << " and the session data is \"" << encoding(HTML) << session->second << encoding(NONE) << "\". It will expire at " << httpDate(sessions.getExpiry(session)) << ".</p>\n\
 		<p>Click <a href='?command=logout'>here</a> to logout</p>\n";
 	}
 
@@ -1413,13 +1401,11 @@ class Session: public Fastcgipp::Request<char>
 		
 		const std::string& command=environment().findGet("command");
 		
-		setloc(std::locale(getloc(), new boost::posix_time::time_facet("%a, %d-%b-%Y %H:%M:%S GMT")));
-
 		if(session!=sessions.end())
 		{
 			if(command=="logout")
 			{
-				out << "Set-Cookie: SESSIONID=deleted; expires=Thu, 01-Jan-1970 00:00:00 GMT;\n";
+				out << "Set-Cookie: SESSIONID=deleted; expires=Thu, 01 Jan 1970 00:00:00 GMT;\n";
 				sessions.erase(session);
 				session=sessions.end();
 				handleNoSession();
@@ -1427,7 +1413,7 @@ class Session: public Fastcgipp::Request<char>
 			else
 			{
 				session->first.refresh();
-				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				handleSession();
 			}
 		}
@@ -1436,7 +1422,7 @@ class Session: public Fastcgipp::Request<char>
 			if(command=="login")
 			{
 				session=sessions.generate(environment().findPost("data").value);
-				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				handleSession();
 			}
 			else
@@ -1462,7 +1448,7 @@ Content-Type: text/html; charset=ISO-8859-1\r\n\r\n\
 		<title>fastcgi++: Session Handling example</title>\n\
 	</head>\n\
 	<body>\n\
-		<p>We are currently in a session. The session id is " << session->first << " and the session data is \"" << encoding(HTML) << session->second << encoding(NONE) << "\". It will expire at " << sessions.getExpiry(session) << ".</p>\n\
+		<p>We are currently in a session. The session id is " << session->first << " and the session data is \"" << encoding(HTML) << session->second << encoding(NONE) << "\". It will expire at " << httpDate(sessions.getExpiry(session)) << ".</p>\n\
 		<p>Click <a href='?command=logout'>here</a> to logout</p>\n";
 	}
 
@@ -60,14 +60,10 @@ class Session: public Fastcgipp::Request<char>
 		{
 			case Fastcgipp::Protocol::RESPONDER:
 			{
-				// We need to call this to set a facet in our requests locale regarding how
-				// to format the date upon insertion. It needs to conform to the http standard.
-				setloc(std::locale(getloc(), new boost::posix_time::time_facet("%a, %d-%b-%Y %H:%M:%S GMT")));
-
 				if(session==sessions.end())
 				{
 					session=sessions.generate(0);
-					out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+					out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				}
 				else
 					session->first.refresh();
@@ -84,7 +80,7 @@ Content-Type: text/html; charset=ISO-8859-1\r\n\r\n\
 		<h1>fastcgi++: Authorizer Example</h1>\n\
 		<p>\n\
 			You are now authorized to view <a href='locked/locked.png'>the image</a> under the\n\
-			session ID " << session->first << " until " << sessions.getExpiry(session) << ".\n\
+			session ID " << session->first << " until " << httpDate(sessions.getExpiry(session)) << ".\n\
 		</p>\n\
 	</body>\n\
 </html>";
@@ -100,6 +96,9 @@ Content-Type: text/html; charset=ISO-8859-1\r\n\r\n\
 					out << "Status: 403 Forbidden\r\n\r\n";
 				break;
 			}
+
+			default:
+				break;
 		}
 		return true;
 	}
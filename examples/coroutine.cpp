@@ -0,0 +1,124 @@
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <fstream>
+#include <cstring>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <fastcgi++/corequest.hpp>
+#include <fastcgi++/manager.hpp>
+
+// This example does what the timer example does but as a coroutine, so it needs a compiler
+// supporting C++20. Fastcgipp::CoRequest keeps track of where we are for us, so no state
+// variable is needed and the response reads from top to bottom. As with the timer example,
+// you will only see the delays if you put the following directive in your apache
+// configuration: FastCgiConfig -flush
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+boost::asio::io_service io;
+
+// I like to have an independent error log file to keep track of exceptions while debugging.
+// You might want a different filename. I just picked this because everything has access there.
+void error_log(const char* msg)
+{
+	static std::ofstream error;
+	if(!error.is_open())
+	{
+		error.open("/tmp/errlog", std::ios_base::out | std::ios_base::app);
+		error.imbue(std::locale(error.getloc(), new boost::posix_time::time_facet()));
+	}
+
+	error << '[' << boost::posix_time::second_clock::local_time() << "] " << msg << std::endl;
+}
+
+// Let's make our request handling class. It must do the following:
+// 1) Be derived from Fastcgipp::CoRequest
+// 2) Define the virtual respond() coroutine from Fastcgipp::CoRequest
+
+class Coroutine: public Fastcgipp::CoRequest<char>
+{
+	// The timer has to outlive any suspension of the coroutine so it is kept as member data
+	boost::asio::deadline_timer t;
+
+public:
+	Coroutine(): t(io) {}
+
+private:
+	Response respond()
+	{
+		out << "Content-Type: text/html; charset=ISO-8859-1\r\n\r\n";
+		out << "<html><head><meta http-equiv='Content-Type' content='text/html; charset=ISO-8859-1' />";
+		out << "<title>fastcgi++: Coroutine</title></head><body>";
+		out << "Sleeping...<br />";
+		out.flush();
+
+		// Should all we need be a delay, sleep() has the manager wake us up. No thread or
+		// timer object of our own is involved.
+		co_await sleep(boost::posix_time::seconds(2));
+		out << "Starting timer...<br />";
+		out.flush();
+
+		// Anything that takes a completion callback can be waited on with async(). We are
+		// handed a Waker to pass on as the callback. Here boost::asio calls it from it's own
+		// thread once five seconds have passed.
+		t.expires_from_now(boost::posix_time::seconds(5));
+		co_await async(boost::bind(&Coroutine::startTimer, this, _1));
+		out << "Timer finished!<br />";
+
+		// Messages passed through callback() from other threads are received in order.
+		boost::thread(boost::bind(&Coroutine::sendMessage, callback())).detach();
+		Fastcgipp::Message msg=co_await receive();
+		out << "Our message data was \"" << msg.data.get() << "\"";
+		out << "</body></html>";
+
+		// Once the coroutine returns the request is complete
+	}
+
+	void startTimer(const Waker& waker)
+	{
+		t.async_wait(waker);
+	}
+
+	static void sendMessage(const boost::function<void(Fastcgipp::Message)>& callback)
+	{
+		const char cString[] = "I was passed between two threads!!";
+		Fastcgipp::Message msg(1, sizeof(cString));
+		std::memcpy(msg.data.get(), cString, sizeof(cString));
+		callback(msg);
+	}
+};
+
+// The main function is the same as in the timer example
+int main()
+{
+	try
+	{
+		boost::asio::io_service::work w(io);
+		boost::thread t(boost::bind(&boost::asio::io_service::run, &io));
+
+		Fastcgipp::Manager<Coroutine> fcgi;
+		fcgi.handler();
+	}
+	catch(std::exception& e)
+	{
+		error_log(e.what());
+	}
+}
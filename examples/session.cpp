@@ -59,15 +59,11 @@ class Session: public Fastcgipp::Request<char>
 		
 		const std::string& command=environment().findGet("command");
 		
-		// We need to call this to set a facet in our requests locale regarding how
-		// to format the date upon insertion. It needs to conform to the http standard.
-		setloc(std::locale(getloc(), new boost::posix_time::time_facet("%a, %d-%b-%Y %H:%M:%S GMT")));
-
 		if(session!=sessions.end())
 		{
 			if(command=="logout")
 			{
-				out << "Set-Cookie: SESSIONID=deleted; expires=Thu, 01-Jan-1970 00:00:00 GMT;\n";
+				out << "Set-Cookie: SESSIONID=deleted; expires=Thu, 01 Jan 1970 00:00:00 GMT;\n";
 				sessions.erase(session);
 				session=sessions.end();
 				handleNoSession();
@@ -75,7 +71,7 @@ class Session: public Fastcgipp::Request<char>
 			else
 			{
 				session->first.refresh();
-				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				handleSession();
 			}
 		}
@@ -84,7 +80,7 @@ class Session: public Fastcgipp::Request<char>
 			if(command=="login")
 			{
 				session=sessions.generate(environment().findPost("data").value);
-				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << sessions.getExpiry(session) << '\n';
+				out << "Set-Cookie: SESSIONID=" << encoding(URL) << session->first << encoding(NONE) << "; expires=" << httpDate(sessions.getExpiry(session)) << '\n';
 				handleSession();
 			}
 			else
@@ -114,7 +110,7 @@ Content-Type: text/html; charset=ISO-8859-1\r\n\r\n\
 		<title>fastcgi++: Session Handling example</title>\n\
 	</head>\n\
 	<body>\n\
-		<p>We are currently in a session. The session id is " << session->first << " and the session data is \"" << encoding(HTML) << session->second << encoding(NONE) << "\". It will expire at " << sessions.getExpiry(session) << ".</p>\n\
+		<p>We are currently in a session. The session id is " << session->first << " and the session data is \"" << encoding(HTML) << session->second << encoding(NONE) << "\". It will expire at " << httpDate(sessions.getExpiry(session)) << ".</p>\n\
 		<p>Click <a href='?command=logout'>here</a> to logout</p>\n";
 	}
 
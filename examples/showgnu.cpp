@@ -79,10 +79,6 @@ class ShowGnu: public Fastcgipp::Request<char>
 			etag = fileStat.st_ino;
 		}
 
-		// We need to call this to set a facet in our requests locale regarding how
-		// to format the date upon insertion. It needs to conform to the http standard.
-		setloc(locale(getloc(), new posix_time::time_facet("%a, %d %b %Y %H:%M:%S GMT")));
-
 		// If the modification time of the file is older or equal to the if-modified-since value
 		// sent to us from the client and we were actually sent an if-modified since value,
 		// we don't need to send the image to them.
@@ -97,7 +93,9 @@ class ShowGnu: public Fastcgipp::Request<char>
 
 		// Now we transmit our HTTP header to the client
 		// First we send the modification time of the file
-		out << "Last-Modified: " << modTime << '\n';
+		// Dates in HTTP headers need to conform to RFC 1123. The httpDate manipulator
+		// formats them that way without touching the locale.
+		out << "Last-Modified: " << Fastcgipp::httpDate(modTime) << '\n';
 		// Then a Etag. Note that the environment().etag is an integer value. NOT an std::string.
 		out << "Etag: " << etag << '\n';
 		// Next the size
@@ -109,7 +109,7 @@ private:
 					char cString[] = "I was passed between two threads!!";
 					msg.size=sizeof(cString);
 					msg.data.reset(new char[sizeof(cString)]);
-					std::strncpy(msg.data.get(), cString, sizeof(cString));
+					std::memcpy(msg.data.get(), cString, sizeof(cString));
 				}
 
 				// Now we will give our callback data to boost::asio
@@ -129,6 +129,17 @@ namespace ASql
 		virtual void commit(const unsigned int thread=0)=0;
 		virtual void rollback(const unsigned int thread=0)=0;
 
+		//! Stop the query a thread is executing on the server
+		/*!
+		 * Called from a thread of it's own when a query being executed is cancelled. The default
+		 * does nothing, leaving the query to run to completion.
+		 */
+		virtual void interrupt(const unsigned int thread) { (void)thread; }
+		//! Called from the interrupter thread before it first calls interrupt()
+		virtual void initInterrupter() { }
+		//! Called from the interrupter thread once it is done calling interrupt()
+		virtual void cleanupInterrupter() { }
+
 		boost::scoped_array<boost::condition_variable> wakeUp;
 
 		boost::mutex terminateMutex;
@@ -147,8 +158,8 @@ namespace ASql
 		{
 			QuerySet(QueryPar& query, T* const& statement, const bool commit): m_query(query), m_statement(statement), m_commit(commit) {}
 			QueryPar m_query;
-			bool m_commit;
 			T* m_statement;
+			bool m_commit;
 		};
 		/** 
 		 * @brief Thread safe queue of queries.
@@ -161,6 +172,39 @@ namespace ASql
 		 */
 		void intHandler(const unsigned int id);
 
+		//! Function that runs in the interrupter thread
+		void intInterrupter();
+
+		//! Tells the queries executed by a thread apart
+		struct Running: public boost::mutex
+		{
+			Running(): sequence(0), interrupting(false) {}
+			//! Incremented when the thread starts executing a query and when it finishes
+			unsigned int sequence;
+			//! True while the query with the current sequence is being interrupted
+			/*!
+			 * The thread doesn't start another query until this is false so an interruption
+			 * can't hit the wrong one.
+			 */
+			bool interrupting;
+			//! Signalled once interrupting is set back to false
+			boost::condition_variable interrupted;
+		};
+		boost::scoped_array<Running> running;
+
+		//! Thread safe queue of queries to interrupt, identified by thread and sequence
+		class Interrupts: public std::queue<std::pair<unsigned int, unsigned int> >, public boost::mutex
+		{
+		public:
+			boost::condition_variable wakeUp;
+			bool stop;
+		};
+		Interrupts interrupts;
+		boost::thread interrupter;
+
+		//! Queue the interruption of a query. Called through QueryPar::cancel().
+		void queueInterrupt(const unsigned int id, const unsigned int sequence);
+
 		/** 
 		 * @brief Locks the mutex on a statement and set's the canceller to the queries canceller
 		 */
@@ -173,7 +217,7 @@ namespace ASql
 		};
 
 	protected:
-		ConnectionPar(const int maxThreads_): Connection(maxThreads_), queries(new Queries[maxThreads_]) {}
+		ConnectionPar(const int maxThreads_): Connection(maxThreads_), queries(new Queries[maxThreads_]), running(new Running[maxThreads_]) {}
 	public:
 		//! Returns the number of queued queries
 		int queriesSize() const; 
@@ -223,6 +267,12 @@ template<class T> void ASql::ConnectionPar<T>::start()
 		boost::thread(boost::bind(&ConnectionPar<T>::intHandler, boost::ref(*this), m_threads));
 		threadsChanged.wait(threadsLock);
 	}
+
+	if(!interrupter.joinable())
+	{
+		interrupts.stop=false;
+		interrupter=boost::thread(boost::bind(&ConnectionPar<T>::intInterrupter, boost::ref(*this)));
+	}
 }
 
 template<class T> void ASql::ConnectionPar<T>::terminate()
@@ -237,6 +287,66 @@ template<class T> void ASql::ConnectionPar<T>::terminate()
 	boost::unique_lock<boost::mutex> threadsLock(threadsMutex);
 	while(m_threads)
 		threadsChanged.wait(threadsLock);
+	threadsLock.unlock();
+
+	{
+		boost::lock_guard<boost::mutex> interruptsLock(interrupts);
+		interrupts.stop=true;
+	}
+	interrupts.wakeUp.notify_one();
+	if(interrupter.joinable())
+		interrupter.join();
+}
+
+template<class T> void ASql::ConnectionPar<T>::intInterrupter()
+{
+	initInterrupter();
+	boost::unique_lock<boost::mutex> interruptsLock(interrupts);
+
+	while(1)
+	{
+		while(interrupts.empty() && !interrupts.stop)
+			interrupts.wakeUp.wait(interruptsLock);
+		if(interrupts.stop)
+			break;
+		const std::pair<unsigned int, unsigned int> query=interrupts.front();
+		interrupts.pop();
+		interruptsLock.unlock();
+
+		Running& thread=running[query.first];
+		bool current;
+		{
+			boost::lock_guard<boost::mutex> runningLock(thread);
+			current = thread.sequence==query.second;
+			if(current)
+				thread.interrupting=true;
+		}
+
+		// The round trip to the server is made without holding up the thread
+		if(current)
+		{
+			interrupt(query.first);
+			{
+				boost::lock_guard<boost::mutex> runningLock(thread);
+				thread.interrupting=false;
+			}
+			thread.interrupted.notify_all();
+		}
+
+		interruptsLock.lock();
+	}
+
+	interruptsLock.unlock();
+	cleanupInterrupter();
+}
+
+template<class T> void ASql::ConnectionPar<T>::queueInterrupt(const unsigned int id, const unsigned int sequence)
+{
+	{
+		boost::lock_guard<boost::mutex> interruptsLock(interrupts);
+		interrupts.push(std::make_pair(id, sequence));
+	}
+	interrupts.wakeUp.notify_one();
 }
 
 template<class T> void ASql::ConnectionPar<T>::intHandler(const unsigned int id)
@@ -268,6 +378,18 @@ template<class T> void ASql::ConnectionPar<T>::intHandler(const unsigned int id)
 		queries[id].pop();
 		queriesLock.unlock();
 
+		{
+			boost::unique_lock<boost::mutex> runningLock(running[id]);
+			// An interruption of the previous query must not hit this one
+			while(running[id].interrupting)
+				running[id].interrupted.wait(runningLock);
+			++running[id].sequence;
+		}
+		{
+			boost::lock_guard<boost::mutex> interruptLock(querySet.m_query.m_sharedData->m_interruptMutex);
+			querySet.m_query.m_sharedData->m_interrupt=boost::bind(&ConnectionPar<T>::queueInterrupt, boost::ref(*this), id, running[id].sequence);
+		}
+
 		Error error;
 
 		try
@@ -311,6 +433,15 @@ template<class T> void ASql::ConnectionPar<T>::intHandler(const unsigned int id)
 			queriesLock.unlock();
 		}
 
+		{
+			boost::lock_guard<boost::mutex> interruptLock(querySet.m_query.m_sharedData->m_interruptMutex);
+			querySet.m_query.m_sharedData->m_interrupt.clear();
+		}
+		{
+			boost::lock_guard<boost::mutex> runningLock(running[id]);
+			++running[id].sequence;
+		}
+
 		querySet.m_query.callback();
 	}
 
@@ -326,7 +457,7 @@ template<class T> void ASql::ConnectionPar<T>::queue(T* const& statement, QueryP
 	if(instance == -1)
 	{
 		instance=0;
-		for(unsigned int i=1; i<threads(); ++i)
+		for(int i=1; i<threads(); ++i)
 		{{
 			boost::lock_guard<boost::mutex> queriesLock(queries[i]);
 			if(queries[i].size() < queries[instance].size())
@@ -346,7 +477,7 @@ template<class T> void ASql::ConnectionPar<T>::queue(Transaction<T>& transaction
 	if(instance == -1)
 	{
 		instance=0;
-		for(unsigned int i=1; i<threads(); ++i)
+		for(int i=1; i<threads(); ++i)
 		{{
 			boost::lock_guard<boost::mutex> queriesLock(queries[i]);
 			if(queries[i].size() < queries[instance].size())
@@ -372,7 +503,7 @@ template<class T> void ASql::Transaction<T>::cancel()
 template<class T> int ASql::ConnectionPar<T>::queriesSize() const
 {
 	int size=0;
-	for(unsigned int i=1; i<threads(); ++i)
+	for(int i=1; i<threads(); ++i)
 	{{
 		boost::lock_guard<boost::mutex> queriesLock(queries[i]);
 		size += queries[i].size();
@@ -56,6 +56,12 @@ namespace ASql
 			 */
 			boost::scoped_array<MYSQL_BIND> foundRowsBinding;
 
+			//! %MySQL thread id of each connection, used to interrupt it's queries.
+			boost::scoped_array<unsigned long> threadIds;
+
+			//! Separate connection to issue KILL QUERY through. Only used by the interrupter thread.
+			MYSQL interruptConnection;
+
 			bool m_initialized;
 
 		public:
@@ -73,7 +79,7 @@ namespace ASql
 			 * \param[in] threads_ Number of threads to have for simultaneous queries. The higher this number is the more concurrent
 			 * SQL requeries can be processed.
 			 */
-			Connection(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset="latin1", const int threads_=1): ConnectionPar<MySQL::Statement>(threads_), m_initialized(false)
+			Connection(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset="latin1", const int threads_=1): ConnectionPar<MySQL::Statement>(threads_), threadIds(new unsigned long[threads_]), m_initialized(false)
 			{
 				connect(host, user, passwd, db, port, unix_socket, client_flag, charset);
 			}
@@ -89,6 +95,7 @@ namespace ASql
 				m_connection(new MYSQL[threads_]),
 				foundRowsStatement(new MYSQL_STMT*[threads_]),
 				foundRowsBinding(new MYSQL_BIND[threads_]),
+				threadIds(new unsigned long[threads_]),
 				m_initialized(false) {}
 			~Connection();
 
@@ -117,6 +124,17 @@ namespace ASql
 
 			inline void commit(const unsigned int thread=0)	{ mysql_commit(&m_connection[thread]); }
 			inline void rollback(const unsigned int thread=0)	{ mysql_rollback(&m_connection[thread]); }
+
+			//! Stop the query a thread is executing with KILL QUERY
+			/*!
+			 * The interrupt connection may have sat idle long enough for the server to drop it
+			 * so it is pinged first, which reconnects it if need be.
+			 */
+			void interrupt(const unsigned int thread);
+			//! Register the interrupter thread with the %MySQL client library
+			void initInterrupter() { mysql_thread_init(); }
+			//! Release what the %MySQL client library holds for the interrupter thread
+			void cleanupInterrupter() { mysql_thread_end(); }
 		};
 
 		//! %MySQL query statement.
@@ -157,9 +175,9 @@ namespace ASql
 				ASql::Statement(connection_.threads()),
 				connection(connection_),
 				stmt(new MYSQL_STMT*[connection_.threads()]),
-				m_initialized(false),
 				paramsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
 				resultsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
+				m_initialized(false),
 				m_stop(new const bool*[connection_.threads()])
 			{
 				init(queryString, queryLength, parameterSet, resultSet);
@@ -173,9 +191,9 @@ namespace ASql
 				ASql::Statement(connection_.threads()),
 				connection(connection_),
 				stmt(new MYSQL_STMT*[connection_.threads()]),
-				m_initialized(false),
 				paramsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
 				resultsBindings(new boost::scoped_array<MYSQL_BIND>[connection_.threads()]),
+				m_initialized(false),
 				m_stop(new const bool*[connection_.threads()]) {}
 
 			~Statement();
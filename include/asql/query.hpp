@@ -86,6 +86,11 @@ namespace ASql
 			//! If set true the query should cancel when the opportunity arises.
 			bool m_cancel;
 
+			//! Interrupts the query on the server. Only set while the query is executing.
+			boost::function<void()> m_interrupt;
+
+			boost::mutex m_interruptMutex;
+
 			//! flags for the shared data
 			/*! 
 			 * FLAG_SINGLE_RESULTS: This means that the data pointed to be m_results is a Data::Set
@@ -296,9 +301,18 @@ namespace ASql
 		//! Call this function to cancel the query.
 		/*! 
 		 * This will cancel the query at the earliest opportunity. Calling a
-		 * cancel will rollback any changes in the associated transaction.
+		 * cancel will rollback any changes in the associated transaction. Should
+		 * the query be executing, the connection is also asked to interrupt it on
+		 * the server. That happens in a thread of the connection so this never
+		 * waits on the server.
 		 */
-		void cancel() { m_sharedData->m_cancel = true; }
+		void cancel()
+		{
+			m_sharedData->m_cancel = true;
+			boost::lock_guard<boost::mutex> lock(m_sharedData->m_interruptMutex);
+			if(!m_sharedData->m_interrupt.empty())
+				m_sharedData->m_interrupt();
+		}
 
 		//! Call this function to enable the retrieval of a row count (affected/available rows)
 		void enableRows()
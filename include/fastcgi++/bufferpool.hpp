@@ -0,0 +1,106 @@
+//! \file bufferpool.hpp Defines the Fastcgipp::BufferPool class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include <boost/shared_array.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Size class pool for the raw data of Message objects
+	/*!
+	 * Buffers handed out by this class are rounded up to one of a fixed set of size
+	 * classes and, once the last boost::shared_array referencing them is destroyed,
+	 * returned to a cache belonging to the thread that allocated them. The next
+	 * allocation of the same size class from that thread is then served without
+	 * touching the heap. The reference count blocks of the returned boost::shared_array
+	 * objects are recycled the same way.
+	 *
+	 * Buffers released by another thread than the one that allocated them, as when
+	 * worker threads finish with records read by the I/O thread, are handed back to the
+	 * allocating thread through a lock free list it takes over once it's cache is empty.
+	 *
+	 * The size classes are chosen to fit FastCGI records: the small ones hold PARAMS
+	 * and management records while the larger ones hold full STDIN records of up to
+	 * 64KB plus padding. Requests for more than the largest size class are passed
+	 * straight through to the heap.
+	 *
+	 * Each thread only retains a bounded amount of memory per size class. Anything
+	 * released past that bound is freed. The cache of a thread that exits is emptied
+	 * and taken over by the next thread to allocate.
+	 */
+	class BufferPool
+	{
+	public:
+		//! Allocate a buffer of at least the specified size
+		/*!
+		 * The contents of the buffer are not initialized.
+		 *
+		 * @param[in] size Minimum size in bytes of the buffer
+		 * @return Shared pointer to the buffer. Releasing the last copy returns it to the pool.
+		 */
+		static boost::shared_array<char> allocate(size_t size);
+
+		//! Hit and miss counts for a single size class
+		struct Statistics
+		{
+			//! Size in bytes of buffers in this class. Zero means allocations too large for any class.
+			size_t size;
+			//! Allocations served from a thread cache
+			unsigned long long hits;
+			//! Allocations that had to go to the heap
+			unsigned long long misses;
+			//! Buffers freed because the allocating thread's cache was full
+			unsigned long long overflows;
+
+			//! Fraction of allocations in this class served from a thread cache
+			double hitRate() const { return hits+misses? double(hits)/double(hits+misses): 0; }
+		};
+
+		//! Turn on or off the collection of statistics
+		/*!
+		 * Statistics collection is off by default as it adds a shared counter update to
+		 * every allocation and release.
+		 *
+		 * @param[in] enable True to start counting, false to stop
+		 */
+		static void enableStatistics(bool enable);
+
+		//! Retrieve the statistics collected so far
+		/*!
+		 * One entry is returned for each size class, in increasing order of size,
+		 * followed by one entry with a size of zero for oversized allocations.
+		 */
+		static std::vector<Statistics> statistics();
+
+		//! Reset all collected statistics to zero
+		static void resetStatistics();
+
+		//! Free every buffer cached by the calling thread, including those other threads have handed back
+		static void trim();
+	};
+}
+
+#endif
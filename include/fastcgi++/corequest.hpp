@@ -0,0 +1,391 @@
+//! \file corequest.hpp Defines the Fastcgipp::CoRequest class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#ifndef COREQUEST_HPP
+#define COREQUEST_HPP
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <climits>
+#include <queue>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/request.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! %Request handling class with a coroutine as response
+	/*!
+	 * Rather than response() having to return false and be called again once whatever
+	 * it waits on has sent a Message through callback(), derivations of this class
+	 * define respond() as a C++20 coroutine that suspends with co_await and carries on
+	 * where it left off. The coroutine is resumed directly from the handler() call the
+	 * awaited Message is delivered to, on whatever thread the Manager handles the
+	 * request in.
+	 *
+	 * \code
+	 * Response respond()
+	 * {
+	 * 	co_await this->query(statement, query);
+	 * 	out << "Content-Type: text/plain\r\n\r\n" << query.rows() << " rows";
+	 * 	Message result=co_await receive();
+	 * 	out << " and a message of type " << result.type;
+	 * }
+	 * \endcode
+	 *
+	 * @tparam charT Character type for internal processing (wchar_t or char)
+	 */
+	template<class charT> class CoRequest: public Request<charT>
+	{
+		//! Passes wake ups to the request for as long as it's coroutine runs
+		/*!
+		 * Wakers share ownership of this rather than referencing the request itself so one
+		 * called after the request is destroyed or has moved on does nothing.
+		 */
+		struct Link: public boost::mutex
+		{
+			Link(CoRequest* request_): request(request_), refCount(0) { }
+			//! The request to wake. Null once it no longer wants waking.
+			CoRequest* request;
+			boost::atomic<unsigned int> refCount;
+			friend void intrusive_ptr_add_ref(Link* link) { link->refCount.fetch_add(1, boost::memory_order_relaxed); }
+			friend void intrusive_ptr_release(Link* link)
+			{
+				if(link->refCount.fetch_sub(1, boost::memory_order_acq_rel)==1)
+					delete link;
+			}
+		};
+
+	public:
+		//! Message type reserved for waking the coroutine
+		static const int wakeMessage=INT_MIN;
+
+		//! Return type of respond()
+		class Response
+		{
+		public:
+			struct promise_type
+			{
+				Response get_return_object() { return Response(std::coroutine_handle<promise_type>::from_promise(*this)); }
+				//! The coroutine starts once response() is first called
+				std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+				//! The coroutine is destroyed by it's Response
+				std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+				void return_void() { }
+				void unhandled_exception() { exception=std::current_exception(); }
+				//! Exception that escaped the coroutine
+				std::exception_ptr exception;
+			};
+
+			Response(): handle(0) { }
+			Response(Response&& x): handle(x.handle) { x.handle=0; }
+			Response& operator=(Response&& x) { std::swap(handle, x.handle); return *this; }
+			~Response() { if(handle) handle.destroy(); }
+
+		private:
+			friend class CoRequest;
+			explicit Response(std::coroutine_handle<promise_type> handle_): handle(handle_) { }
+			std::coroutine_handle<promise_type> handle;
+		};
+
+		//! Callable that resumes a coroutine suspended on async() or query()
+		/*!
+		 * Calling it from any thread, with any arguments, sends a Message of type wakeMessage
+		 * through the request's callback(). Copying it never allocates so it fits in the small
+		 * object buffer of a boost::function.
+		 */
+		class Waker
+		{
+		public:
+			template<class... Args> void operator()(Args&&...) const
+			{
+				boost::lock_guard<boost::mutex> linkLock(*m_link);
+				if(m_link->request)
+					m_link->request->callback()(Message(wakeMessage));
+			}
+		private:
+			friend class CoRequest;
+			explicit Waker(Link* link): m_link(link) { }
+			boost::intrusive_ptr<Link> m_link;
+		};
+
+		//! Initializes what it can. set() must be called by Manager before the data is usable.
+		/*!
+		 * \param maxPostSize This would be the maximum size you want to allow for
+		 * post data. Any data beyond this size would result in a call to
+		 * bigPostErrorHandler(). A value of 0 represents unlimited.
+		 */
+		CoRequest(const size_t maxPostSize=0): Request<charT>(maxPostSize), waiting(NOTHING), link(0), registered(false) { }
+		~CoRequest() { finish(); }
+
+	protected:
+		//! Response generator
+		/*!
+		 * This coroutine is started once all request data has been received from the other
+		 * side. The response is complete once it returns.
+		 */
+		virtual Response respond() =0;
+
+		//! Awaitable that resumes with the next Message passed through callback()
+		/*!
+		 * Messages that arrive while the coroutine waits on something else are kept and
+		 * handed out in order.
+		 */
+		class Receive
+		{
+		public:
+			bool await_ready() const { return !request.received.empty(); }
+			void await_suspend(std::coroutine_handle<>) { request.waiting=MESSAGE; }
+			Message await_resume()
+			{
+				Message message;
+				message.swap(request.received.front());
+				request.received.pop();
+				return message;
+			}
+		private:
+			friend class CoRequest;
+			explicit Receive(CoRequest& request_): request(request_) { }
+			CoRequest& request;
+		};
+		//! Wait for the next Message passed through callback()
+		Receive receive() { return Receive(*this); }
+
+		//! Awaitable that starts an asynchronous operation and resumes once it calls it's Waker
+		template<class Start> class Async
+		{
+		public:
+			bool await_ready() const { return false; }
+			void await_suspend(std::coroutine_handle<>)
+			{
+				request.waiting=WAKE;
+				start(request.waker());
+			}
+			void await_resume() const { }
+		private:
+			friend class CoRequest;
+			Async(CoRequest& request_, const Start& start_): request(request_), start(start_) { }
+			CoRequest& request;
+			Start start;
+		};
+		//! Wait on any asynchronous operation that takes a completion callback
+		/*!
+		 * The function passed is called with a Waker once the coroutine is suspended. It
+		 * should hand the Waker to whatever is to call back on completion, e.g. a
+		 * boost::asio timer's async_wait().
+		 *
+		 * @param[in] start Function starting the operation
+		 */
+		template<class Start> Async<Start> async(const Start& start) { return Async<Start>(*this, start); }
+
+		//! Starts an ASql query
+		template<class Statement, class Query> struct StartQuery
+		{
+			void operator()(const Waker& waker) const
+			{
+				query.setCallback(waker);
+				request.setQueryCanceller(boost::bind(&Query::cancel, query));
+				statement.queue(query);
+			}
+			CoRequest& request;
+			Statement& statement;
+			Query& query;
+		};
+		//! Queue an ASql query and wait for it to complete
+		/*!
+		 * The query's callback is replaced. Errors and cancellation are checked on the query
+		 * once the coroutine is resumed, as they would be in the callback. The query is
+		 * cancelled should the request be.
+		 *
+		 * @param[in] statement Statement to queue the query on
+		 * @param[in] query The query
+		 */
+		template<class Statement, class Query> Async<StartQuery<Statement, Query> > query(Statement& statement, Query& query)
+		{
+			const StartQuery<Statement, Query> start={ *this, statement, query };
+			return Async<StartQuery<Statement, Query> >(*this, start);
+		}
+
+		//! Awaitable that resumes once a delay has passed
+		class Sleep
+		{
+		public:
+			bool await_ready() const { return false; }
+			void await_suspend(std::coroutine_handle<>)
+			{
+				request.waiting=WAKE;
+				request.wakeAfter(delay, Message(wakeMessage));
+			}
+			void await_resume() const { }
+		private:
+			friend class CoRequest;
+			Sleep(CoRequest& request_, const boost::posix_time::time_duration& delay_): request(request_), delay(delay_) { }
+			CoRequest& request;
+			boost::posix_time::time_duration delay;
+		};
+		//! Wait for a delay to pass
+		/*!
+		 * This uses the timer behind Request::wakeAfter() so it replaces any wake up set through that.
+		 *
+		 * @param[in] delay Time to wait
+		 */
+		Sleep sleep(const boost::posix_time::time_duration& delay) { return Sleep(*this, delay); }
+
+		//! Destroy a coroutine the request didn't complete with
+		/*!
+		 * A request may complete without its coroutine having returned, e.g. once its deadline
+		 * passes. Derivations overriding this should call it.
+		 */
+		virtual void reset() { finish(); }
+
+	private:
+		//! What the coroutine is suspended on
+		enum Waiting { NOTHING, MESSAGE, WAKE } waiting;
+
+		//! The running coroutine
+		Response coroutine;
+
+		//! Messages not yet retrieved through receive()
+		std::queue<Message> received;
+
+		//! Shared with Wakers handed out since the coroutine started
+		Link* link;
+
+		//! Cancels the ASql query the coroutine is suspended on
+		/*!
+		 * It holds on to the query only until the coroutine resumes so completed queries,
+		 * and their data, aren't kept alive by the request.
+		 */
+		struct QueryCanceller: public boost::function<void()>, public boost::mutex {} queryCanceller;
+
+		//! True once cancelQuery() is registered through Request::onCancel()
+		bool registered;
+
+		//! Have a query cancelled should the request be before the coroutine resumes
+		void setQueryCanceller(const boost::function<void()>& canceller)
+		{
+			boost::lock_guard<boost::mutex> lock(queryCanceller);
+			static_cast<boost::function<void()>&>(queryCanceller)=canceller;
+			if(!registered)
+			{
+				registered=true;
+				this->onCancel(boost::bind(&CoRequest::cancelQuery, this));
+			}
+		}
+
+		//! Cancel the query being waited on if any
+		void cancelQuery()
+		{
+			boost::function<void()> canceller;
+			{
+				boost::lock_guard<boost::mutex> lock(queryCanceller);
+				// Request::cancel() drops what was registered
+				registered=false;
+				canceller.swap(queryCanceller);
+			}
+			if(canceller)
+				canceller();
+		}
+
+		//! A Waker for the running coroutine
+		Waker waker()
+		{
+			if(!link)
+			{
+				link=new Link(this);
+				intrusive_ptr_add_ref(link);
+			}
+			return Waker(link);
+		}
+
+		//! Start or resume the coroutine
+		bool response()
+		{
+			const Message& message=Request<charT>::message();
+
+			if(!coroutine.handle)
+			{
+				coroutine=respond();
+				waiting=NOTHING;
+			}
+			else if(message.type==wakeMessage)
+			{
+				// A wake up left over from a previous operation
+				if(waiting!=WAKE)
+					return false;
+
+				// Whatever was waited on is done with
+				boost::lock_guard<boost::mutex> lock(queryCanceller);
+				queryCanceller.clear();
+			}
+			else
+			{
+				received.push(message);
+				if(waiting!=MESSAGE)
+					return false;
+			}
+
+			waiting=NOTHING;
+			coroutine.handle.resume();
+
+			if(!coroutine.handle.done())
+				return false;
+
+			const std::exception_ptr exception(coroutine.handle.promise().exception);
+			finish();
+			if(exception)
+				std::rethrow_exception(exception);
+			return true;
+		}
+
+		//! Destroy the coroutine and make sure no Waker handed out reaches us anymore
+		void finish()
+		{
+			if(link)
+			{
+				{
+					boost::lock_guard<boost::mutex> linkLock(*link);
+					link->request=0;
+				}
+				intrusive_ptr_release(link);
+				link=0;
+			}
+			coroutine=Response();
+			waiting=NOTHING;
+			received=std::queue<Message>();
+			boost::lock_guard<boost::mutex> lock(queryCanceller);
+			queryCanceller.clear();
+		}
+	};
+}
+
+#endif
+
+#endif
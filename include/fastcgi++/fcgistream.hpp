@@ -23,11 +23,15 @@
 #define FCGISTREAM_HPP
 
 #include <iosfwd>
+#include <cstring>
+#include <string>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/categories.hpp>
 #include <boost/iostreams/concepts.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <fastcgi++/protocol.hpp>
+#include <fastcgi++/format.hpp>
 #include <fastcgi++/transceiver.hpp>
 
 //! Topmost namespace for the fastcgi++ library
@@ -165,20 +169,105 @@ namespace Fastcgipp
 	 * 		<td>\%25</td>
 	 * 	</tr>
 	 * </table>
+	 *
+	 * <b>JSON</b> escapes text for use inside a JSON string. &quot; and \\ are
+	 * preceded by a backslash, \\b, \\f, \\n, \\r and \\t get their short escapes and
+	 * every other control character as well as &lt;, &gt; and &amp; become \\u00XX.
+	 * The latter keeps the string from ending a surrounding script element.
+	 *
+	 * <b>HTML_ATTRIBUTE</b> escapes text for use as an attribute value, quoted or
+	 * not. Every ASCII character other than letters and digits becomes &amp;\#xHH;.
+	 *
+	 * <b>URI_COMPONENT</b> escapes text for use as a component of a URI as per RFC
+	 * 3986. Every byte of the UTF-8 form of the text other than letters, digits, -,
+	 * ., _ and ~ becomes \%XX.
+	 */
+	enum OutputEncoding {NONE, HTML, URL, JSON, HTML_ATTRIBUTE, URI_COMPONENT};
+
+	class RecordWriter;
+
+	//! Stream manipulator for inserting a number without locale facets
+	/*!
+	 * Inserting numbers into a stream goes through the num_put facet of it's locale.
+	 * This formats them with the functions in Fastcgipp::Format instead.
+	 *
+	 * \code Fastcgipp::Request::out << "Content-Length: " << Fastcgipp::number(size) << "\r\n"; \endcode
+	 *
+	 * Integers are always written in decimal and floating point numbers as %g with the
+	 * precision of the stream. Width, fill and the other formatting flags are ignored.
+	 */
+	class number
+	{
+	public:
+		number(int value): m_type(SIGNED), m_signed(value) { }
+		number(long value): m_type(SIGNED), m_signed(value) { }
+		number(long long value): m_type(SIGNED), m_signed(value) { }
+		number(unsigned int value): m_type(UNSIGNED), m_unsigned(value) { }
+		number(unsigned long value): m_type(UNSIGNED), m_unsigned(value) { }
+		number(unsigned long long value): m_type(UNSIGNED), m_unsigned(value) { }
+		number(double value): m_type(FLOATING), m_floating(value) { }
+
+		//! Format the number
+		/*!
+		 * @param[in] precision Significant digits of a floating point number
+		 * @param[out] destination Where to write it. Must have room for Format::maxFloatingSize bytes.
+		 * @return Amount of bytes written
+		 */
+		size_t format(int precision, char* destination) const;
+
+	private:
+		enum { SIGNED, UNSIGNED, FLOATING } m_type;
+		union
+		{
+			long long m_signed;
+			unsigned long long m_unsigned;
+			double m_floating;
+		};
+	};
+
+	//! Stream manipulator for inserting an RFC 1123 date as HTTP headers want it
+	/*!
+	 * Use this in place of imbuing the stream with a time_facet.
+	 *
+	 * \code Fastcgipp::Request::out << "Last-Modified: " << Fastcgipp::httpDate(modTime) << "\r\n"; \endcode
+	 *
+	 * @sa Format::httpDate()
 	 */
-	enum OutputEncoding {NONE, HTML, URL};
+	struct httpDate
+	{
+		std::time_t m_time;
+		httpDate(std::time_t time): m_time(time) { }
+		//! Special values like not_a_date_time are taken as the epoch
+		httpDate(const boost::posix_time::ptime& time): m_time(time.is_special()?0:(time-boost::posix_time::from_time_t(0)).total_seconds()) { }
+	};
+
+	template<class charT, class Traits> std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>& os, const number& value);
+	template<class charT, class Traits> std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>& os, const httpDate& date);
 
 	//! Encapsulates data into FastCGI records to be sent back to the web server
 	class FcgistreamSink: public boost::iostreams::device<boost::iostreams::output, char>
 	{
 	private:
+		friend class RecordWriter;
 		Protocol::FullId m_id;
 		Protocol::RecordType m_type;
 		Transceiver* m_transceiver;
+		//! Amount of content bytes secured since set() was called
+		size_t m_written;
+	protected:
+		//! Fill in the header and padding of a record and secure it in the transceiver
+		/*!
+		 * @param[in] record Start of the record in space given by Transceiver::requestWrite()
+		 * @param[in] contentLength Amount of bytes of content following the header
+		 */
+		void secureRecord(char* record, uint16_t contentLength);
+		Transceiver& transceiver() { return *m_transceiver; }
 	public:
 		std::streamsize write(const char* s, std::streamsize n);
 
-		void set(Protocol::FullId id, Transceiver &transceiver, Protocol::RecordType type) {m_id=id, m_type=type, m_transceiver=&transceiver;}
+		void set(Protocol::FullId id, Transceiver &transceiver, Protocol::RecordType type) {m_id=id, m_type=type, m_transceiver=&transceiver, m_written=0;}
+		//! Amount of content bytes secured in the transceiver since set() was called
+		size_t written() const { return m_written; }
 		void dump(const char* data, size_t size) { write(data, size); }
 		void dump(std::basic_istream<char>& stream);
 
@@ -201,6 +290,123 @@ namespace Fastcgipp
 		}
 	};
 
+	//! Writes bytes straight into FastCGI records
+	/*!
+	 * Obtained through Fcgistream::writer(). Rather than going through the stream
+	 * buffer, filters and FcgistreamSink, data is written into the write space of the
+	 * Transceiver where a record is opened with room left for it's header. The header
+	 * is only filled in once the record is committed, which happens when it is full,
+	 * when commit() is called and when the writer is destroyed.
+	 *
+	 * No output encoding or code conversion takes place. The writer must be committed
+	 * or destroyed before the stream it came from, or anything else writing on the
+	 * same thread, is used again.
+	 *
+	 * \code
+	 * Fastcgipp::RecordWriter writer(out.writer());
+	 * writer << "Content-Type: text/plain\r\n\r\n";
+	 * for(std::vector<std::string>::const_iterator it=names.begin(); it!=names.end(); ++it)
+	 * 	writer << *it << '\n';
+	 * \endcode
+	 */
+	class RecordWriter
+	{
+	public:
+		//! Most bytes reserve() can be asked for
+		/*!
+		 * The Transceiver always has space for a record with this much content.
+		 */
+		const static size_t maxReserve=128;
+
+		explicit RecordWriter(FcgistreamSink& sink): m_sink(sink), m_record(0), m_position(0), m_end(0) { }
+		//! Takes over the open record of another writer
+		RecordWriter(const RecordWriter& x): m_sink(x.m_sink), m_record(x.m_record), m_position(x.m_position), m_end(x.m_end) { x.m_record=0; }
+		~RecordWriter() { secure(); }
+
+		//! Get room to write into directly
+		/*!
+		 * The bytes written are only kept once advance() is called.
+		 *
+		 * @param[in] size Amount of bytes needed. At most maxReserve.
+		 * @return Pointer to the room
+		 */
+		char* reserve(size_t size)
+		{
+			if(size_t(m_end-m_position)<size || !m_record)
+				open();
+			return m_position;
+		}
+		//! Keep bytes written to room from reserve()
+		void advance(size_t size) { m_position+=size; }
+
+		//! Write a block of bytes
+		void write(const char* data, size_t size);
+
+		//! Characters, like a narrow stream would, are written as is
+		RecordWriter& operator<<(char c) { *reserve(1)=c; advance(1); return *this; }
+		RecordWriter& operator<<(signed char c) { return *this << char(c); }
+		RecordWriter& operator<<(unsigned char c) { return *this << char(c); }
+		RecordWriter& operator<<(const char* string) { write(string, std::strlen(string)); return *this; }
+		RecordWriter& operator<<(char* string) { return *this << (const char*)string; }
+		RecordWriter& operator<<(const std::string& string) { write(string.data(), string.size()); return *this; }
+		//! Written as 1 or 0 as a new stream would
+		RecordWriter& operator<<(bool value) { return *this << (value?'1':'0'); }
+		RecordWriter& operator<<(short value) { return *this << (long long)value; }
+		RecordWriter& operator<<(unsigned short value) { return *this << (unsigned long long)value; }
+		RecordWriter& operator<<(int value) { return *this << (long long)value; }
+		RecordWriter& operator<<(long value) { return *this << (long long)value; }
+		RecordWriter& operator<<(long long value) { advance(Format::integer(value, reserve(Format::maxIntegerSize))); return *this; }
+		RecordWriter& operator<<(unsigned int value) { return *this << (unsigned long long)value; }
+		RecordWriter& operator<<(unsigned long value) { return *this << (unsigned long long)value; }
+		RecordWriter& operator<<(unsigned long long value) { advance(Format::integer(value, reserve(Format::maxIntegerSize))); return *this; }
+		//! Written as %g with six significant digits as a new stream would
+		RecordWriter& operator<<(double value) { advance(Format::floating(value, 6, reserve(Format::maxFloatingSize))); return *this; }
+		RecordWriter& operator<<(float value) { return *this << double(value); }
+		RecordWriter& operator<<(const httpDate& date) { advance(Format::httpDate(date.m_time, reserve(Format::httpDateSize))); return *this; }
+
+		//! Secure what has been written so far in the transceiver
+		void commit() { secure(); m_sink.throwExceptionWhenTransceiverFailed(); }
+
+	private:
+		FcgistreamSink& m_sink;
+		//! Start of the open record. Null if there is none.
+		mutable char* m_record;
+		//! Where the next byte of content goes
+		char* m_position;
+		//! End of the room the record may take up, header and padding included
+		char* m_end;
+
+		//! Secure the open record and open a new one
+		void open();
+		//! Secure the open record if it has any content
+		void secure();
+
+		RecordWriter& operator=(const RecordWriter&);
+
+		//! Anything without an overload of it's own is refused rather than converted
+		/*!
+		 * Otherwise a type like wchar_t or long double could be quietly narrowed into a
+		 * char or picked up by whichever overload it happens to convert to.
+		 */
+		template<class T> RecordWriter& operator<<(const T&);
+	};
+
+	//! Encodes wide characters as UTF-8 straight into FastCGI records
+	/*!
+	 * Stands in for FcgistreamSink at the end of a wide character Fcgistream. Rather
+	 * than passing characters one at a time through a code conversion facet and then
+	 * copying the result into a record, whole buffers of characters are encoded with
+	 * Utf8::encode() directly into the write space of the Transceiver. Characters that
+	 * aren't valid code points are replaced with U+FFFD.
+	 */
+	class Utf8FcgistreamSink: public FcgistreamSink
+	{
+	public:
+		typedef wchar_t char_type;
+		Utf8FcgistreamSink(const FcgistreamSink& sink): FcgistreamSink(sink) {}
+		std::streamsize write(const wchar_t* s, std::streamsize n);
+	};
+
 	//! Stream class for output of client data through FastCGI
 	/*!
 	 * This class is derived from std::basic_ostream<charT, traits>. It acts just
@@ -231,6 +437,13 @@ namespace Fastcgipp
 		//! Arguments passed directly to FcgistreamSink::set()
 		void set(Protocol::FullId id, Transceiver& transceiver, Protocol::RecordType type) { m_sink.set(id, transceiver, type); }
 
+		//! Amount of bytes sent through the stream so far
+		/*!
+		 * The stream is flushed first so anything it holds is counted. Bytes are counted
+		 * after output encoding and code conversion.
+		 */
+		size_t written() { flush(); return m_sink.written(); }
+
 		//! Called to flush all buffers to the sink
 		void flush() {
 			boost::iostreams::filtering_stream<boost::iostreams::output, charT>::strict_sync();
@@ -257,6 +470,15 @@ namespace Fastcgipp
 		 */
 		void dump(std::basic_istream<char>& stream) { flush(); m_sink.dump(stream); m_sink.throwExceptionWhenTransceiverFailed(); }
 
+		//! Write straight into FastCGI records
+		/*!
+		 * The stream is flushed so what it holds goes out first. Like dump() this bypasses
+		 * output encoding and code conversion.
+		 *
+		 * @sa RecordWriter
+		 */
+		RecordWriter writer() { flush(); return RecordWriter(m_sink); }
+
 		//! Sets the output encoding for this stream
 		/*!
 		 * This can also be set with the Fastcgipp::encoding manipulator.
@@ -265,6 +487,21 @@ namespace Fastcgipp
 		 * @sa OutputEncoding
 		 */
 		void setEncoding(OutputEncoding x) { m_encoder.m_state=x; }
+
+		//! Return the formatting state and encoding to those of a new stream
+		/*!
+		 * The stream buffer, filter chain and locale are kept so the stream can be reused
+		 * without rebuilding them. Nothing should be left buffered.
+		 */
+		void reset()
+		{
+			this->clear();
+			this->flags(std::ios_base::skipws | std::ios_base::dec);
+			this->width(0);
+			this->precision(6);
+			this->fill(this->widen(' '));
+			m_encoder.m_state=NONE;
+		}
 	};
 
 	//! Stream manipulator for setting output encoding.
@@ -0,0 +1,259 @@
+//! \file flatmap.hpp Defines the Fastcgipp::FlatMap class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef FLATMAP_HPP
+#define FLATMAP_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <utility>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Associative container of string keys kept in a flat array
+	/*!
+	 * Entries are kept in a vector in the order they were added and a key may be
+	 * added more than once, as with "a=1&a=2" in a query string. Looking a key up
+	 * finds the first entry with it, findNext() the ones after.
+	 *
+	 * The few entries a request usually has are found by walking the array. Once
+	 * there are more than indexThreshold an open addressing hash index of the
+	 * entries is built on the first lookup and kept up to date by following ones.
+	 *
+	 * Clearing the container keeps the entries along with the memory their strings
+	 * have allocated. A container that is reused, as in a pooled request, only
+	 * allocates once it holds more or longer entries than it ever has before.
+	 * Values must therefore have a clear() member that returns them to their default
+	 * state.
+	 *
+	 * The interface follows that of std::map closely enough for iterating, find(),
+	 * count() and operator[] to be used the same way. Entries are iterated in the
+	 * order they were added rather than sorted by key.
+	 *
+	 * @tparam charT Character type of the keys
+	 * @tparam Value Type of the values
+	 */
+	template<class charT, class Value> class FlatMap
+	{
+	public:
+		typedef std::basic_string<charT> Key;
+		typedef std::pair<Key, Value> value_type;
+		typedef typename std::vector<value_type>::iterator iterator;
+		typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+		FlatMap(): m_size(0), m_indexed(0) { }
+
+		iterator begin() { return m_entries.begin(); }
+		const_iterator begin() const { return m_entries.begin(); }
+		iterator end() { return m_entries.begin()+m_size; }
+		const_iterator end() const { return m_entries.begin()+m_size; }
+
+		//! Amount of entries
+		size_t size() const { return m_size; }
+		//! True if there are no entries
+		bool empty() const { return !m_size; }
+
+		//! Find the first entry with a key
+		/*!
+		 * @param[in] key The key
+		 * @return Iterator to the entry. end() if there is none.
+		 */
+		iterator find(const Key& key) { return begin()+locate(key.data(), key.size()); }
+		const_iterator find(const Key& key) const { return begin()+locate(key.data(), key.size()); }
+		iterator find(const charT* key) { return begin()+locate(key, std::char_traits<charT>::length(key)); }
+		const_iterator find(const charT* key) const { return begin()+locate(key, std::char_traits<charT>::length(key)); }
+
+		//! Find the next entry with the same key as another
+		/*!
+		 * The entries after it are walked so this isn't meant for large containers with
+		 * many repeated keys.
+		 *
+		 * @param[in] it Iterator to an entry
+		 * @return Iterator to the next entry with the same key. end() if there is none.
+		 */
+		iterator findNext(iterator it) { return begin()+locateNext(it-begin()); }
+		const_iterator findNext(const_iterator it) const { return begin()+locateNext(it-begin()); }
+
+		//! Amount of entries with a key
+		size_t count(const Key& key) const
+		{
+			size_t result=0;
+			for(const_iterator it=find(key); it!=end(); it=findNext(it))
+				++result;
+			return result;
+		}
+
+		//! Value of the first entry with a key. An entry is added if there is none.
+		Value& operator[](const Key& key)
+		{
+			iterator it=find(key);
+			if(it!=end())
+				return it->second;
+			value_type& entry=append();
+			entry.first=key;
+			return entry.second;
+		}
+
+		//! Add an entry, whether or not it's key is already in the container
+		/*!
+		 * @param[in] entry The key and value
+		 * @return Iterator to the new entry
+		 */
+		iterator insert(const value_type& entry)
+		{
+			value_type& newEntry=append();
+			newEntry.first=entry.first;
+			newEntry.second=entry.second;
+			return end()-1;
+		}
+
+		//! Add an entry with an empty key and value
+		/*!
+		 * This lets the key and value be converted straight into the entry without
+		 * building them elsewhere first. The key must be set before the container is
+		 * next searched.
+		 *
+		 * @return Reference to the new entry
+		 */
+		value_type& append();
+
+		//! Remove every entry, keeping the memory they have allocated
+		void clear();
+
+	private:
+		//! Amount of entries before a hash index is built
+		const static size_t indexThreshold=16;
+
+		//! Entries. Only the first m_size are in the container, the rest are kept for reuse.
+		std::vector<value_type> m_entries;
+		//! Amount of entries in the container
+		size_t m_size;
+
+		//! Open addressing hash table of entry positions plus one, zero being an empty slot
+		/*!
+		 * Empty until there are more than indexThreshold entries. Its size is always a
+		 * power of two and at least twice the amount of entries indexed. As entries are
+		 * never taken out and are indexed in order, linear probing always reaches the
+		 * first entry with a key before any later ones.
+		 */
+		mutable std::vector<size_t> m_index;
+		//! Amount of entries indexed
+		mutable size_t m_indexed;
+
+		//! Hash of a key
+		static size_t hash(const charT* key, size_t size)
+		{
+			// FNV-1a
+			size_t result=2166136261u;
+			for(const charT* end=key+size; key!=end; ++key)
+				result=(result^(size_t)*key)*16777619u;
+			return result;
+		}
+
+		//! Position of the first entry with a key. m_size if there is none.
+		size_t locate(const charT* key, size_t size) const;
+
+		//! Position of the next entry with the same key as the one at position. m_size if there is none.
+		size_t locateNext(size_t position) const
+		{
+			const Key& key=m_entries[position].first;
+			while(++position<m_size)
+				if(m_entries[position].first==key)
+					break;
+			return position;
+		}
+
+		//! Bring the hash index up to date with the entries
+		void index() const;
+	};
+}
+
+template<class charT, class Value> typename Fastcgipp::FlatMap<charT, Value>::value_type& Fastcgipp::FlatMap<charT, Value>::append()
+{
+	if(m_size==m_entries.size())
+		m_entries.push_back(value_type());
+	return m_entries[m_size++];
+}
+
+template<class charT, class Value> void Fastcgipp::FlatMap<charT, Value>::clear()
+{
+	for(iterator it=begin(); it!=end(); ++it)
+	{{
+		it->first.clear();
+		it->second.clear();
+	}}
+	m_size=0;
+	m_index.clear();
+	m_indexed=0;
+}
+
+template<class charT, class Value> size_t Fastcgipp::FlatMap<charT, Value>::locate(const charT* key, size_t size) const
+{
+	if(m_size<=indexThreshold)
+	{
+		size_t position=0;
+		for(; position<m_size; ++position)
+		{{
+			const Key& entryKey=m_entries[position].first;
+			if(entryKey.size()==size && !std::char_traits<charT>::compare(entryKey.data(), key, size))
+				break;
+		}}
+		return position;
+	}
+
+	index();
+	const size_t mask=m_index.size()-1;
+	for(size_t slot=hash(key, size)&mask; m_index[slot]; slot=(slot+1)&mask)
+	{{
+		const Key& entryKey=m_entries[m_index[slot]-1].first;
+		if(entryKey.size()==size && !std::char_traits<charT>::compare(entryKey.data(), key, size))
+			return m_index[slot]-1;
+	}}
+	return m_size;
+}
+
+template<class charT, class Value> void Fastcgipp::FlatMap<charT, Value>::index() const
+{
+	if(m_indexed==m_size)
+		return;
+
+	if(m_index.size()<m_size*2)
+	{
+		size_t indexSize=64;
+		while(indexSize<m_size*2)
+			indexSize*=2;
+		m_index.assign(indexSize, 0);
+		m_indexed=0;
+	}
+
+	const size_t mask=m_index.size()-1;
+	for(; m_indexed<m_size; ++m_indexed)
+	{{
+		const Key& key=m_entries[m_indexed].first;
+		size_t slot=hash(key.data(), key.size())&mask;
+		while(m_index[slot])
+			slot=(slot+1)&mask;
+		m_index[slot]=m_indexed+1;
+	}}
+}
+
+#endif
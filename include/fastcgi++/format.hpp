@@ -0,0 +1,80 @@
+//! \file format.hpp Declares the Fastcgipp::Format number and date formatting functions
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef FASTCGIPP_FORMAT_HPP
+#define FASTCGIPP_FORMAT_HPP
+
+#include <cstddef>
+#include <ctime>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Formatting of numbers and dates into caller supplied memory
+	/*!
+	 * Unlike inserting into a stream, nothing here goes through a locale or it's
+	 * facets and nothing is allocated. Output is always plain ASCII as HTTP headers
+	 * and most response bodies want it, with no grouping and a '.' decimal point.
+	 */
+	namespace Format
+	{
+		//! Most bytes integer() writes
+		const size_t maxIntegerSize=20;
+		//! Most bytes floating() writes
+		const size_t maxFloatingSize=32;
+		//! Bytes httpDate() writes
+		const size_t httpDateSize=29;
+
+		//! Write an integer in decimal
+		/*!
+		 * @param[in] value The integer
+		 * @param[out] destination Where to write it. Must have room for maxIntegerSize bytes.
+		 * @return Amount of bytes written
+		 */
+		size_t integer(unsigned long long value, char* destination);
+		size_t integer(long long value, char* destination);
+
+		//! Write a floating point number as printf's %g would
+		/*!
+		 * This gives the same output std::ostream gives by default.
+		 *
+		 * @param[in] value The number
+		 * @param[in] precision Amount of significant digits. Values above 17 are taken as 17.
+		 * @param[out] destination Where to write it. Must have room for maxFloatingSize bytes.
+		 * @return Amount of bytes written
+		 */
+		size_t floating(double value, int precision, char* destination);
+
+		//! Write a time as an RFC 1123 date
+		/*!
+		 * This is the format HTTP wants in headers like Last-Modified, Expires and the
+		 * expires attribute of Set-Cookie, as in "Sun, 06 Nov 1994 08:49:37 GMT". The
+		 * last time formatted is remembered by each thread so a response stamping the
+		 * current time into several headers only formats it once.
+		 *
+		 * @param[in] time Seconds since the epoch
+		 * @param[out] destination Where to write it. Must have room for httpDateSize bytes.
+		 * @return Amount of bytes written, always httpDateSize
+		 */
+		size_t httpDate(std::time_t time, char* destination);
+	}
+}
+
+#endif
@@ -25,6 +25,7 @@
 #include <string>
 #include <boost/shared_array.hpp>
 #include <boost/scoped_array.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <ostream>
 #include <istream>
@@ -35,6 +36,7 @@
 #include <vector>
 
 #include <fastcgi++/exceptions.hpp>
+#include <fastcgi++/flatmap.hpp>
 #include <fastcgi++/protocol.hpp>
 
 //! Topmost namespace for the fastcgi++ library
@@ -79,10 +81,40 @@ namespace Fastcgipp
 				value(x.value),
 				filename(value),
 				contentType(x.contentType),
-				m_data(x.steal()),
+				m_data(x.m_data),
 				m_size(x.m_size)
-			{}
+			{
+				x.m_data=0;
+				x.m_size=0;
+			}
+			//! Expropriates the file data of x, as the copy constructor does
+			Post& operator=(const Post& x)
+			{
+				if(&x!=this)
+				{
+					type=x.type;
+					value=x.value;
+					contentType=x.contentType;
+					delete [] m_data;
+					m_data=x.m_data;
+					m_size=x.m_size;
+					x.m_data=0;
+					x.m_size=0;
+				}
+				return *this;
+			}
 			~Post() { delete [] m_data; }
+
+			//! Return to the default state, freeing any file data
+			void clear()
+			{
+				type=form;
+				value.clear();
+				contentType.clear();
+				delete [] m_data;
+				m_data=0;
+				m_size=0;
+			}
 		private:
 			//! Pointer to file data
 			mutable char* m_data;
@@ -243,17 +275,25 @@ namespace Fastcgipp
 			//! Timestamp the client has for this document
 			boost::posix_time::ptime ifModifiedSince;
 
+			typedef FlatMap<charT, std::basic_string<charT> > RequestEnvVariables;
 			//! Container with all request environment variables (of the form "HTTP_*")
-			std::map<std::basic_string<charT>, std::basic_string<charT> > requestEnvVariables;
+			RequestEnvVariables requestEnvVariables;
 
-			typedef std::map<std::basic_string<charT>, std::basic_string<charT> > Cookies;
+			typedef FlatMap<charT, std::basic_string<charT> > Cookies;
 			//! Container with all url-encoded cookie data
+			/*!
+			 * Cookies passed more than once have an entry for every value.
+			 */
 			Cookies cookies;
 			//! Quick and easy way to find a cookie value
 			const std::basic_string<charT>& findCookie(const charT* key) const;
 
-			typedef std::map<std::basic_string<charT>, std::basic_string<charT> > Gets;
+			typedef FlatMap<charT, std::basic_string<charT> > Gets;
 			//! Container with all url-encoded GET data
+			/*!
+			 * Names passed more than once, as in "a=1&a=2", have an entry for every value.
+			 * Use Gets::findNext() to get past the first.
+			 */
 			Gets gets;
 
 			//! Quick and easy way to find a GET value
@@ -271,8 +311,11 @@ namespace Fastcgipp
 			 */
 			bool checkForGet(const charT* key) const;
 
-			typedef std::map<std::basic_string<charT>, Post<charT> > Posts;
-			//! STL container associating Post objects with their name
+			typedef FlatMap<charT, Post<charT> > Posts;
+			//! Container associating Post objects with their name
+			/*!
+			 * Names posted more than once have an entry for every value.
+			 */
 			Posts posts;
 
 			//! Quick and easy way to find a POST value
@@ -290,6 +333,76 @@ namespace Fastcgipp
 			 */
 			bool checkForPost(const charT* key) const;
 
+			//! Switch lazy parsing of parameters on or off
+			/*!
+			 * In lazy mode fill() only sets requestMethod, contentLength and contentType,
+			 * which are needed to receive post data. Every other member is left at it's
+			 * default. The parameter data is instead kept as it came in, with the name
+			 * and value of every parameter indexed, and decoded only once retrieved
+			 * through parameter(), findGet(const char*, std::basic_string<charT>&) or
+			 * findCookie(const char*, std::basic_string<charT>&). Handlers that only look
+			 * at a few values thereby avoid building strings and maps for all of them.
+			 *
+			 * This must be set before fill() is first called for a request. It is kept
+			 * through clear().
+			 *
+			 * @param[in] lazy True for lazy parsing
+			 */
+			void setLazy(bool lazy) { m_lazy=lazy; }
+
+			//! True if parameters are parsed lazily
+			bool lazy() const { return m_lazy; }
+
+			//! Raw value of a parameter
+			/*!
+			 * Only available in lazy mode. The value is exactly as passed by the other
+			 * side and stays valid until the environment is cleared.
+			 *
+			 * \param[in] name Name of the parameter, e.g. "HTTP_HOST"
+			 * \return The value. Empty if the parameter wasn't passed.
+			 */
+			boost::string_ref parameter(const char* name) const;
+
+			//! Value of a parameter converted to a string
+			/*!
+			 * Only available in lazy mode.
+			 *
+			 * \param[in] name Name of the parameter
+			 * \param[out] value Set to the value. Left alone if the parameter wasn't passed.
+			 * \return True if the parameter was passed, false otherwise.
+			 */
+			bool parameter(const char* name, std::basic_string<charT>& value) const;
+
+			//! Value of a parameter converted to an integer. 0 if it wasn't passed.
+			int parameterInt(const char* name) const;
+
+			//! Value of a parameter converted to an address. All zeros if it wasn't passed.
+			Address parameterAddress(const char* name) const;
+
+			//! Check if a parameter was passed. Only available in lazy mode.
+			bool checkForParameter(const char* name) const;
+
+			//! Find a single GET value, decoding only it
+			/*!
+			 * Only available in lazy mode. The query string is searched every call so the
+			 * value should be kept if it is needed more than once.
+			 *
+			 * \param[in] key Name of the GET value
+			 * \param[out] value Set to the value. Left alone if it wasn't passed.
+			 * \return True if the value was passed, false otherwise.
+			 */
+			bool findGet(const char* key, std::basic_string<charT>& value) const;
+
+			//! Find a single cookie, decoding only it
+			/*!
+			 * Only available in lazy mode.
+			 *
+			 * \param[in] key Name of the cookie
+			 * \param[out] value Set to the value. Left alone if it wasn't passed.
+			 * \return True if the cookie was passed, false otherwise.
+			 */
+			bool findCookie(const char* key, std::basic_string<charT>& value) const;
+
 			//! Parses FastCGI parameter data into the data structure
 			/*!
 			 * This function will take the body of a FastCGI parameter record and parse
@@ -324,8 +437,36 @@ namespace Fastcgipp
 			//! Clear the post buffer
 			void clearPostBuffer() { m_postBuffer.reset(); pPostBuffer=0; }
 
-			Environment(): requestMethod(HTTP_METHOD_ERROR), etag(0), keepAlive(0), contentLength(0), serverPort(0), remotePort(0) {}
+			//! Return every member to it's default state so the structure can be reused
+			/*!
+			 * Strings, the path info vector and the containers of gets, cookies, posts and
+			 * request environment variables keep the memory they have allocated.
+			 */
+			void clear();
+
+			Environment(): requestMethod(HTTP_METHOD_ERROR), etag(0), keepAlive(0), contentLength(0), serverPort(0), remotePort(0), m_lazy(false) {}
 		private:
+			//! True if parameters are parsed lazily
+			bool m_lazy;
+
+			//! Offsets of a parameter's name and value in m_parameterData
+			struct Parameter
+			{
+				Parameter(size_t name_, size_t nameSize_, size_t value_, size_t valueSize_): name(name_), nameSize(nameSize_), value(value_), valueSize(valueSize_) { }
+				size_t name;
+				size_t nameSize;
+				size_t value;
+				size_t valueSize;
+			};
+			//! Index of every parameter passed. Only filled in lazy mode.
+			std::vector<Parameter> m_parameters;
+			//! Parameter data as it came in. Only filled in lazy mode.
+			/*!
+			 * Keeps the memory it has allocated through clear() so a reused environment
+			 * doesn't allocate for it again.
+			 */
+			std::vector<char> m_parameterData;
+
 			//! Raw string of characters representing the post boundary
 			boost::scoped_array<char> boundary;
 			//! Size of boundary
@@ -374,11 +515,9 @@ namespace Fastcgipp
 		/*!
 		 * @param[in] data Data to decode
 		 * @param[in] size Size of data to decode
-		 * @param[out] output Container to output data into
-		 *
-		 * @return Returns false if the name isn't found. True otherwise.
+		 * @param[out] output Container to output data into. Every field gets an entry, even should it's name repeat.
 		 */
-		template<class charT> void decodeUrlEncoded(const char* data, size_t size, std::map<std::basic_string<charT>, std::basic_string<charT> >& output, const char fieldSeperator='&');
+		template<class charT> void decodeUrlEncoded(const char* data, size_t size, FlatMap<charT, std::basic_string<charT> >& output, const char fieldSeperator='&');
 
 		//! Convert a string with percent escaped byte values to their actual values
 		/*!
@@ -570,7 +709,7 @@ template<class T> void Fastcgipp::Http::Sessions<T>::cleanup()
 	while(it!=this->end())
 	{
 		if(it->first.timestamp < oldest)
-			erase(it++);
+			this->erase(it++);
 		else
 			++it;
 	}
@@ -654,7 +793,7 @@ template<class T> typename Fastcgipp::Http::Sessions<T>::iterator Fastcgipp::Htt
 	std::pair<iterator,bool> retVal;
 	retVal.second=false;
 	while(!retVal.second)
-		retVal=insert(std::pair<SessionId, T>(SessionId(), value_));
+		retVal=this->insert(std::pair<SessionId, T>(SessionId(), value_));
 	return retVal.first;
 }
 
@@ -0,0 +1,130 @@
+//! \file loadshedder.hpp Defines the Fastcgipp::LoadShedder class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef LOADSHEDDER_HPP
+#define LOADSHEDDER_HPP
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Measures how long tasks wait to be handled and decides when to shed load
+	/*!
+	 * Every task taken off a queue reports the time it was queued at. The time spent
+	 * waiting, it's sojourn, is counted in a histogram. Shedding follows the CoDel
+	 * approach to queue management. Should every task for a whole interval have
+	 * waited longer than the target, the queue is considered to be standing rather
+	 * than absorbing a burst and the shedder enters an overloaded state. It stays
+	 * there until a task is seen that waited less than the target.
+	 *
+	 * While overloaded a request is shed straight away, and after that whenever the
+	 * interval divided by the square root of the amount shed so far has passed. The
+	 * rate of shedding therefore keeps growing for as long as the queue stands. Should
+	 * the shedder become overloaded again shortly after leaving that state, it picks up
+	 * close to the rate it left off at. Only the sojourn is looked at, never the length
+	 * of the queue, so it works the same whatever the amount of threads handling tasks.
+	 *
+	 * All functions are safe to call from any thread.
+	 */
+	class LoadShedder
+	{
+	public:
+		LoadShedder();
+
+		//! Amount of histogram buckets
+		/*!
+		 * The first bucket counts sojourns below a microsecond. Every following bucket
+		 * counts sojourns of up to twice the length of the bucket before it, with the
+		 * last one counting everything longer.
+		 */
+		const static unsigned int buckets=32;
+
+		//! Set the target sojourn and the interval it is measured over
+		/*!
+		 * @param[in] target Microseconds tasks should wait at most. 0 disables shedding.
+		 * @param[in] interval Microseconds the target may be exceeded for before shedding
+		 */
+		void setParameters(long long target, long long interval);
+
+		//! Account for a task taken off a queue
+		/*!
+		 * @param[in] queued Time the task was queued at as returned by now()
+		 * @return True if a request is due to be shed. Should the task's request not be
+		 * sheddable, the next one to be is shed instead.
+		 */
+		bool dequeued(long long queued);
+
+		//! Account for a shed request
+		/*!
+		 * This schedules the next request to be shed.
+		 */
+		void shed();
+
+		//! Amount of requests shed
+		unsigned long long shedCount() const { return m_shed.load(boost::memory_order_relaxed); }
+
+		//! True if in an overloaded state
+		bool overloaded() const { return m_overloaded.load(boost::memory_order_relaxed); }
+
+		//! Retrieve the sojourn histogram
+		/*!
+		 * @param[out] counts Set to the amount of tasks counted in every bucket
+		 */
+		void histogram(std::vector<unsigned long long>& counts) const;
+
+		//! Current time in microseconds from a monotonic clock
+		static long long now();
+
+	private:
+		//! Microseconds tasks should wait at most. 0 if shedding is disabled.
+		boost::atomic<long long> target;
+		//! Microseconds the target may be exceeded for
+		boost::atomic<long long> interval;
+		//! Time by which the target will have been exceeded for a whole interval. 0 if it isn't exceeded.
+		boost::atomic<long long> firstAbove;
+		//! True if in an overloaded state
+		boost::atomic<bool> m_overloaded;
+		//! Guards changes to the state above and the shedding schedule below
+		/*!
+		 * Tasks that waited less than the target only take it should there be state to
+		 * clear, so it is left alone unless tasks start to queue up.
+		 */
+		boost::mutex stateMutex;
+		//! Time the next request is due to be shed at
+		long long shedNext;
+		//! Amount of requests shed since entering the overloaded state
+		unsigned int shedRun;
+		//! Value of shedRun right after entering the overloaded state the last time
+		unsigned int lastShedRun;
+		//! Amount of requests shed
+		boost::atomic<unsigned long long> m_shed;
+		//! The sojourn histogram
+		boost::atomic<unsigned long long> counts[buckets];
+
+		LoadShedder(const LoadShedder&);
+		LoadShedder& operator=(const LoadShedder&);
+	};
+}
+
+#endif
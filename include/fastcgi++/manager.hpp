@@ -23,9 +23,11 @@
 #define MANAGER_HPP
 
 #include <list>
+#include <vector>
 #include <map>
 #include <string>
 #include <queue>
+#include <utility>
 #include <algorithm>
 #include <cstring>
 
@@ -33,11 +35,17 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <boost/atomic.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <signal.h>
 
 #include <fastcgi++/protocol.hpp>
 #include <fastcgi++/transceiver.hpp>
+#include <fastcgi++/taskqueue.hpp>
+#include <fastcgi++/requesttable.hpp>
+#include <fastcgi++/timerwheel.hpp>
+#include <fastcgi++/loadshedder.hpp>
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
@@ -67,10 +75,11 @@ namespace Fastcgipp
 		 * @param[in] fd File descriptor to listen on.
 		 * @param[in] sendMessage_ Function Transceiver should use to communicate with Manager.
 		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM and SIGUSR1. If false, no signal handlers will be set up.
+		 * @param[in] backend Mechanism the Transceiver should use to wait on file descriptors.
 		 */
-		ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals);
+		ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals, EventBackend backend);
 
-		~ManagerPar() { instance=0; }
+		~ManagerPar() { if(instance==this) instance=0; }
 
 		//! Halter for the handler() function
 		/*!
@@ -108,25 +117,107 @@ namespace Fastcgipp
 		//! Tells you the size of the message queue
 		size_t getMessagesSize() const { return messages.size(); }
 
+		//! Enable or disable deferred flushing of output to the other side
+		/*!
+		 * @sa Transceiver::setDeferredFlush()
+		 */
+		void setDeferredFlush(bool deferFlush) { transceiver.setDeferredFlush(deferFlush); }
+
+		//! Change the size and retention limits of output memory
+		/*!
+		 * @sa Transceiver::setChunkParameters()
+		 */
+		void setChunkParameters(const ChunkParameters& parameters) { transceiver.setChunkParameters(parameters); }
+
+		//! Set the limits the other side is told about and held to
+		/*!
+		 * The limits are reported in reply to FCGI_GET_VALUES management records. A
+		 * request beginning beyond the amount of connections or requests is turned down
+		 * straight away with an END_REQUEST record of protocol status OVERLOADED. A
+		 * request beginning on a connection that already has one while multiplexing is
+		 * disabled is turned down with CANT_MPX_CONN. Either way no request object is
+		 * ever made for it. This must not be called while handler() is running.
+		 *
+		 * The connection limit is only checked when a request begins. Connections beyond it
+		 * are still accepted and stay open, so the other side finds out through the
+		 * OVERLOADED status of its requests rather than by being refused. Those
+		 * connections count towards the limit for as long as they are open.
+		 *
+		 * @param[in] maxConns Maximum amount of connections at a time. 0, the default, means no limit.
+		 * @param[in] maxReqs Maximum amount of requests at a time. 0, the default, means no limit.
+		 * @param[in] mpxsConns True, the default, if requests can be multiplexed over a single connection.
+		 */
+		void setLimits(unsigned int maxConns, unsigned int maxReqs, bool mpxsConns=true) { this->maxConns=maxConns; this->maxReqs=maxReqs; this->mpxsConns=mpxsConns; }
+
+		//! Shed new requests while tasks wait too long to be handled
+		/*!
+		 * The time every task spends queued before being handled is measured, from the
+		 * moment it is received to the moment a thread handles it. Should it exceed the
+		 * target for a whole interval, requests that haven't received all their parameters
+		 * yet when their turn comes are answered with a 503 Service Unavailable straight
+		 * away. Requests are shed at a rate that grows for as long as tasks keep waiting
+		 * beyond the target, and shedding stops once a task waited less than it.
+		 *
+		 * @param[in] target Time tasks should wait at most. A special value such as boost::posix_time::pos_infin, the default, disables shedding.
+		 * @param[in] interval Time the target may be exceeded for before shedding.
+		 *
+		 * @sa LoadShedder
+		 */
+		void setLoadShedding(const boost::posix_time::time_duration& target, const boost::posix_time::time_duration& interval=boost::posix_time::milliseconds(100)) { shedder.setParameters(target.is_special()?0:target.total_microseconds(), interval.total_microseconds()); }
+
+		//! Retrieve the histogram of the time tasks waited to be handled
+		/*!
+		 * @param[out] counts Set to the amount of tasks in every bucket
+		 *
+		 * @sa LoadShedder::buckets
+		 */
+		void sojournHistogram(std::vector<unsigned long long>& counts) const { shedder.histogram(counts); }
+
+		//! Amount of requests shed
+		unsigned long long shedCount() const { return shedder.shedCount(); }
+
 	protected:
 		//! Handles low level communication with the other side
 		Transceiver transceiver;
 
-		//! Queue type for pending tasks
+		//! Queue for pending tasks
 		/*!
-		 * This is merely a derivation of a std::queue<Protocol::FullId> and a
-		 * boost::mutex that gives data locking abilities to the STL container.
+		 * This contains a queue of Task that need their handlers called. Only the thread
+		 * running handler() pops tasks.
 		 */
-		class Tasks: public std::list<Protocol::FullId>, public boost::mutex {};
-		//! Queue for pending tasks
+		TaskQueue tasks;
+
+		//! Timers of every request
 		/*!
-		 * This contains a queue of Protocol::FullId that need their handlers called.
+		 * This is declared before any container of requests so it outlives the timers they hold.
+		 * Expired timers are collected by the thread running handler().
 		 */
-		Tasks tasks;
+		TimerWheel timers;
 
 		//! A queue of messages for the manager itself
 		std::queue<Message> messages;
 
+		//! Maximum amount of connections. 0 means no limit.
+		unsigned int maxConns;
+		//! Maximum amount of requests. 0 means no limit.
+		unsigned int maxReqs;
+		//! True if requests can be multiplexed over a single connection
+		bool mpxsConns;
+
+		//! Measures the time tasks wait and decides when requests are shed
+		LoadShedder shedder;
+
+		//! Turn down a request that is beginning
+		/*!
+		 * Only an END_REQUEST record is sent. Any other record for the request that follows
+		 * is discarded as it is for any request that doesn't exist.
+		 *
+		 * @param[in] id FullId of the request
+		 * @param[in] status Reason for turning it down
+		 * @param[in] kill True if the connection should be closed afterwards
+		 */
+		void reject(Protocol::FullId id, Protocol::ProtocolStatus status, bool kill);
+
 		//! Handles management messages
 		/*!
 		 * This function is called by handler() in the case that a management message is recieved.
@@ -139,24 +230,30 @@ namespace Fastcgipp
 		void localHandler(Protocol::FullId id);
 
 		//! Indicated whether or not the manager is currently in sleep mode
-		bool asleep;
-		//! Mutex to make accessing asleep thread safe
-		boost::mutex sleepMutex;
+		boost::atomic<bool> asleep;
+
+		//! Wake handler() up should it be asleep
+		/*!
+		 * To be called after whatever handler() should notice has been stored. Either
+		 * handler() sees it before going to sleep or we see that it is asleep.
+		 */
+		void wake()
+		{
+			boost::atomic_thread_fence(boost::memory_order_seq_cst);
+			if(asleep.load(boost::memory_order_relaxed))
+				transceiver.wake();
+		}
 
 		//! Boolean value indicating that handler() should halt
 		/*!
 		 * @sa stop()
 		 */
-		bool stopBool;
-		//! Mutex to make stopBool thread safe
-		boost::mutex stopMutex;
+		boost::atomic<bool> stopBool;
 		//! Boolean value indication that handler() should terminate
 		/*!
 		 * @sa terminate()
 		 */
-		bool terminateBool;
-		//! Mutex to make terminateMutex thread safe
-		boost::mutex terminateMutex;
+		boost::atomic<bool> terminateBool;
 
 	private:
 		//! General function to handler POSIX signals
@@ -190,8 +287,9 @@ namespace Fastcgipp
 		 *
 		 * @param[in] fd File descriptor to listen on.
 		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM and SIGUSR1. If false, no signal handlers will be set up.
+		 * @param[in] backend Mechanism the Transceiver should use to wait on file descriptors.
 		 */
-		Manager(int fd=0, bool doSetupSignals=true): ManagerPar(fd, boost::bind(&Manager::push, boost::ref(*this), _1, _2), doSetupSignals) {}
+		Manager(int fd=0, bool doSetupSignals=true, EventBackend backend=defaultEventBackend): ManagerPar(fd, boost::bind(&Manager::push, boost::ref(*this), _1, _2), doSetupSignals, backend), releaser(*this), generation(0), workers(0), requestTimeout(0), lazyEnvironment(false) {}
 
 		//! General handling function to be called after construction
 		/*!
@@ -229,32 +327,480 @@ namespace Fastcgipp
 		    m_requestCreatorCallback = callback;
 		}
 
-		//! Remove the outstanding tasks for a certain FullId.
+		//! Keep finished request objects for reuse
 		/*!
-                 * Whenever an error, e.g. exception, occurs after pushing
-                 * a message it should be undone. This is to prevent that tasks remain in the
-                 * queue while the request no longer exists.
-                 */
-		void removeTasks(const Protocol::FullId& removeId)
-		{
-			tasks.remove_if( [removeId] (Protocol::FullId id) { return id == removeId; } );
-		}
+		 * Rather than being destroyed, requests that completed are reset and kept, up to
+		 * the specified amount, to be handed the next requests that come in. This saves
+		 * building the streams, environment and locale of a request every time. Strings
+		 * in the environment keep the memory they allocated. User state in the derived
+		 * class should be reset by overriding Request::reset(). Only requests created
+		 * while the pool is enabled are kept. The default is 0, meaning disabled.
+		 *
+		 * @param[in] size Maximum amount of request objects to keep
+		 */
+		void setRequestPool(size_t size);
+
+		//! Set the amount of worker threads that run request handlers
+		/*!
+		 * With no workers, the default, every request is handled in the thread running
+		 * handler(). Otherwise that thread is left with only the I/O and management records
+		 * while requests are handed off to a pool of this many threads that handler()
+		 * starts and stops. Records for a single request are still handled in order and
+		 * never by two threads at once. This must not be called while handler() is running.
+		 *
+		 * @param[in] count Amount of worker threads
+		 */
+		void setWorkers(unsigned int count) { workers=count; }
+
+		//! Set a deadline for every request
+		/*!
+		 * Requests still not complete this long after they began are completed with
+		 * Request::timeoutHandler(), by default a 504 Gateway Timeout. A request may
+		 * change its own deadline with Request::setDeadline(). This must not be called
+		 * while handler() is running.
+		 *
+		 * @param[in] timeout Time requests have to complete. A special value such as boost::posix_time::pos_infin, the default, means no deadline.
+		 */
+		void setRequestTimeout(const boost::posix_time::time_duration& timeout) { requestTimeout=timeout.is_special()?0:timeout.total_milliseconds(); }
+
+		//! Let the other side shorten the deadline of a request through a parameter
+		/*!
+		 * Should a request come with the parameter, its value is taken as milliseconds
+		 * the request has to complete. It can only make the deadline of
+		 * setRequestTimeout() shorter, never longer. With the web server passing on a
+		 * header such as X-Request-Timeout, name would be "HTTP_X_REQUEST_TIMEOUT". This
+		 * must not be called while handler() is running.
+		 *
+		 * @param[in] name Name of the parameter. An empty string, the default, ignores any parameter.
+		 */
+		void setDeadlineVariable(const std::string& name) { deadlineVariable=name; }
+
+		//! Parse the parameters of requests lazily
+		/*!
+		 * Rather than filling every member of Request::environment(), only what is needed
+		 * to receive post data is parsed and everything else is decoded once asked for.
+		 * This must not be called while handler() is running.
+		 *
+		 * @param[in] lazy True for lazy parsing. False, the default, fills the environment as usual.
+		 * @sa Http::Environment::setLazy()
+		 */
+		void setLazyEnvironment(bool lazy) { lazyEnvironment=lazy; }
 
 	private:
-		//! Associative container type for active requests
+		//! Finished requests kept for reuse
 		/*!
-		 * This is merely a derivation of a std::map<Protocol::FullId, boost::shared_ptr<T> > and a
-		 * boost::shared_mutex that gives data locking abilities to the STL container.
+		 * This is a derivation of a std::vector<T*> and a boost::mutex that gives data locking
+		 * abilities to the STL container. It takes back requests it was set as recycler of once
+		 * they are no longer referenced.
 		 */
-		class Requests: public std::map<Protocol::FullId, boost::shared_ptr<T> >, public boost::shared_mutex {};
-		//! Associative container type for active requests
+		class Pool: public T::Recycler, public std::vector<T*>, public boost::mutex
+		{
+		public:
+			Pool(): limit(0) { }
+			~Pool()
+			{
+				for(typename std::vector<T*>::iterator it=this->begin(); it!=this->end(); ++it)
+					delete *it;
+			}
+
+			//! Maximum amount of requests to keep
+			boost::atomic<size_t> limit;
+
+			//! Retrieve a request to reuse
+			/*!
+			 * @return Pointer to the request. Null if there is none.
+			 */
+			T* take()
+			{
+				boost::lock_guard<boost::mutex> poolLock(*this);
+				if(this->empty())
+					return 0;
+				T* request=this->back();
+				this->pop_back();
+				return request;
+			}
+
+			void recycle(typename T::Recycler::Recyclable* request)
+			{
+				if(request->recycle())
+				{
+					boost::lock_guard<boost::mutex> poolLock(*this);
+					if(this->size()<limit)
+					{
+						this->push_back(static_cast<T*>(request));
+						return;
+					}
+				}
+				delete request;
+			}
+		};
+		//! Finished requests kept for reuse
+		/*!
+		 * This is declared before any container of requests so it outlives whatever they return to it.
+		 */
+		Pool pool;
+
+		//! Container type for active requests
+		typedef RequestTable<T> Requests;
+		//! Container for active requests
 		/*!
 		 * This container associated the Protocol::FullId of each active request with a pointer
 		 * to the actual Request object.
 		 */
 		Requests requests;
 
+		//! Takes requests out of the table of active requests as they complete
+		/*!
+		 * Without this a request handled by a worker thread would only be erased once
+		 * it's END_REQUEST record was already on it's way, and the next request on the
+		 * connection could be turned away for the finished one still counting.
+		 */
+		class Releaser: public T::Table
+		{
+		public:
+			Releaser(Manager& manager_): manager(manager_) { }
+			void release(typename T::Table::Entry* request) { manager.erase(static_cast<T*>(request)); }
+		private:
+			Manager& manager;
+		};
+		//! Sole Releaser of the manager
+		Releaser releaser;
+
 		RequestCreatorCallback m_requestCreatorCallback;
+
+		//! Generation given to the last request created
+		/*!
+		 * Only modified by the thread running handler().
+		 */
+		unsigned int generation;
+
+		//! Amount of worker threads to run request handlers in
+		unsigned int workers;
+
+		//! Milliseconds requests have to complete. 0 means no deadline.
+		long long requestTimeout;
+
+		//! Name of the parameter requests may take a shorter deadline from. Empty if none.
+		std::string deadlineVariable;
+
+		//! True if the parameters of requests are parsed lazily
+		bool lazyEnvironment;
+
+		//! Timers collected but not yet delivered
+		/*!
+		 * Kept around so collecting doesn't allocate. Only used by the thread running handler().
+		 */
+		TimerWheel::Expired expired;
+
+		//! Deliver the messages of expired timers to their requests
+		void collectTimers();
+
+		//! Queue type for requests waiting on a worker thread
+		/*!
+		 * This is merely a derivation of a std::deque<boost::intrusive_ptr<T> > and a
+		 * boost::mutex that gives data locking abilities to the STL container.
+		 */
+		class Ready: public std::deque<boost::intrusive_ptr<T> >, public boost::mutex
+		{
+		public:
+			Ready(): stop(false), handling(0) { }
+			//! Signalled when a request is queued or the workers should stop
+			boost::condition_variable condition;
+			//! True if the worker threads should return
+			bool stop;
+			//! Amount of requests worker threads are handling right now
+			unsigned int handling;
+		};
+		//! Requests that have tasks waiting on a worker thread
+		Ready ready;
+
+		//! Amount of tasks a worker thread handles for a request before others waiting get a turn
+		/*!
+		 * Keeps a request receiving a large amount of records, e.g. an upload multiplexed
+		 * with others over a connection, from holding on to a worker.
+		 */
+		const static unsigned int turnTasks=16;
+
+		//! Hand a task off to the worker threads
+		/*!
+		 * A request is only queued if it isn't already queued or being handled. Otherwise the worker
+		 * handling it picks up the task once it is done with the previous ones. The messages mutex
+		 * of the request must be locked.
+		 *
+		 * @param[in] request The request
+		 * @param[in] queued Time the task was first queued at as returned by LoadShedder::now()
+		 */
+		void schedule(const boost::intrusive_ptr<T>& request, long long queued=LoadShedder::now());
+
+		//! Hand a task taken from the task queue off to the worker threads
+		void dispatch(const Task& task);
+
+		//! Run request handlers until told to stop
+		void worker();
+
+		//! Remove a finished request unless it has since been replaced
+		/*!
+		 * Requests usually take themselves out through the Releaser before this is called,
+		 * in which case nothing is done.
+		 */
+		void erase(T* request);
+
+		//! Give up on a request the other side has given up on
+		/*!
+		 * This is done when the connection of the request is closed or another request
+		 * takes its id. Functions registered through Request::onCancel() are called,
+		 * its timers are stopped and it is taken out of the table of active requests.
+		 */
+		void abandon(const boost::intrusive_ptr<T>& request);
+
+		//! True if no request is left in the table nor being handled by a worker thread
+		/*!
+		 * A request handled by a worker thread takes itself out of the table before it's last
+		 * records have been handed to the transceiver, so the table alone doesn't tell.
+		 */
+		bool idle();
+
+		//! The loop run by handler() once any worker threads have been started
+		void loop();
+
+		//! Halt and join the worker threads started by handler()
+		void stopWorkers(boost::thread_group& threads);
+	};
+
+	//! Non-template portion of the ShardedManager class
+	/*!
+	 * Takes care of the listening sockets, threads, CPU affinity and signals shared
+	 * by every shard.
+	 */
+	class ShardedManagerPar
+	{
+	public:
+		~ShardedManagerPar();
+
+		//! Run every shard until they have all halted
+		/*!
+		 * Each shard's handler() runs in a thread of it's own. If pinning is enabled
+		 * the threads are bound to the CPUs this process is allowed to run on in a
+		 * round robin fashion. This function returns once every shard has halted.
+		 *
+		 * @sa setPinning()
+		 */
+		void handler();
+
+		//! Halt the handler() of every shard
+		/*!
+		 * @sa ManagerPar::stop()
+		 */
+		void stop();
+
+		//! Terminate the handler() of every shard
+		/*!
+		 * @sa ManagerPar::terminate()
+		 */
+		void terminate();
+
+		//! Configure the handlers for POSIX signals
+		/*!
+		 * Same as ManagerPar::setupSignals() except that the signals apply to every
+		 * shard.
+		 */
+		void setupSignals();
+
+		//! Amount of shards
+		size_t size() const { return shards.size(); }
+
+		//! Amount of shards with a listening socket of their own
+		/*!
+		 * The remaining shards take turns accepting connections on the socket passed
+		 * to the constructor.
+		 */
+		size_t reusedPorts() const { return ownFds.size(); }
+
+		//! Enable or disable pinning of shard threads to CPUs
+		/*!
+		 * Pinning is enabled by default. It must be set before handler() is called.
+		 */
+		void setPinning(bool pin) { m_pin=pin; }
+
+		//! Enable or disable deferred flushing of output on every shard
+		/*!
+		 * @sa Transceiver::setDeferredFlush()
+		 */
+		void setDeferredFlush(bool deferFlush);
+
+		//! Change the size and retention limits of output memory on every shard
+		/*!
+		 * @sa Transceiver::setChunkParameters()
+		 */
+		void setChunkParameters(const ChunkParameters& parameters);
+
+	protected:
+		//! Set up the listening sockets for each shard
+		/*!
+		 * If the socket passed was created with SO_REUSEPORT set, every shard but the
+		 * first gets a new socket bound to the same address so the kernel can spread
+		 * connections between them. Otherwise every shard listens on the one socket.
+		 *
+		 * @param[in] fd File descriptor to listen on.
+		 * @param[in] count Amount of shards. If zero, one per hardware thread.
+		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM and SIGUSR1.
+		 */
+		ShardedManagerPar(int fd, unsigned int count, bool doSetupSignals);
+
+		//! Listening file descriptor for each shard
+		std::vector<int> fds;
+
+		//! Every shard
+		/*!
+		 * This is filled by the derived class.
+		 */
+		std::vector<ManagerPar*> shards;
+
+		//! The handler() function of every shard
+		std::vector<boost::function<void()> > handlers;
+
+	private:
+		//! Listening sockets created by us that need closing
+		std::vector<int> ownFds;
+
+		//! True if shard threads should be pinned to CPUs
+		bool m_pin;
+
+		//! Bind a new socket with SO_REUSEPORT to the address of another
+		/*!
+		 * @param[in] fd Listening socket to copy the address of.
+		 * @return New listening socket or -1 if one couldn't be created.
+		 */
+		static int reusePort(int fd);
+
+		//! Pin the calling thread to a CPU and run a shard's handler
+		void run(unsigned int shard, int cpu);
+
+		//! General function to handler POSIX signals
+		static void signalHandler(int signum);
+		//! Pointer to the %ShardedManager object
+		static ShardedManagerPar* instance;
+	};
+
+	//! Runs multiple independant managers in parallel
+	/*!
+	 * Rather than a single Manager and Transceiver doing all communication in a
+	 * single thread, this class runs a number of them each in their own thread.
+	 * The shards share nothing, each has it's own requests, tasks and connections.
+	 * To operate this class all that needs to be done is creating an object and
+	 * calling handler() on it.
+	 *
+	 * @tparam T Class that will handle individual requests. Should be derived from
+	 * the Request class.
+	 */
+	template<class T> class ShardedManager: public ShardedManagerPar
+	{
+	public:
+		//! Construct from a file descriptor
+		/*!
+		 * @param[in] count Amount of shards. If zero, one per hardware thread.
+		 * @param[in] fd File descriptor to listen on.
+		 * @param[in] doSetupSignals If true, signal handlers will be set up for SIGTERM and SIGUSR1. If false, no signal handlers will be set up.
+		 * @param[in] backend Mechanism each Transceiver should use to wait on file descriptors.
+		 */
+		ShardedManager(unsigned int count=0, int fd=0, bool doSetupSignals=true, EventBackend backend=defaultEventBackend): ShardedManagerPar(fd, count, doSetupSignals)
+		{
+			for(std::vector<int>::const_iterator it=fds.begin(); it!=fds.end(); ++it)
+			{{
+				managers.push_back(boost::shared_ptr<Manager<T> >(new Manager<T>(*it, false, backend)));
+				shards.push_back(managers.back().get());
+				handlers.push_back(boost::bind(&Manager<T>::handler, managers.back().get()));
+			}}
+		}
+
+		//! Access an individual shard
+		Manager<T>& shard(size_t index) { return *managers[index]; }
+
+		//! Keep finished request objects for reuse on every shard
+		/*!
+		 * @sa Manager::setRequestPool()
+		 */
+		void setRequestPool(size_t size)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setRequestPool(size);
+		}
+
+		//! Set the amount of worker threads that run request handlers on every shard
+		/*!
+		 * Each shard gets a pool of this many workers of it's own.
+		 *
+		 * @sa Manager::setWorkers()
+		 */
+		void setWorkers(unsigned int count)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setWorkers(count);
+		}
+
+		//! Set a deadline for every request on every shard
+		/*!
+		 * @sa Manager::setRequestTimeout()
+		 */
+		void setRequestTimeout(const boost::posix_time::time_duration& timeout)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setRequestTimeout(timeout);
+		}
+
+		//! Let the other side shorten the deadline of a request on every shard
+		/*!
+		 * @sa Manager::setDeadlineVariable()
+		 */
+		void setDeadlineVariable(const std::string& name)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setDeadlineVariable(name);
+		}
+
+		//! Parse the parameters of requests lazily on every shard
+		/*!
+		 * @sa Manager::setLazyEnvironment()
+		 */
+		void setLazyEnvironment(bool lazy)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setLazyEnvironment(lazy);
+		}
+
+		//! Set the limits the other side is told about and held to on every shard
+		/*!
+		 * The limits apply to each shard separately.
+		 *
+		 * @sa ManagerPar::setLimits()
+		 */
+		void setLimits(unsigned int maxConns, unsigned int maxReqs, bool mpxsConns=true)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setLimits(maxConns, maxReqs, mpxsConns);
+		}
+
+		//! Shed new requests while tasks wait too long to be handled on every shard
+		/*!
+		 * Each shard measures and sheds separately.
+		 *
+		 * @sa ManagerPar::setLoadShedding()
+		 */
+		void setLoadShedding(const boost::posix_time::time_duration& target, const boost::posix_time::time_duration& interval=boost::posix_time::milliseconds(100))
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setLoadShedding(target, interval);
+		}
+
+		//! Set the callback that creates request objects for every shard
+		void setRequestCreatorCallback(typename Manager<T>::RequestCreatorCallback callback)
+		{
+			for(typename std::vector<boost::shared_ptr<Manager<T> > >::iterator it=managers.begin(); it!=managers.end(); ++it)
+				(*it)->setRequestCreatorCallback(callback);
+		}
+
+	private:
+		std::vector<boost::shared_ptr<Manager<T> > > managers;
 	};
 }
 
@@ -266,14 +812,19 @@ template<class T> void Fastcgipp::Manager<T>::push(Protocol::FullId id, Message
 
 	if(id.fcgiId)
 	{
-		shared_lock<shared_mutex> reqReadLock(requests);
-		typename Requests::iterator it(requests.find(id));
-		if(it!=requests.end())
+		const boost::intrusive_ptr<T> existing(requests.find(id));
+		// Requests leave the table before their END_REQUEST is queued, so one still holding the id was given up on by the other side and is replaced below
+		if(existing && !(!message.type && ((Header*)message.data.get())->getType()==BEGIN_REQUEST))
 		{
-			lock_guard<mutex> mesLock(it->second->messages);
-			it->second->messages.push(message);
-			lock_guard<mutex> tasksLock(tasks);
-			tasks.push_back(id);
+			boost::lock_guard<boost::mutex> mesLock(existing->messages);
+			existing->messages.push(message);
+			if(workers)
+			{
+				// Going straight to the workers ties the task to this very request object
+				schedule(existing);
+				return;
+			}
+			tasks.push(Task(id, existing->generation));
 		}
 		else if(!message.type)
 		{
@@ -282,118 +833,333 @@ template<class T> void Fastcgipp::Manager<T>::push(Protocol::FullId id, Message
 			{
 				BeginRequest& body=*(BeginRequest*)(message.data.get()+sizeof(Header));
 
-				reqReadLock.unlock();
-				unique_lock<shared_mutex> reqWriteLock(requests);
-
-				boost::shared_ptr<T>& request = requests[id];
+				// The new request takes the place of the old one rather than joining it
+				if(existing)
+					abandon(existing);
 
-				if (m_requestCreatorCallback)
+				if(!mpxsConns && requests.size(id.fd))
+				{
+					reject(id, CANT_MPX_CONN, !body.getKeepConn());
+					return;
+				}
+				if((maxReqs && requests.size()>=maxReqs) || (maxConns && transceiver.connections()>maxConns))
 				{
-				    request.reset(m_requestCreatorCallback());
+					reject(id, OVERLOADED, !body.getKeepConn());
+					return;
 				}
-				else
+
+				boost::intrusive_ptr<T> request(pool.limit? pool.take(): 0);
+
+				if (!request)
 				{
-				    request.reset(new T);
+				    if (m_requestCreatorCallback)
+				    {
+				        request.reset(m_requestCreatorCallback());
+				    }
+				    else
+				    {
+				        request.reset(new T);
+				    }
+
+				    if (pool.limit)
+				        request->m_recycler=&pool;
 				}
 
+				request->generation=++generation;
 				request->set(
 					id,
 					transceiver,
 					body.getRole(),
 					!body.getKeepConn(),
-					boost::bind(&Manager::push, boost::ref(*this), id, _1),
-					boost::bind(&Manager::removeTasks, boost::ref(*this), id)
+					boost::bind(&Manager::push, boost::ref(*this), id, _1)
 				);
+
+				request->timers=&timers;
+				request->deadlineVariable=deadlineVariable.empty()?0:&deadlineVariable;
+				request->maxDeadline=requestTimeout;
+				request->m_environment.setLazy(lazyEnvironment);
+				request->m_table=&releaser;
+				if(requestTimeout)
+					timers.schedule(request->deadlineTimer, requestTimeout, Task(id, request->generation), Message(T::deadlineMessage));
+
+				requests.insert(id, request);
 			}
 			else
 				return;
 		}
 	}
+	else if(message.type==Transceiver::closedMessage)
+	{
+		// Handled right away as the file descriptor may be reused by the next connection accepted
+		std::vector<boost::intrusive_ptr<T> > closed;
+		requests.find(id.fd, closed);
+		for(typename std::vector<boost::intrusive_ptr<T> >::const_iterator it=closed.begin(); it!=closed.end(); ++it)
+			abandon(*it);
+		return;
+	}
 	else
 	{
 		messages.push(message);
-		tasks.push_back(id);
+		tasks.push(Task(id, 0));
 	}
 
-	lock_guard<mutex> sleepLock(sleepMutex);
-	if(asleep)
-		transceiver.wake();
+	wake();
+}
+
+template<class T> void Fastcgipp::Manager<T>::abandon(const boost::intrusive_ptr<T>& request)
+{
+	request->cancel();
+	timers.cancel(request->wakeTimer);
+	timers.cancel(request->deadlineTimer);
+	erase(request.get());
+}
+
+template<class T> void Fastcgipp::Manager<T>::setRequestPool(size_t size)
+{
+	std::vector<T*> surplus;
+	{
+		boost::lock_guard<boost::mutex> poolLock(pool);
+		pool.limit=size;
+		if(pool.size()>size)
+		{
+			surplus.assign(pool.begin()+size, pool.end());
+			pool.resize(size);
+		}
+	}
+
+	for(typename std::vector<T*>::iterator it=surplus.begin(); it!=surplus.end(); ++it)
+		delete *it;
 }
 
 template<class T> void Fastcgipp::Manager<T>::handler()
+{
+	boost::thread_group threads;
+	if(workers)
+	{
+		transceiver.setConcurrentWrites(true);
+		ready.stop=false;
+		for(unsigned int i=0; i<workers; ++i)
+			threads.create_thread(boost::bind(&Manager::worker, this));
+	}
+
+	try
+	{
+		loop();
+	}
+	catch(...)
+	{
+		stopWorkers(threads);
+		throw;
+	}
+
+	stopWorkers(threads);
+}
+
+template<class T> void Fastcgipp::Manager<T>::stopWorkers(boost::thread_group& threads)
+{
+	if(!workers)
+		return;
+
+	{
+		boost::lock_guard<boost::mutex> readyLock(ready);
+		ready.stop=true;
+	}
+	ready.condition.notify_all();
+	threads.join_all();
+	transceiver.setConcurrentWrites(false);
+}
+
+template<class T> void Fastcgipp::Manager<T>::loop()
 {
 	using namespace std;
 	using namespace boost;
 
 	while(1)
 	{{
+		if(stopBool.exchange(false))
+			return;
+
+		if(!timers.empty())
+			collectTimers();
+
+		bool sleep=transceiver.handler();
+
+		if(terminateBool && sleep && idle())
 		{
-			lock_guard<mutex> stopLock(stopMutex);
-			if(stopBool)
-			{
-				stopBool=false;
-				return;
-			}
+			terminateBool=false;
+			return;
 		}
 
-		bool sleep=transceiver.handler();
+		Task task;
+		if(!tasks.pop(task))
+		{
+			asleep=true;
+			// Anything pushed from here on either shows up below or wakes us
+			boost::atomic_thread_fence(boost::memory_order_seq_cst);
+			const bool halting=stopBool || (terminateBool && idle());
+			if(sleep && !halting && tasks.empty()) transceiver.sleep(timers.timeout());
+			asleep=false;
 
+			continue;
+		}
+
+		// With worker threads the time spent here is measured along with that spent in the ready queue
+		const bool overloaded=!workers && shedder.dequeued(task.queued);
+
+		if(task.id.fcgiId==0)
+			localHandler(task.id);
+		else if(workers)
+			dispatch(task);
+		else
 		{
-			lock_guard<mutex> terminateLock(terminateMutex);
-			if(terminateBool)
+			const boost::intrusive_ptr<T> request(requests.find(task.id));
+			if(!request || request->generation!=task.generation)
+				continue;
+			if(overloaded && request->sheddable())
 			{
-				shared_lock<shared_mutex> requestsLock(requests);
-				if(requests.empty() && sleep)
-				{
-					terminateBool=false;
-					return;
-				}
+				request->shed();
+				shedder.shed();
+				requests.erase(task.id, request.get());
 			}
+			else if(request->handler())
+				requests.erase(task.id, request.get());
 		}
+	}}
+}
 
-		unique_lock<mutex> tasksLock(tasks);
-		unique_lock<mutex> sleepLock(sleepMutex);
+template<class T> void Fastcgipp::Manager<T>::collectTimers()
+{
+	using namespace boost;
 
-		if(tasks.empty())
-		{
-			tasksLock.unlock();
+	timers.collect(expired);
 
-			asleep=true;
-			sleepLock.unlock();
+	for(TimerWheel::Expired::iterator it=expired.begin(); it!=expired.end(); ++it)
+	{{
+		const boost::intrusive_ptr<T> request(requests.find(it->first.id));
+		if(!request || request->generation!=it->first.generation)
+			continue;
 
-			if(sleep) transceiver.sleep();
+		lock_guard<mutex> mesLock(request->messages);
+		request->messages.push(it->second);
+		if(workers)
+			schedule(request);
+		else
+			tasks.push(it->first);
+	}}
 
-			sleepLock.lock();
-			asleep=false;
-			sleepLock.unlock();
+	expired.clear();
+}
 
-			continue;
-		}
+template<class T> void Fastcgipp::Manager<T>::dispatch(const Task& task)
+{
+	using namespace boost;
 
-		sleepLock.unlock();
+	const boost::intrusive_ptr<T> request(requests.find(task.id));
+	if(!request || request->generation!=task.generation)
+		return;
 
-		Protocol::FullId id=tasks.front();
-		tasks.pop_front();
-		tasksLock.unlock();
+	lock_guard<mutex> mesLock(request->messages);
+	schedule(request, task.queued);
+}
 
-		if(id.fcgiId==0)
-			localHandler(id);
-		else
+template<class T> void Fastcgipp::Manager<T>::schedule(const boost::intrusive_ptr<T>& request, long long queued)
+{
+	if(request->pendingTasks++)
+		return;
+
+	request->queued=queued;
+	{
+		boost::lock_guard<boost::mutex> readyLock(ready);
+		ready.push_back(request);
+	}
+	ready.condition.notify_one();
+}
+
+template<class T> void Fastcgipp::Manager<T>::worker()
+{
+	using namespace boost;
+
+	while(1)
+	{{
+		boost::intrusive_ptr<T> request;
 		{
-			shared_lock<shared_mutex> reqReadLock(requests);
-			typename map<Protocol::FullId, boost::shared_ptr<T> >::iterator it(requests.find(id));
-			if (it!=requests.end())
+			unique_lock<mutex> readyLock(ready);
+			while(ready.empty() && !ready.stop)
+				ready.condition.wait(readyLock);
+			// Anything still queued is picked up when handler() is called again
+			if(ready.stop)
+				return;
+			request=ready.front();
+			ready.pop_front();
+			++ready.handling;
+		}
+
+		if(requests.find(request->id)!=request)
+		{
+			// Abandoned while it waited so there is nobody left to answer
+		}
+		else if(shedder.dequeued(request->queued) && request->sheddable())
+		{
+			request->shed();
+			shedder.shed();
+			erase(request.get());
+		}
+		else for(unsigned int handled=1; true; ++handled)
+		{{
+			if(request->handler())
 			{
-				if (it->second->handler())
-				{
-					reqReadLock.unlock();
-					unique_lock<shared_mutex> reqWriteLock(requests);
+				erase(request.get());
+				break;
+			}
 
-					requests.erase(it);
+			lock_guard<mutex> mesLock(request->messages);
+			if(!--request->pendingTasks)
+				break;
+
+			if(handled>=turnTasks)
+			{
+				// Go to the back of the line should others be waiting
+				unique_lock<mutex> readyLock(ready);
+				if(!ready.empty())
+				{
+					request->queued=LoadShedder::now();
+					ready.push_back(request);
+					readyLock.unlock();
+					ready.condition.notify_one();
+					break;
 				}
+				handled=0;
 			}
+		}}
+
+		bool last;
+		{
+			lock_guard<mutex> readyLock(ready);
+			last=!--ready.handling;
 		}
+		// Requests leave the table before they are done writing so the handler() thread waits for us
+		if(last && terminateBool && requests.empty())
+			wake();
 	}}
 }
 
+template<class T> bool Fastcgipp::Manager<T>::idle()
+{
+	if(!requests.empty())
+		return false;
+	if(!workers)
+		return true;
+	boost::lock_guard<boost::mutex> readyLock(ready);
+	return !ready.handling;
+}
+
+template<class T> void Fastcgipp::Manager<T>::erase(T* request)
+{
+	requests.erase(request->id, request);
+
+	// The handler() thread may be asleep waiting for the last request to terminate
+	if(requests.empty() && terminateBool)
+		wake();
+}
+
 #endif
@@ -21,8 +21,12 @@
 #ifndef MESSAGE_HPP
 #define MESSAGE_HPP
 
+#include <algorithm>
+
 #include <boost/shared_array.hpp>
 
+#include <fastcgi++/bufferpool.hpp>
+
 namespace Fastcgipp
 {
 	//! Data structure used to pass messages within the fastcgi++ task management system
@@ -39,6 +43,16 @@ namespace Fastcgipp
 	{
 		Message(const int type_): type(type_), size(0) {}
 		Message(): type(0), size(0) {}
+		//! Construct a message with a data section of the specified size taken from BufferPool
+		Message(const int type_, const size_t size_): type(type_), size(size_), data(BufferPool::allocate(size_)) {}
+
+		//! Exchange contents with another message without touching reference counts
+		void swap(Message& x)
+		{
+			std::swap(type, x.type);
+			std::swap(size, x.size);
+			data.swap(x.data);
+		}
 		
 		//! Type of message. A 0 means FastCGI record. Anything else is open.
 		int type;
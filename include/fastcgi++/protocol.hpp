@@ -414,13 +414,6 @@ namespace Fastcgipp
 				header.setPaddingLength(PADDINGLENGTH);
 			}
 		};
-
-		//! Reply record that will be sent when asked the maximum allowed file descriptors open at a time
-		extern ManagementReply<14, 2, 8> maxConnsReply;
-		//! Reply record that will be sent when asked the maximum allowed requests at a time
-		extern ManagementReply<13, 2, 1> maxReqsReply;
-		//! Reply record that will be sent when asked if requests can be multiplexed over a single connections
-		extern ManagementReply<15, 1, 8> mpxsConnsReply;
 	}
 }
 
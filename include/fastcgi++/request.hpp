@@ -23,19 +23,24 @@
 #define REQUEST_HPP
 
 #include <queue>
+#include <vector>
 #include <map>
+#include <climits>
+#include <cstdlib>
 #include <string>
 #include <locale>
 
 #include <boost/shared_array.hpp>
 #include <boost/thread.hpp>
 #include <boost/function.hpp>
+#include <boost/atomic.hpp>
 
 #include <fastcgi++/transceiver.hpp>
 #include <fastcgi++/protocol.hpp>
 #include <fastcgi++/exceptions.hpp>
 #include <fastcgi++/fcgistream.hpp>
 #include <fastcgi++/http.hpp>
+#include <fastcgi++/timerwheel.hpp>
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
@@ -67,7 +72,7 @@ namespace Fastcgipp
 		 * post data. Any data beyond this size would result in a call to
 		 * bigPostErrorHandler(). A value of 0 represents unlimited.
 		 */
-		Request(const size_t maxPostSize=0): m_maxPostSize(maxPostSize), state(Protocol::PARAMS)  {
+		Request(const size_t maxPostSize=0): m_maxPostSize(maxPostSize), state(Protocol::PARAMS), generation(0), pendingTasks(0), refCount(0), m_recycler(0), m_table(0), timers(0), deadlineVariable(0), maxDeadline(0)  {
 			setloc(std::locale::classic());
 			out.exceptions(std::ios_base::badbit | std::ios_base::failbit | std::ios_base::eofbit);
 			m_environment.clearPostBuffer();
@@ -75,7 +80,14 @@ namespace Fastcgipp
 
 		virtual ~Request()
 		{
-			removeTasksCallback();
+			// Nobody will read the response of a request that never completed
+			if(state!=Protocol::END_REQUEST)
+				cancel();
+			if(timers)
+			{
+				timers->cancel(wakeTimer);
+				timers->cancel(deadlineTimer);
+			}
 		}
 
 		//! Accessor for  the data structure containing all HTTP environment data
@@ -109,6 +121,16 @@ namespace Fastcgipp
 		//! Called when too much post data is recieved.
 		virtual void bigPostErrorHandler();
 
+		//! Called when the deadline of the request passes.
+		/*!
+		 * By default a standard 504 Gateway Timeout message is sent to the user unless part
+		 * of the response has already been written, in which case what was written is all
+		 * the user gets. The request is completed afterwards.
+		 *
+		 * @sa setDeadline()
+		 */
+		virtual void timeoutHandler();
+
 		//! See the requests role
 		Protocol::Role role() const { return m_role; }
 
@@ -126,11 +148,48 @@ namespace Fastcgipp
 		 */
 		const boost::function<void(Message)>& callback() const { return m_callback; }
 
-		//! Accessor for the undo callback function for dealings outside the fastcgi++ library
+		//! Have a message passed to response() once a delay has passed
 		/*!
-		 * This function should be called to undo any callback in case an exception occurs.
+		 * The message is delivered as if it had been passed to callback() when the delay
+		 * runs out, without the need for a thread or timer of your own. Each request has a
+		 * single such timer so calling this again replaces the message and delay. Safe to
+		 * call from any thread.
+		 *
+		 * @param[in] delay Time to wait. A special value such as boost::posix_time::pos_infin cancels the timer.
+		 * @param[in] message The message to pass
 		 */
-		const void removeTasksCallback() const { m_removeTasksCallback(); }
+		void wakeAfter(const boost::posix_time::time_duration& delay, const Message& message);
+
+		//! Complete the request with timeoutHandler() should it not be complete within a time
+		/*!
+		 * Whatever the request is waiting on, it is completed once the deadline passes. This
+		 * replaces any deadline set before, including the one set through
+		 * Manager::setRequestTimeout(). Safe to call from any thread.
+		 *
+		 * @param[in] timeout Time from now. A special value such as boost::posix_time::pos_infin removes the deadline.
+		 */
+		void setDeadline(const boost::posix_time::time_duration& timeout);
+
+		//! Message type reserved for the expiry of the deadline
+		static const int deadlineMessage=INT_MIN+1;
+
+		//! Have a function called should the request be cancelled
+		/*!
+		 * A request is cancelled when the other side aborts it, when its deadline passes or
+		 * when it is destroyed without having completed. Nobody is going to read the response
+		 * by then so anything still working on it should stop. The functions registered are
+		 * dropped once the request completes. Safe to call from any thread.
+		 *
+		 * To have an ASql query cancelled, and interrupted on the server should it be
+		 * executing, pass boost::bind(&ASql::QueryPar::cancel, query).
+		 *
+		 * @param[in] canceller Function to call
+		 */
+		void onCancel(const boost::function<void()>& canceller)
+		{
+			boost::lock_guard<boost::mutex> lock(cancellers);
+			cancellers.push_back(canceller);
+		}
 
 		//! Set the requests locale
 		/*!
@@ -150,6 +209,38 @@ namespace Fastcgipp
 		 */
 		const std::locale& getloc(){ return loc; }
 
+		//! Takes back requests that are no longer referenced so they can be reused
+		/*!
+		 * @sa Manager::setRequestPool()
+		 */
+		class Recycler
+		{
+		public:
+			typedef Request Recyclable;
+			//! Called instead of deleting a request once the last reference to it is released
+			virtual void recycle(Recyclable* request) =0;
+		protected:
+			~Recycler() { }
+		};
+
+		//! Takes requests out of the table of active requests they are kept in
+		/*!
+		 * @sa Manager
+		 */
+		class Table
+		{
+		public:
+			typedef Request Entry;
+			//! Called right before the request queues it's END_REQUEST record
+			/*!
+			 * Once the other side has the record it may start another request on the
+			 * connection, and that must not find this one still counted.
+			 */
+			virtual void release(Entry* request) =0;
+		protected:
+			~Table() { }
+		};
+
 	protected:
 		//! Response generator
 		/*!
@@ -173,7 +264,7 @@ namespace Fastcgipp
 		 *
 		 * @param[in] bytesReceived Amount of bytes received in this FastCGI record
 		 */
-		virtual void inHandler(int bytesReceived) { };
+		virtual void inHandler(int bytesReceived) { (void)bytesReceived; }
 
 		//! Process custom POST data
 		/*!
@@ -192,6 +283,21 @@ namespace Fastcgipp
 		 */
 		bool virtual inProcessor() { return false; }
 
+		//! Reset user state before the request object is reused
+		/*!
+		 * Should the Manager keep finished requests for reuse, this function is called
+		 * once a request has completed and before it is handed the next one. Override it
+		 * to return any members of the derived class to the state the next request expects
+		 * them to be in. The environment, streams and messages have already been reset.
+		 * Anything set up in the constructor, including the locale, is kept. Throwing an
+		 * exception prevents the object from being reused.
+		 *
+		 * This may be called from any thread.
+		 *
+		 * @sa Manager::setRequestPool()
+		 */
+		virtual void reset() { }
+
 		//! The message associated with the current handler() call.
 		/*!
 		 * This is only of use to the library user when a non FastCGI (type=0) Message is passed
@@ -230,9 +336,6 @@ namespace Fastcgipp
 		 */
 		boost::function<void(Message)> m_callback;
 
-		//! Undo callback function for dealings outside the fastcgi++ library
-		boost::function<void()> m_removeTasksCallback;
-
 		//! The data structure containing all HTTP environment data
 		Http::Environment<charT> m_environment;
 
@@ -245,6 +348,18 @@ namespace Fastcgipp
 		//! A queue of messages to be handler by the request
 		Messages messages;
 
+		//! Container type for the functions registered through onCancel()
+		/*!
+		 * This is merely a derivation of a std::vector<boost::function<void()> > and a
+		 * boost::mutex that gives data locking abilities to the STL container.
+		 */
+		class Cancellers: public std::vector<boost::function<void()> >, public boost::mutex {};
+		//! Functions to call should the request be cancelled
+		Cancellers cancellers;
+
+		//! Call and drop the functions registered through onCancel()
+		void cancel();
+
 		//! The maximum amount of post data that can be recieved
 		const size_t m_maxPostSize;
 
@@ -267,8 +382,63 @@ namespace Fastcgipp
 		bool killCon;
 		//! What the request is current doing
 		Protocol::RecordType state;
+		//! Tells the tasks of this request apart from those of an earlier one with the same id
+		unsigned int generation;
+		//! Amount of tasks handed to worker threads and not yet handled
+		/*!
+		 * Guarded by the messages mutex. Only used when the Manager runs worker threads.
+		 */
+		unsigned int pendingTasks;
+		//! Time the task that last queued the request for a worker thread was received at as returned by LoadShedder::now()
+		long long queued;
+		//! Amount of references held to the request through boost::intrusive_ptr
+		boost::atomic<unsigned int> refCount;
+		//! Where the request goes once unreferenced. If null it is deleted.
+		Recycler* m_recycler;
+		//! Table of active requests the request is in. Null if none.
+		Table* m_table;
+		//! Timers of the Manager the request belongs to
+		TimerWheel* timers;
+		//! Timer behind wakeAfter()
+		TimerWheel::Timer wakeTimer;
+		//! Timer behind setDeadline()
+		TimerWheel::Timer deadlineTimer;
+		//! Name of the parameter a deadline is taken from. Null if none.
+		/*!
+		 * @sa Manager::setDeadlineVariable()
+		 */
+		const std::string* deadlineVariable;
+		//! Longest deadline in milliseconds taken from deadlineVariable. 0 means no limit.
+		long long maxDeadline;
+		friend void intrusive_ptr_add_ref(Request* request) { request->refCount.fetch_add(1, boost::memory_order_relaxed); }
+		friend void intrusive_ptr_release(Request* request)
+		{
+			if(request->refCount.fetch_sub(1, boost::memory_order_release)==1)
+			{
+				boost::atomic_thread_fence(boost::memory_order_acquire);
+				if(request->m_recycler)
+					request->m_recycler->recycle(request);
+				else
+					delete request;
+			}
+		}
+		//! Return the request to the state it was in before set() so it can be reused
+		/*!
+		 * @return False if the request can't be reused as it never completed
+		 */
+		bool recycle();
 		//! Generates an END_REQUEST FastCGI record
 		void complete();
+		//! Complete the request with a prebuilt 503 Service Unavailable response
+		/*!
+		 * Nothing is formatted or passed through the output stream so turning a request
+		 * away costs next to nothing.
+		 *
+		 * @sa Manager::setLoadShedding()
+		 */
+		void shed();
+		//! True if the request is new enough to be shed as it has yet to receive all parameters
+		bool sheddable() const { return state==Protocol::PARAMS; }
 		//! Set's up the request with the data it needs.
 		/*!
 		 * This function is an "after-the-fact" constructor that build vital initial data for the request.
@@ -284,8 +454,7 @@ namespace Fastcgipp
 			Transceiver& transceiver_,
 			Protocol::Role role_,
 			bool killCon_,
-			boost::function<void(Message)> callback_,
-			boost::function<void()> removeTasksCallback_
+			boost::function<void(Message)> callback_
 		)
 		{
 			killCon=killCon_;
@@ -293,7 +462,6 @@ namespace Fastcgipp
 			transceiver=&transceiver_;
 			m_role=role_;
 			m_callback=callback_;
-			m_removeTasksCallback=removeTasksCallback_;
 
 			err.set(id_, transceiver_, Protocol::ERR);
 			out.set(id_, transceiver_, Protocol::OUT);
@@ -0,0 +1,370 @@
+//! \file requesttable.hpp Defines the Fastcgipp::RequestTable class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef REQUESTTABLE_HPP
+#define REQUESTTABLE_HPP
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <fastcgi++/protocol.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Table of active requests indexed by file descriptor and FastCGI request id
+	/*!
+	 * Rather than an associative container under a single lock, requests are kept in
+	 * a flat table with a slot for every possible file descriptor and request id. The
+	 * slots of a file descriptor lie in a Connection, which are allocated a page at a
+	 * time the first time a descriptor in the page is used and kept until the table
+	 * is destroyed. The pages cover every 16 bit file descriptor. Connections for
+	 * descriptors beyond that are allocated one at a time, kept in a map under a lock
+	 * of their own and likewise kept until the table is destroyed. Each connection
+	 * has slots for the first few request ids inline. Higher ids, which only show up
+	 * on multiplexed connections, get slots of their own under a lock local to the
+	 * connection.
+	 *
+	 * Looking a request up never locks for descriptors below 65536 and request ids
+	 * up to 8. Beyond those the lock of the map or of the connection's overflow slots
+	 * is taken to find the slot. Every slot counts the readers currently inside it.
+	 * A request is only released by the table once it has been taken out of its slot
+	 * and the slot has no readers left, so a reader that found it is certain to have
+	 * added its reference first.
+	 *
+	 * @tparam T Type of the requests. Reference counted through intrusive_ptr_add_ref() and intrusive_ptr_release().
+	 */
+	template<class T> class RequestTable
+	{
+	public:
+		//! Pointer type sharing ownership of a request
+		typedef boost::intrusive_ptr<T> Pointer;
+
+		RequestTable(): m_size(0)
+		{
+			for(unsigned int i=0; i<pageCount; ++i)
+				pages[i].store(0, boost::memory_order_relaxed);
+		}
+
+		~RequestTable();
+
+		//! Retrieve the request with a certain id. Safe to call from any thread.
+		/*!
+		 * @param[in] id Complete ID of the request
+		 * @return Pointer to the request. Null if there is none.
+		 */
+		Pointer find(Protocol::FullId id) const;
+
+		//! Retrieve every request on a file descriptor. Safe to call from any thread.
+		/*!
+		 * @param[in] fd The file descriptor
+		 * @param[out] requests Pointers to the requests are appended to this
+		 */
+		void find(int fd, std::vector<Pointer>& requests) const;
+
+		//! Put a request in the table
+		/*!
+		 * Should a request already have the id, it is replaced. Only one thread may
+		 * insert at a time.
+		 *
+		 * @param[in] id Complete ID of the request
+		 * @param[in] request The request
+		 */
+		void insert(Protocol::FullId id, const Pointer& request);
+
+		//! Take a request out of the table. Safe to call from any thread.
+		/*!
+		 * @param[in] id Complete ID of the request
+		 * @param[in] request The request expected to have the id
+		 * @return False if the id is held by another request or none at all
+		 */
+		bool erase(Protocol::FullId id, const T* request);
+
+		//! Amount of requests in the table
+		size_t size() const { return m_size.load(boost::memory_order_relaxed); }
+		//! True if there are no requests in the table
+		bool empty() const { return !size(); }
+
+		//! Amount of requests in the table on a single file descriptor
+		/*!
+		 * @param[in] fd The file descriptor
+		 */
+		size_t size(int fd) const
+		{
+			const Connection* const connection=locate(fd, false);
+			return connection? connection->size.load(boost::memory_order_relaxed): 0;
+		}
+
+	private:
+		//! Holds the request with a single id
+		struct Slot
+		{
+			Slot(): request(0), readers(0) { }
+			//! The request. The slot holds a reference to it.
+			boost::atomic<T*> request;
+			//! Amount of threads currently retrieving the request
+			mutable boost::atomic<unsigned int> readers;
+		};
+
+		//! Slots for request ids too high to be kept inline
+		struct Overflow: public std::map<Protocol::RequestId, Slot*>, public boost::mutex
+		{
+			~Overflow()
+			{
+				for(typename std::map<Protocol::RequestId, Slot*>::iterator it=this->begin(); it!=this->end(); ++it)
+					delete it->second;
+			}
+		};
+
+		//! Amount of request ids each connection has inline slots for
+		const static unsigned int inlineSlots=8;
+
+		//! The slots of a single file descriptor
+		struct Connection
+		{
+			Connection(): overflow(0), size(0) { }
+			~Connection() { delete overflow.load(boost::memory_order_relaxed); }
+			//! Slots for request ids 1 through inlineSlots
+			Slot slots[inlineSlots];
+			//! Slots for higher request ids. Null until one is needed.
+			boost::atomic<Overflow*> overflow;
+			//! Amount of requests in the slots
+			boost::atomic<unsigned int> size;
+		};
+
+		//! Amount of connections allocated together
+		const static unsigned int pageSize=256;
+		//! Enough pages for every 16 bit file descriptor
+		const static unsigned int pageCount=65536/pageSize;
+		//! Pages of connections. Null until a descriptor in them is used.
+		boost::atomic<Connection*> pages[pageCount];
+
+		//! Connections of file descriptors too high to be in a page
+		std::map<int, Connection*> highConnections;
+		//! Mutex to make accessing highConnections thread safe
+		mutable boost::mutex highConnectionsMutex;
+
+		//! Amount of requests in the table
+		boost::atomic<size_t> m_size;
+
+		//! Find the slots of a file descriptor
+		/*!
+		 * @param[in] fd The file descriptor
+		 * @param[in] create If true, allocate the page of connections should it not exist
+		 * @return The slots. Null if create is false and they don't exist.
+		 */
+		Connection* locate(int fd, bool create) const;
+
+		//! Find the slot for an id
+		/*!
+		 * @param[in] id Complete ID of the request
+		 * @param[in] create If true, allocate whatever is needed for the slot to exist
+		 * @return The slot. Null if create is false and it doesn't exist.
+		 */
+		Slot* locate(Protocol::FullId id, bool create) const;
+
+		//! Release the references held by every slot of a connection
+		static void release(Connection& connection);
+
+		//! Release the reference held by a slot once it has no readers left
+		void retire(const Slot& slot, T* request);
+
+		RequestTable(const RequestTable&);
+		RequestTable& operator=(const RequestTable&);
+	};
+}
+
+template<class T> Fastcgipp::RequestTable<T>::~RequestTable()
+{
+	for(unsigned int i=0; i<pageCount; ++i)
+	{{
+		Connection* page=pages[i].load(boost::memory_order_acquire);
+		if(!page)
+			continue;
+
+		for(unsigned int j=0; j<pageSize; ++j)
+			release(page[j]);
+
+		delete [] page;
+	}}
+
+	for(typename std::map<int, Connection*>::iterator it=highConnections.begin(); it!=highConnections.end(); ++it)
+	{{
+		release(*it->second);
+		delete it->second;
+	}}
+}
+
+template<class T> void Fastcgipp::RequestTable<T>::release(Connection& connection)
+{
+	for(unsigned int i=0; i<inlineSlots; ++i)
+		if(T* request=connection.slots[i].request.load(boost::memory_order_relaxed))
+			intrusive_ptr_release(request);
+
+	if(Overflow* overflow=connection.overflow.load(boost::memory_order_relaxed))
+		for(typename Overflow::iterator it=overflow->begin(); it!=overflow->end(); ++it)
+			if(T* request=it->second->request.load(boost::memory_order_relaxed))
+				intrusive_ptr_release(request);
+}
+
+template<class T> typename Fastcgipp::RequestTable<T>::Connection* Fastcgipp::RequestTable<T>::locate(int fd, bool create) const
+{
+	if((unsigned int)fd >= pageCount*pageSize)
+	{
+		boost::lock_guard<boost::mutex> highConnectionsLock(highConnectionsMutex);
+		std::map<int, Connection*>& connections=const_cast<std::map<int, Connection*>&>(highConnections);
+		typename std::map<int, Connection*>::iterator it(connections.find(fd));
+		if(it!=connections.end())
+			return it->second;
+		if(!create)
+			return 0;
+		return connections[fd]=new Connection;
+	}
+
+	boost::atomic<Connection*>& pagePointer=const_cast<boost::atomic<Connection*>&>(pages[fd/pageSize]);
+	Connection* page=pagePointer.load(boost::memory_order_acquire);
+	if(!page)
+	{
+		if(!create)
+			return 0;
+		Connection* newPage=new Connection[pageSize];
+		if(pagePointer.compare_exchange_strong(page, newPage, boost::memory_order_acq_rel, boost::memory_order_acquire))
+			page=newPage;
+		else
+			delete [] newPage;
+	}
+	return &page[fd%pageSize];
+}
+
+template<class T> typename Fastcgipp::RequestTable<T>::Slot* Fastcgipp::RequestTable<T>::locate(Protocol::FullId id, bool create) const
+{
+	Connection* const connectionPointer=locate(id.fd, create);
+	if(!connectionPointer)
+		return 0;
+	Connection& connection=*connectionPointer;
+
+	if(id.fcgiId && id.fcgiId<=inlineSlots)
+		return &connection.slots[id.fcgiId-1];
+
+	Overflow* overflow=connection.overflow.load(boost::memory_order_acquire);
+	if(!overflow)
+	{
+		if(!create)
+			return 0;
+		Overflow* newOverflow=new Overflow;
+		if(connection.overflow.compare_exchange_strong(overflow, newOverflow, boost::memory_order_acq_rel, boost::memory_order_acquire))
+			overflow=newOverflow;
+		else
+			delete newOverflow;
+	}
+
+	boost::lock_guard<boost::mutex> overflowLock(*overflow);
+	typename Overflow::iterator it(overflow->find(id.fcgiId));
+	if(it!=overflow->end())
+		return it->second;
+	if(!create)
+		return 0;
+	return (*overflow)[id.fcgiId]=new Slot;
+}
+
+template<class T> typename Fastcgipp::RequestTable<T>::Pointer Fastcgipp::RequestTable<T>::find(Protocol::FullId id) const
+{
+	const Slot* slot=locate(id, false);
+	if(!slot)
+		return Pointer();
+
+	slot->readers.fetch_add(1, boost::memory_order_seq_cst);
+	Pointer request(slot->request.load(boost::memory_order_seq_cst));
+	slot->readers.fetch_sub(1, boost::memory_order_release);
+
+	return request;
+}
+
+template<class T> void Fastcgipp::RequestTable<T>::find(int fd, std::vector<Pointer>& requests) const
+{
+	const Connection* const connection=locate(fd, false);
+	if(!connection || !connection->size.load(boost::memory_order_relaxed))
+		return;
+
+	std::vector<Protocol::RequestId> ids;
+	for(unsigned int i=0; i<inlineSlots; ++i)
+		if(connection->slots[i].request.load(boost::memory_order_relaxed))
+			ids.push_back(i+1);
+	if(Overflow* overflow=connection->overflow.load(boost::memory_order_acquire))
+	{
+		boost::lock_guard<boost::mutex> overflowLock(*overflow);
+		for(typename Overflow::const_iterator it=overflow->begin(); it!=overflow->end(); ++it)
+			if(it->second->request.load(boost::memory_order_relaxed))
+				ids.push_back(it->first);
+	}
+
+	// Looked up again as the slots may have changed hands since
+	for(std::vector<Protocol::RequestId>::const_iterator it=ids.begin(); it!=ids.end(); ++it)
+		if(const Pointer request=find(Protocol::FullId(*it, fd)))
+			requests.push_back(request);
+}
+
+template<class T> void Fastcgipp::RequestTable<T>::insert(Protocol::FullId id, const Pointer& request)
+{
+	Slot& slot=*locate(id, true);
+
+	intrusive_ptr_add_ref(request.get());
+	T* old=slot.request.exchange(request.get(), boost::memory_order_seq_cst);
+	if(old)
+		retire(slot, old);
+	else
+	{
+		m_size.fetch_add(1, boost::memory_order_relaxed);
+		locate(id.fd, false)->size.fetch_add(1, boost::memory_order_relaxed);
+	}
+}
+
+template<class T> bool Fastcgipp::RequestTable<T>::erase(Protocol::FullId id, const T* request)
+{
+	Slot* slot=locate(id, false);
+	if(!slot)
+		return false;
+
+	T* old=const_cast<T*>(request);
+	if(!slot->request.compare_exchange_strong(old, 0, boost::memory_order_seq_cst))
+		return false;
+
+	m_size.fetch_sub(1, boost::memory_order_relaxed);
+	locate(id.fd, false)->size.fetch_sub(1, boost::memory_order_relaxed);
+	retire(*slot, old);
+	return true;
+}
+
+template<class T> void Fastcgipp::RequestTable<T>::retire(const Slot& slot, T* request)
+{
+	// Readers only stay long enough to add a reference
+	while(slot.readers.load(boost::memory_order_seq_cst))
+		boost::this_thread::yield();
+	intrusive_ptr_release(request);
+}
+
+#endif
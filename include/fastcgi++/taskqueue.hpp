@@ -0,0 +1,137 @@
+//! \file taskqueue.hpp Defines the Fastcgipp::TaskQueue class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef TASKQUEUE_HPP
+#define TASKQUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <fastcgi++/protocol.hpp>
+#include <fastcgi++/loadshedder.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! A pending call to the handler of a request or the Manager itself
+	struct Task
+	{
+		Task() { }
+		//! Construct from an id and the generation of the request it is meant for
+		/*!
+		 * @param[in] id_ Complete ID of the request
+		 * @param[in] generation_ Generation of the request the task was queued for
+		 */
+		Task(Protocol::FullId id_, unsigned int generation_): id(id_), generation(generation_) { }
+		//! Complete ID of the request
+		Protocol::FullId id;
+		//! Generation of the request the task was queued for
+		/*!
+		 * Request ids are reused. A task whose generation doesn't match that of the request
+		 * currently holding its id was meant for one that is gone and is discarded.
+		 */
+		unsigned int generation;
+		//! Time the task was pushed at as returned by LoadShedder::now()
+		long long queued;
+	};
+
+	//! Multiple producer, single consumer queue of tasks
+	/*!
+	 * Tasks are kept in a fixed size ring of cells, each carrying a sequence number
+	 * that tells producers and the consumer whose turn it is to use it. Pushing and
+	 * popping therefore never lock or allocate. Should the ring be full, tasks are
+	 * put on a mutex guarded overflow queue instead so a producer never has to wait
+	 * on the consumer. The overflow queue is only looked at once it is known to be
+	 * non-empty.
+	 *
+	 * The queue as a whole is therefore unbounded. Producers include the consumer
+	 * thread itself, so making them wait for room could deadlock, and dropping a task
+	 * would lose the record it stands for. Each task stands for a record or message
+	 * that is already held in memory, so the queue only grows with that backlog. Use
+	 * Manager::setLoadShedding() or Manager::setLimits() to keep the backlog in check.
+	 *
+	 * The order tasks are popped in is only guaranteed for tasks pushed by the same
+	 * thread while the ring has room.
+	 */
+	class TaskQueue
+	{
+	public:
+		//! Construct with a ring of the specified size
+		/*!
+		 * @param[in] capacity Amount of tasks the ring holds. Rounded up to a power of two.
+		 */
+		TaskQueue(size_t capacity=4096);
+		~TaskQueue();
+
+		//! Add a task to the queue. Safe to call from any thread.
+		/*!
+		 * The task is stamped with the time it was pushed at.
+		 */
+		void push(const Task& task);
+
+		//! Retrieve the oldest task in the queue
+		/*!
+		 * Only one thread may pop tasks at a time.
+		 *
+		 * @param[out] task Set to the task removed from the queue
+		 * @return False if the queue was empty
+		 */
+		bool pop(Task& task);
+
+		//! True if there is no task to pop. Only to be called by the popping thread.
+		bool empty() const;
+
+	private:
+		//! A slot in the ring
+		struct Cell
+		{
+			//! Equals the position of the cell when free and one more than that once filled
+			boost::atomic<size_t> sequence;
+			Task task;
+		};
+
+		//! The ring
+		Cell* const cells;
+		//! Ring size minus one
+		const size_t mask;
+
+		//! Position the next task is pushed at
+		boost::atomic<size_t> pushPosition;
+		//! Keeps the consumer's position out of the producers' cache line
+		char padding[64];
+		//! Position the next task is popped from
+		size_t popPosition;
+
+		//! Tasks that found the ring full
+		std::deque<Task> overflow;
+		//! Mutex to make accessing overflow thread safe
+		boost::mutex overflowMutex;
+		//! Amount of tasks in overflow
+		boost::atomic<size_t> overflowSize;
+
+		TaskQueue(const TaskQueue&);
+		TaskQueue& operator=(const TaskQueue&);
+	};
+}
+
+#endif
@@ -0,0 +1,157 @@
+//! \file timerwheel.hpp Defines the Fastcgipp::TimerWheel class
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <fastcgi++/message.hpp>
+#include <fastcgi++/taskqueue.hpp>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Hierarchical wheel of timers that deliver messages to requests
+	/*!
+	 * Time is counted in ticks of a millisecond. The wheel has a number of levels,
+	 * each a ring of slots holding lists of timers. A slot of the lowest level spans a
+	 * single tick and each slot of a level spans the whole ring of the level below it.
+	 * A timer is linked into the lowest level whose slot span covers its expiry, which
+	 * makes scheduling and cancelling constant time. Once time reaches a slot of a
+	 * higher level, its timers are moved down a level. Occupied slots are tracked in a
+	 * bitmap per level so finding the next thing to do never walks empty slots.
+	 *
+	 * Timers are embedded in whatever they time and the wheel never owns them. All
+	 * functions are safe to call from any thread.
+	 */
+	class TimerWheel
+	{
+	public:
+		//! A timer linked into the wheel
+		class Timer
+		{
+		public:
+			Timer(): next(0), prev(0), scheduled(false) { }
+		private:
+			friend class TimerWheel;
+			Timer* next;
+			Timer* prev;
+			//! Tick the timer expires at
+			long long expiry;
+			unsigned char level;
+			unsigned char slot;
+			bool scheduled;
+			//! The request to deliver the message to
+			Task task;
+			//! Message delivered on expiry
+			Message message;
+
+			Timer(const Timer&);
+			Timer& operator=(const Timer&);
+		};
+
+		//! Messages due for delivery along with the request they are meant for
+		typedef std::vector<std::pair<Task, Message> > Expired;
+
+		TimerWheel();
+
+		//! Schedule a timer, replacing whatever it was scheduled for before
+		/*!
+		 * @param[in] timer The timer
+		 * @param[in] delay Milliseconds from now until the timer expires
+		 * @param[in] task The request the message is meant for
+		 * @param[in] message The message to deliver on expiry
+		 * @return True if the thread collecting timers is asleep for longer than the delay and should be woken
+		 */
+		bool schedule(Timer& timer, long long delay, const Task& task, const Message& message);
+
+		//! Stop a timer from expiring. Does nothing if it isn't scheduled.
+		void cancel(Timer& timer);
+
+		//! Milliseconds until the next timer expires
+		/*!
+		 * The value may be short of the actual expiry in which case calling
+		 * collect() once it has passed merely shifts timers around. The caller is
+		 * expected to wait no longer than this before calling collect(). Timers
+		 * scheduled to expire earlier report the need for a wake up.
+		 *
+		 * @return Milliseconds to wait. -1 if there are no timers.
+		 */
+		int timeout();
+
+		//! Take every timer that has expired out of the wheel
+		/*!
+		 * @param[out] expired The messages of the expired timers are appended to this
+		 */
+		void collect(Expired& expired);
+
+		//! True if no timers are scheduled
+		bool empty() const { return !m_size.load(boost::memory_order_relaxed); }
+
+		//! Current time in milliseconds from a monotonic clock
+		static long long now();
+
+	private:
+		//! Bits of a tick that index the slots of a level
+		const static unsigned int slotBits=6;
+		//! Amount of slots in each level
+		const static unsigned int slots=1<<slotBits;
+		//! Amount of levels. Timers further out than the wheel spans are moved down as time approaches them.
+		const static unsigned int levels=5;
+
+		//! The slots of every level
+		Timer* wheel[levels][slots];
+		//! A bit for every slot that has timers in it
+		unsigned long long occupied[levels];
+
+		//! The last tick timers were collected for
+		long long current;
+		//! Tick the collecting thread is expected to call collect() by
+		long long deadline;
+
+		//! Amount of scheduled timers
+		boost::atomic<size_t> m_size;
+
+		boost::mutex mutex;
+
+		//! Put a scheduled timer in the slot its expiry belongs in
+		void link(Timer& timer);
+		//! Take a timer out of its slot
+		void unlink(Timer& timer);
+
+		//! Find the next tick at which a slot needs attention
+		/*!
+		 * @param[out] tick Set to the tick
+		 * @return False if there are no timers
+		 */
+		bool next(long long& tick) const;
+
+		TimerWheel(const TimerWheel&);
+		TimerWheel& operator=(const TimerWheel&);
+	};
+}
+
+#endif
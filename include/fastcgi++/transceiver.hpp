@@ -23,27 +23,47 @@
 #define TRANSCEIVER_HPP
 
 #include <map>
+#include <set>
 #include <list>
 #include <queue>
+#include <utility>
+#include <deque>
 #include <algorithm>
 #include <map>
 #include <vector>
 #include <functional>
+#include <climits>
 
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_array.hpp>
 #include <boost/optional.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/atomic.hpp>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <signal.h>
 
 #include <fastcgi++/protocol.hpp>
+#include <fastcgi++/bufferpool.hpp>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 //! Topmost namespace for the fastcgi++ library
 namespace Fastcgipp
@@ -96,6 +116,61 @@ namespace Fastcgipp
                 };
         }
 
+	//! Defines the mechanism a Transceiver uses to wait on its file descriptors
+	/*!
+	 * POLL is the portable fallback. It rescans every connection each time
+	 * it is woken up so it's cost grows linearly with the amount of open
+	 * connections. EPOLL_LEVEL and EPOLL_EDGE use the Linux epoll facility
+	 * in level or edge triggered mode respectively and only ever touch the
+	 * descriptors that are actually ready. Should epoll be unavailable at
+	 * runtime the Transceiver falls back to POLL.
+	 *
+	 * IO_URING does away with readiness notification altogether. Connections
+	 * are accepted with a multishot accept, read with multishot receives into
+	 * a ring of provided buffers and written with a single sendmsg per
+	 * connection, all submitted and reaped in batches through one io_uring
+	 * instance. It needs Linux 6.0 or later; on anything older, or should
+	 * io_uring be unavailable, the Transceiver falls back to EPOLL_LEVEL or
+	 * POLL.
+	 */
+	enum EventBackend { POLL, EPOLL_LEVEL, EPOLL_EDGE, IO_URING };
+
+	//! The event backend used unless told otherwise
+#ifdef HAVE_SYS_EPOLL_H
+	const EventBackend defaultEventBackend=EPOLL_LEVEL;
+#else
+	const EventBackend defaultEventBackend=POLL;
+#endif
+
+	//! Runtime parameters for the memory output is buffered in
+	/*!
+	 * Output records are written into large chunks of memory. Chunks whose data has been
+	 * completely transmitted are kept on a free list for reuse instead of being returned
+	 * to the system immediately. Should more than minFreeChunks sit unused on the free
+	 * list for idleTimeout milliseconds, the surplus is returned to the operating system
+	 * so that memory used for a burst of large responses is not held forever.
+	 */
+	struct ChunkParameters
+	{
+		ChunkParameters(): chunkSize(131072), maxFreeChunks(16), minFreeChunks(2), idleTimeout(30000), hugePages(false) { }
+
+		//! Size in bytes of each chunk. Anything under 4096 is raised to 4096.
+		size_t chunkSize;
+		//! Maximum amount of unused chunks kept for reuse
+		size_t maxFreeChunks;
+		//! Amount of unused chunks retained once idleTimeout has passed
+		size_t minFreeChunks;
+		//! Milliseconds the free list must go unused before it is shrunk to minFreeChunks
+		unsigned int idleTimeout;
+		//! Back chunks with huge pages
+		/*!
+		 * Should chunkSize be a multiple of 2MB, explicit huge pages (MAP_HUGETLB) are tried
+		 * first. Otherwise, or if none are reserved, the chunk is mapped normally and
+		 * transparent huge pages are requested for it with madvise().
+		 */
+		bool hugePages;
+	};
+
 	//! A raw block of memory
 	/*!
 	 * The purpose of this structure is to communicate a block of data to be written to
@@ -130,8 +205,9 @@ namespace Fastcgipp
 		//! General transceiver handler
 		/*!
 		 * This function is called by Manager::handler() to both transmit data passed to it from
-		 * requests and relay received data back to them as a Message. The function will return true
-		 * if there is nothing at all for it to do.
+		 * requests and relay received data back to them as a Message. Every descriptor that was
+		 * found ready is serviced in a single call. The function will return true if there is
+		 * nothing at all for it to do.
 		 *
 		 * @return Boolean value indicating whether there is data to be transmitted or received
 		 */
@@ -140,7 +216,68 @@ namespace Fastcgipp
 		//! Direct interface to Buffer::requestWrite()
 		Block requestWrite(size_t size) { return buffer.requestWrite(size); }
 		//! Direct interface to Buffer::secureWrite()
-		void secureWrite(size_t size, Protocol::FullId id, bool kill)	{ buffer.secureWrite(size, id, kill); transmit(); }
+		/*!
+		 * Unless deferred flushing is enabled the data is transmitted immediately. Otherwise it
+		 * is held until the next call to handler() or flush() so that all records written in
+		 * the meantime go out in a single writev() per connection. Should too much data build
+		 * up for a connection it is transmitted regardless.
+		 *
+		 * With concurrent writes the data is instead handed over to the thread running
+		 * handler(), which is woken up if it has nothing else to transmit.
+		 */
+		void secureWrite(size_t size, Protocol::FullId id, bool kill)
+		{
+			if(buffer.concurrent())
+			{
+				if(buffer.submit(size, id, kill))
+					wake();
+			}
+			else if(!m_deferFlush)
+			{
+				// Transmitted right away so there is no need to list it for handler()
+				buffer.secureWrite(size, id, kill, false);
+				transmit(id.fd);
+			}
+			else if(buffer.secureWrite(size, id, kill)>=maxDeferredSize)
+				transmit(id.fd);
+		}
+
+		//! Transmit all data waiting on a single file descriptor
+		/*!
+		 * With concurrent writes this does nothing as only handler() may transmit.
+		 */
+		void flush(int fd)
+		{
+			if(!buffer.concurrent())
+				transmit(fd);
+		}
+
+		//! Allow requestWrite() and secureWrite() to be called from any thread
+		/*!
+		 * Every thread then writes into chunk memory of its own and secured writes are passed to
+		 * the thread running handler() through a lock-free stack. This must only be changed while
+		 * no other thread is writing.
+		 */
+		void setConcurrentWrites(bool concurrent) { buffer.setConcurrent(concurrent); }
+
+		//! Enable or disable deferred flushing
+		/*!
+		 * With deferred flushing enabled records are not written to their socket the moment
+		 * they are secured. Instead everything written to a connection during one pass of the
+		 * Manager loop is gathered into a single writev() call. This dramatically cuts
+		 * down on system calls for responses made of many small writes.
+		 *
+		 * @sa secureWrite()
+		 */
+		void setDeferredFlush(bool deferFlush) { m_deferFlush=deferFlush; }
+
+		//! Change the size and retention limits of output memory
+		/*!
+		 * Chunks already in use keep their size. Only new chunks are made with the new size.
+		 */
+		void setChunkParameters(const ChunkParameters& parameters) { buffer.setChunkParameters(parameters); }
+		//! Retrieve the size and retention limits of output memory
+		ChunkParameters chunkParameters() const { return buffer.chunkParameters(); }
 		//! Constructor
 		/*!
 		 * Construct a transceiver object based on an initial file descriptor to listen on and
@@ -148,14 +285,39 @@ namespace Fastcgipp
 		 *
 		 * @param[in] fd_ File descriptor to listen for connections on
 		 * @param[in] sendMessage_ Function to call to pass messages to requests
+		 * @param[in] backend_ Mechanism to use for waiting on file descriptors
 		 */
-		Transceiver(int fd_, boost::function<void(Protocol::FullId, Message)> sendMessage_);
+		Transceiver(int fd_, boost::function<void(Protocol::FullId, Message)> sendMessage_, EventBackend backend_=defaultEventBackend);
+		~Transceiver();
+
+		//! Message type passed along with a request id of 0 once a connection is closed
+		/*!
+		 * It is passed straight from freeFd(), before the file descriptor can be reused
+		 * for another connection. The message has no data.
+		 */
+		static const int closedMessage=INT_MIN;
 		//! Blocks until there is data to receive or a call to wake() is made
-		void sleep()
+		/*!
+		 * Should there be unused output memory waiting to be released, the wait is cut short
+		 * when it is due.
+		 *
+		 * @param[in] timeout Maximum amount of milliseconds to wait. -1 waits indefinitely.
+		 */
+		void sleep(int timeout=-1)
 		{
-			poll(&pollFds.front(), pollFds.size(), -1);
+			if(readyFds.empty())
+			{
+				const int release=buffer.releaseChunks();
+				collectEvents(release>=0 && (timeout<0 || release<timeout)?release:timeout);
+			}
 		}
 
+		//! The event backend actually in use
+		EventBackend backend() const { return m_backend; }
+
+		//! Amount of open connections to the other side. Only safe to call from the thread running handler().
+		size_t connections() const { return fdBuffers.size(); }
+
 		//! Forces a wakeup from a call to sleep()
 		void wake();
 
@@ -167,79 +329,248 @@ namespace Fastcgipp
 			Protocol::Header headerBuffer;
 			//! Buffer of complete Message
 			Message messageBuffer;
+			//! Tells io_uring completions for this connection apart from those of an earlier one with the same descriptor
+			unsigned int generation;
 		};
 
 		//! %Buffer type for transmission of FastCGI records
 		/*!
-		 * This buffer is implemented as a circle of Chunk objects; the number of which can grow and shrink as needed. Write
-		 * space is requested with requestWrite() which thereby returns a Block which may be smaller
-		 * than requested. The write is committed by calling secureWrite(). A smaller space can be
-		 * committed than was given to write on.
+		 * Write space is carved out of a shared Chunk of memory. It is requested with requestWrite()
+		 * which thereby returns a Block which may be smaller than requested. The write is committed
+		 * by calling secureWrite(). A smaller space can be committed than was given to write on.
 		 *
-		 * All data written to the buffer has an associated file descriptor through which it
-		 * is flushed. File descriptor association with data is managed through a queue of Frame
-		 * objects.
+		 * All data written to the buffer has an associated file descriptor through which it is
+		 * flushed. Each file descriptor has it's own queue of Frame objects so a connection that
+		 * can not currently be written to never holds up the others. Requests multiplexed over a
+		 * connection keep their frames apart until they are about to be transmitted and take turns
+		 * in round robin fashion, so one writing a large response doesn't hold up the others
+		 * either. A Frame shares ownership of the Chunk it lies in so chunk memory is released
+		 * once every frame in it has been transmitted, regardless of the order connections are
+		 * flushed in.
 		 */
 		class Buffer
 		{
+			//! Recycles the memory that Chunk objects are made of
+			/*!
+			 * Chunk memory is handed out as a boost::shared_array whose deleter puts it on
+			 * the free list, so memory comes back no matter where the last Frame in it is
+			 * destroyed. The memory is not initialized.
+			 */
+			class ChunkPool
+			{
+				//! Unused chunk of memory
+				struct FreeChunk
+				{
+					FreeChunk(char* data_, size_t size_, bool mapped_): data(data_), size(size_), mapped(mapped_) { }
+					char* data;
+					size_t size;
+					//! True if the memory was obtained with mmap()
+					bool mapped;
+				};
+
+				//! Free list and parameters shared with the deleters of outstanding chunks
+				struct State: public boost::mutex
+				{
+					State(): periodStart(0), lowWater(0) { }
+					~State();
+					ChunkParameters parameters;
+					std::vector<FreeChunk> freeChunks;
+					//! Time in milliseconds the current idle period started
+					long long periodStart;
+					//! Smallest size of the free list during the current idle period
+					size_t lowWater;
+				};
+
+				//! Puts chunk memory back on the free list of its pool
+				struct Deleter
+				{
+					Deleter(const boost::shared_ptr<State>& state_, size_t size_, bool mapped_): state(state_), size(size_), mapped(mapped_) { }
+					void operator()(char* data) const;
+					boost::shared_ptr<State> state;
+					size_t size;
+					bool mapped;
+				};
+
+				boost::shared_ptr<State> state;
+
+				//! Return memory to the operating system
+				static void free(const FreeChunk& chunk);
+				//! Current time in milliseconds from a monotonic clock
+				static long long now();
+			public:
+				ChunkPool(): state(new State) { }
+
+				//! Retrieve a chunk of memory
+				/*!
+				 * @param[out] size Set to the size of the chunk
+				 * @return Shared pointer to the chunk. Releasing the last copy returns it to the pool.
+				 */
+				boost::shared_array<char> allocate(size_t& size);
+
+				//! Return chunks that went unused for a whole idle period to the operating system
+				/*!
+				 * @return Milliseconds until chunks are next due to be released. -1 if there are none to release.
+				 */
+				int release();
+
+				void setParameters(const ChunkParameters& parameters);
+				ChunkParameters parameters() const;
+			};
+
+			//! %Chunk of data in Buffer
+			struct Chunk
+			{
+				//! Size of data section of the chunk
+				size_t size;
+				//! Pointer to the first byte in the chunk data
+				boost::shared_array<char> data;
+				//! Pointer to the first write byte in the chunk
+				char* end;
+				//! Creates a new data chunk from a pool
+				Chunk(ChunkPool& pool): data(pool.allocate(size)), end(data.get()) { }
+				~Chunk() { }
+				//! Creates a new object that shares the data of the old one
+				Chunk(const Chunk& chunk): size(chunk.size), data(chunk.data), end(chunk.end) { }
+				//! Shares the data of another chunk
+				Chunk& operator=(const Chunk& chunk) { size=chunk.size; data=chunk.data; end=chunk.end; return *this; }
+				//! Lets go of the data and takes a new data chunk from a pool
+				void reset(ChunkPool& pool) { data=pool.allocate(size); end=data.get(); }
+			};
+
 			//! %Frame of data associated with a file descriptor
 			struct Frame
 			{
 				//! Constructor
 				/*!
+				 * @param[in] data_ Pointer to the first byte of the frame
 				 * @param[in] size_ Size of the frame
 				 * @param[in] closeFd_ Boolean value indication whether or not the file descriptor should be closed when the frame has been flushed
 				 * @param[in] id_ Complete ID of the request making the frame
+				 * @param[in] chunk_ Chunk the frame lies in
 				 */
-				Frame(size_t size_, bool closeFd_, Protocol::FullId id_): size(size_), closeFd(closeFd_), id(id_) { }
+				Frame(const char* data_, size_t size_, bool closeFd_, Protocol::FullId id_, const boost::shared_array<char>& chunk_): data(data_), size(size_), closeFd(closeFd_), id(id_), chunk(chunk_) { }
+				//! Pointer to the first byte of the frame yet to be transmitted
+				const char* data;
 				//! Size of the frame
 				size_t size;
 				//! Boolean value indication whether or not the file descriptor should be closed when the frame has been flushed
 				bool closeFd;
 				//! Complete ID (contains a file descriptor) of associated with the data frame
 				Protocol::FullId id;
+				//! Keeps the chunk the frame lies in alive until it is transmitted
+				boost::shared_array<char> chunk;
+			};
+
+			//! Frames of a single request waiting for their turn on a file descriptor
+			struct Stream: public std::deque<Frame>
+			{
+				Stream(): deficit(0) { }
+				//! Bytes the stream may still have moved on top of a quantum in its next turn
+				size_t deficit;
 			};
-			//! Queue of frames waiting to be transmitted
-			std::queue<Frame> frames;
+
+			//! Queue of frames waiting to be transmitted through a single file descriptor
+			/*!
+			 * The queue itself holds frames in the order they are to be transmitted in. New
+			 * frames wait in the stream of their request until interleave() moves them over.
+			 */
+			struct Queue: public std::deque<Frame>
+			{
+				Queue(): bytes(0), blocked(false), pending(false) { }
+				//! Total amount of bytes waiting in the queue and it's streams
+				size_t bytes;
+				//! True if the file descriptor can not currently be written to
+				bool blocked;
+				//! True if the file descriptor is listed in pendingFds
+				bool pending;
+				//! Frames not yet in the queue by request
+				std::map<Protocol::RequestId, Stream> streams;
+				//! Requests with frames in streams in the order they take turns
+				std::deque<Protocol::RequestId> turns;
+				//! Frames that close the file descriptor. They go last.
+				std::deque<Frame> closing;
+				//! True if there is nothing at all to transmit
+				bool idle() const { return this->empty() && turns.empty() && closing.empty(); }
+			};
+
+			//! Bytes a request may have moved into the queue of it's file descriptor per turn
+			const static size_t quantum=16384;
+
+			//! Move frames from the streams of a queue into it
+			/*!
+			 * Requests take turns following deficit round robin. Each turn a request may
+			 * move up to a quantum of bytes plus whatever it didn't use of previous turns
+			 * it had frames waiting for. Turns are taken until the queue holds the
+			 * requested amount of frames or the streams are empty, at which point the
+			 * frames closing the file descriptor are moved.
+			 *
+			 * @param[in] queue The queue
+			 * @param[in] frames Amount of frames the queue should hold
+			 */
+			void interleave(Queue& queue, size_t frames);
+
+			//! Container associating file descriptors with their queue of frames
+			std::map<int, Queue> queues;
+			//! File descriptors that have frames waiting and can be written to
+			std::deque<int> pendingFds;
+
 			//! Minimum Block size value that can be returned from requestWrite()
 			const static unsigned int minBlockSize = 256;
-			//! %Chunk of data in Buffer
-			struct Chunk
+
+			//! Where chunk memory comes from
+			ChunkPool chunkPool;
+			//! The chunk currently used for writing
+			Chunk writeChunk;
+
+			//! A Frame secured by a thread other than the one running Transceiver::handler()
+			struct Submission
 			{
-				//! Size of data section of the chunk
-				const static unsigned int size = 131072;
-				//! Pointer to the first byte in the chunk data
-				boost::shared_array<char> data;
-				//! Pointer to the first write byte in the chunk or 1+ the last read byte
-				char* end;
-				//! Creates a new data chunk
-				Chunk(): data(new char[size]()), end(data.get()) { }
-				~Chunk() { }
-				//! Creates a new object that shares the data of the old one
-				Chunk(const Chunk& chunk): data(chunk.data), end(data.get()) { }
+				Submission(const Frame& frame_): frame(frame_), next(0) { }
+				Frame frame;
+				Submission* next;
 			};
+			//! Lock-free stack of submitted frames, most recent first
+			boost::atomic<Submission*> submissions;
+			//! The chunk each thread writes into when writes are concurrent
+			boost::thread_specific_ptr<Chunk> localChunks;
+			//! True if writes may come from any thread
+			bool m_concurrent;
+
+			//! The chunk the calling thread should write into
+			Chunk& currentChunk()
+			{
+				if(!m_concurrent)
+					return writeChunk;
+				Chunk* chunk=localChunks.get();
+				if(!chunk)
+				{
+					chunk=new Chunk(chunkPool);
+					localChunks.reset(chunk);
+				}
+				return *chunk;
+			}
 
-			//! A list of chunks. Can contain from 2-infinity
-			std::list<Chunk> chunks;
-			//! Iterator pointing to the chunk currently used for writing
-			std::list<Chunk>::iterator writeIt;
+			//! Carve a frame out of the calling thread's chunk
+			Frame makeFrame(size_t size, Protocol::FullId id, bool kill);
 
-			//! Current read spot in the buffer
-			char* pRead;
+			//! Append a frame to the queue of its file descriptor
+			/*!
+			 * @param[in] frame The frame
+			 * @param[in] schedule True if the file descriptor should be listed in pendingFds for
+			 * the next pass of handler(). False if the caller transmits it right away.
+			 * @return Total amount of bytes now waiting to be transmitted through the file descriptor
+			 */
+			size_t enqueue(const Frame& frame, bool schedule=true);
 
-			//! A reference to Transceiver::pollFds for removing file descriptors when they are closed
-			std::vector<pollfd>& pollFds;
-			//! A reference to Transceiver::fdBuffer for deleting buffers upon closing of the file descriptor
-			std::map<int, fdBuffer>& fdBuffers;
-			//! Helper function for freeFd(int fd, std::vector<pollfd> pollFds, std::map<int, fdBuffer> fdBuffers)
-			void freeFd(int fd_) { Fastcgipp::Transceiver::freeFd(fd_, pollFds, fdBuffers);  }
+			//! A reference to the owning Transceiver for closing file descriptors once flushed
+			Transceiver& transceiver;
 		public:
 			//! Constructor
 			/*!
-			 * @param[out] pollFds_ A reference to Transceiver::pollFds is needed for removing file descriptors when they are closed
-			 * @param[out] fdBuffers_ A reference to Transceiver::fdBuffer is needed for deleting buffers upon closing of the file descriptor
+			 * @param[out] transceiver_ A reference to the owning Transceiver is needed for closing file descriptors
 			 */
-			Buffer(std::vector<pollfd>& pollFds_, std::map<int, fdBuffer>& fdBuffers_): chunks(1), writeIt(chunks.begin()), pRead(chunks.begin()->data.get()), pollFds(pollFds_), fdBuffers(fdBuffers_)  { }
+			Buffer(Transceiver& transceiver_): writeChunk(chunkPool), submissions(0), m_concurrent(false), transceiver(transceiver_)  { }
+			~Buffer();
 
 			//! Request a write block in the buffer
 			/*!
@@ -248,57 +579,91 @@ namespace Fastcgipp
 			 */
 			Block requestWrite(size_t size)
 			{
-				return Block(writeIt->end, std::min(size, (size_t)(writeIt->data.get()+Chunk::size-writeIt->end)));
+				Chunk& chunk=currentChunk();
+				// Nothing references the chunk anymore so we may as well start over at the top of it
+				if(chunk.data.unique())
+					chunk.end=chunk.data.get();
+				return Block(chunk.end, std::min(size, (size_t)(chunk.data.get()+chunk.size-chunk.end)));
 			}
 			//! Secure a write in the buffer
 			/*!
 			 * @param[in] size Amount of bytes to secure
 			 * @param[in] id Associated complete ID (contains file descriptor)
 			 * @param[in] kill Boolean value indicating whether or not the file descriptor should be closed after transmission
+			 * @param[in] schedule False if the caller transmits the file descriptor right away
+			 * @return Total amount of bytes now waiting to be transmitted through the file descriptor
 			 */
-			void secureWrite(size_t size, Protocol::FullId id, bool kill);
+			size_t secureWrite(size_t size, Protocol::FullId id, bool kill, bool schedule=true) { return enqueue(makeFrame(size, id, kill), schedule); }
 
-			//! %Block of memory for extraction from Buffer
-			struct SendBlock
-			{
-				//! Constructor
-				/*!
-				 * @param[in] data_ Pointer to the first byte in the block
-				 * @param[in] size_ Size in bytes of the data
-				 * @param[in] fd_ File descriptor the data should be written to
-				 */
-				SendBlock(const char* data_, size_t size_, int fd_): data(data_), size(size_), fd(fd_) { }
-				//! Create a new object that shares the data of the old
-				SendBlock(const SendBlock& sendBlock): data(sendBlock.data), size(sendBlock.size), fd(sendBlock.fd) { }
-				//! Pointer to the first byte in the block
-				const char* data;
-				//! Size in bytes of the data
-				size_t size;
-				//! File descriptor the data should be written to
-				int fd;
-			};
+			//! Secure a write in the buffer from any thread
+			/*!
+			 * The frame is pushed on the submission stack and only put in it's queue once
+			 * collectSubmissions() is called.
+			 *
+			 * @param[in] size Amount of bytes to secure
+			 * @param[in] id Associated complete ID (contains file descriptor)
+			 * @param[in] kill Boolean value indicating whether or not the file descriptor should be closed after transmission
+			 * @return True if the submission stack was empty beforehand
+			 */
+			bool submit(size_t size, Protocol::FullId id, bool kill);
+
+			//! Move every submitted frame into the queue of its file descriptor
+			void collectSubmissions();
 
-			//! Request a block of data for transmitting
+			//! Allow writes from any thread
+			void setConcurrent(bool concurrent) { m_concurrent=concurrent; }
+			//! True if writes may come from any thread
+			bool concurrent() const { return m_concurrent; }
+
+			//! Retrieve the next file descriptor that has data waiting and can be written to
 			/*!
-			 * @return A block of data with a file descriptor to transmit it out
+			 * @return The file descriptor or -1 if there is none
 			 */
-			SendBlock requestRead()
-			{
-				return SendBlock(pRead, frames.empty()?0:frames.front().size, frames.empty()?-1:frames.front().id.fd);
-			}
+			int nextFd();
+
+			//! Request all data waiting on a file descriptor as an array of iovec structures
+			/*!
+			 * Frames are gathered in order up to and including one that closes the file descriptor.
+			 *
+			 * @param[in] fd File descriptor to transmit data for
+			 * @param[out] vectors Array to fill
+			 * @param[in] maxVectors Size of the array
+			 * @param[out] chunks If not null, filled with the chunks the data lies in so they can be kept alive past freeRead() or clear()
+			 * @return Amount of iovec structures filled in. 0 if there is nothing to transmit.
+			 */
+			int requestRead(int fd, iovec* vectors, int maxVectors, std::vector<boost::shared_array<char> >* chunks=0);
+
 			//! Mark data in the buffer as transmitted and free it's memory
 			/*!
+			 * The data may span any amount of frames.
+			 *
+			 * @param fd File descriptor the data was transmitted through
 			 * @param size Amount of bytes to mark as transmitted and free
+			 * @return True if the file descriptor was closed as a result
 			 */
-			void freeRead(size_t size);
-
-			//! Test of the buffer is empty
+			bool freeRead(int fd, size_t size);
+
+			//! Mark a file descriptor as not currently writable
+			void block(int fd);
+			//! Mark a file descriptor as writable again
+			void unblock(int fd);
+			//! Discard all data waiting to be transmitted through a file descriptor
+			void clear(int fd) { queues.erase(fd); }
+
+			//! Direct interface to ChunkPool::release()
+			int releaseChunks() { return chunkPool.release(); }
+			//! Direct interface to ChunkPool::setParameters()
+			void setChunkParameters(const ChunkParameters& parameters) { chunkPool.setParameters(parameters); }
+			//! Direct interface to ChunkPool::parameters()
+			ChunkParameters chunkParameters() const { return chunkPool.parameters(); }
+
+			//! Test if the buffer has no data that can currently be transmitted
 			/*!
 			 * @return true if the buffer is empty
 			 */
 			bool empty()
 			{
-				return pRead==writeIt->end;
+				return pendingFds.empty();
 			}
 		};
 
@@ -307,8 +672,22 @@ namespace Fastcgipp
 		//! Function to call to pass messages to requests
 		boost::function<void(Protocol::FullId, Message)> sendMessage;
 
-		//! poll() file descriptors container
+		//! The event backend in use
+		EventBackend m_backend;
+		//! poll() file descriptors container. Only used by the POLL backend.
 		std::vector<pollfd> pollFds;
+		//! The epoll instance. Only valid for the EPOLL_* backends.
+		int epollFd;
+#ifdef HAVE_SYS_EPOLL_H
+		//! Space for epoll_wait() to return events into
+		std::vector<epoll_event> epollEvents;
+#endif
+		//! Descriptors reported ready by the last collectEvents() and not yet serviced
+		/*!
+		 * Regardless of the backend, ready descriptors are stored here as a pollfd with
+		 * revents set to the poll() equivalent of what happened.
+		 */
+		std::vector<pollfd> readyFds;
 		//! Socket to listen for connections on
 		int socket;
 		//! Input file descriptor to the wakeup socket pair
@@ -319,9 +698,212 @@ namespace Fastcgipp
 		//! Container associating file descriptors with their receive buffers
 		std::map<int, fdBuffer> fdBuffers;
 
+		//! Shared buffer that connections are read into
+		/*!
+		 * Complete records of at least minAliasedSize bytes are passed on as slices of
+		 * this buffer so it is only rewound once no Message references it anymore.
+		 * Smaller records are copied out so that a request holding on to one of them
+		 * pins no more than the record itself.
+		 */
+		boost::shared_array<char> receiveBuffer;
+		//! First unused byte in receiveBuffer
+		char* receiveEnd;
+		//! Size in bytes of receiveBuffer
+		const static size_t receiveBufferSize=131072;
+		//! Least amount of free space in receiveBuffer worth reading into before starting a new one
+		const static size_t minReceiveSize=16384;
+		//! Smallest record passed on as a slice of receiveBuffer instead of being copied
+		/*!
+		 * An aliased record pins receiveBuffer, so this keeps the memory held by a
+		 * stalled request to at most receiveBufferSize/minAliasedSize times its size.
+		 */
+		const static size_t minAliasedSize=16384;
+
 		//! Transmit all buffered data possible
 		int transmit();
 
+		//! Transmit all buffered data possible through a single file descriptor
+		void transmit(int fd);
+
+		//! True if records should be gathered up until the next handler() call
+		bool m_deferFlush;
+
+		//! Amount of bytes a connection may have waiting before it is transmitted regardless of deferred flushing
+		const static size_t maxDeferredSize=65536;
+
+		//! Maximum amount of iovec structures passed to a single writev()
+		const static int maxIovecs=64;
+
+#ifdef HAVE_IO_URING
+		//! Raw io_uring instance along with its provided buffer ring
+		struct Ring
+		{
+			Ring(): fd(-1), sqRing(0), sqes(0), buffers(0), bufferRing(0), bufferTail(0) { }
+			~Ring() { close(); }
+
+			//! Destroy the instance and release all its memory
+			void close();
+
+			//! Create the instance
+			/*!
+			 * @return False if io_uring is unavailable or lacks the features needed.
+			 */
+			bool setup();
+
+			//! Retrieve a zeroed submission queue entry, submitting what is queued if there is no room
+			io_uring_sqe* sqe();
+
+			//! Submit queued entries and optionally wait for completions
+			/*!
+			 * @param[in] timeout Maximum amount of milliseconds to wait for a completion. 0 does not wait and -1 waits indefinitely.
+			 */
+			void enter(int timeout);
+
+			//! Retrieve the next completion or null if there is none
+			io_uring_cqe* cqe();
+			//! Mark the completion retrieved with cqe() as seen
+			void seen();
+
+			//! Retrieve the data of a provided buffer
+			const char* buffer(unsigned short id) const { return buffers+id*bufferSize; }
+			//! Give a provided buffer back to the kernel
+			void recycle(unsigned short id);
+
+			//! Buffer group used for receiving
+			const static unsigned short bufferGroup=0;
+			//! Amount of provided buffers
+			const static unsigned int bufferCount=128;
+			//! Size in bytes of each provided buffer
+			const static unsigned int bufferSize=16384;
+
+			int fd;
+			//! Submission and completion queue rings, mapped together
+			void* sqRing;
+			size_t sqRingSize;
+			io_uring_sqe* sqes;
+			size_t sqesSize;
+
+			unsigned* sqHead;
+			unsigned* sqTail;
+			unsigned* sqFlags;
+			unsigned* sqArray;
+			unsigned sqMask;
+			unsigned sqEntries;
+			//! Tail of the submission queue including entries not yet made visible to the kernel
+			unsigned sqLocalTail;
+
+			unsigned* cqHead;
+			unsigned* cqTail;
+			unsigned cqMask;
+			io_uring_cqe* cqes;
+
+			char* buffers;
+			io_uring_buf_ring* bufferRing;
+			unsigned short bufferTail;
+		};
+
+		//! Operations submitted to the Ring, stored in the top byte of their user data
+		enum RingOperation { RING_ACCEPT=1, RING_WAKE, RING_RECEIVE, RING_SEND, RING_CANCEL };
+
+		//! A sendmsg in flight
+		/*!
+		 * Holds on to the chunks being transmitted so that a connection being freed can not
+		 * release memory the kernel is still reading from.
+		 */
+		struct RingSend
+		{
+			msghdr header;
+			iovec vectors[maxIovecs];
+			std::vector<boost::shared_array<char> > chunks;
+		};
+
+		//! Freed connections whose operations are being cancelled
+		/*!
+		 * Each is closed once its RING_CANCEL completion arrives so that the descriptor
+		 * number can't be reused while completions for it may still be pending.
+		 */
+		std::set<int> cancellingFds;
+
+		//! Sends in flight keyed by their user data
+		std::map<unsigned long long, RingSend> ringSends;
+		//! The io_uring instance. Only used by the IO_URING backend.
+		/*!
+		 * Declared after ringSends so the instance, and with it every operation in
+		 * flight, is gone before the memory they reference is released.
+		 */
+		Ring ring;
+
+		//! Build the user data of an operation
+		static unsigned long long ringData(RingOperation operation, unsigned int generation, int fd)
+		{
+			return (unsigned long long)operation<<56 | (unsigned long long)(generation&0xffffff)<<32 | (unsigned int)fd;
+		}
+
+		//! Queue a multishot operation for the listening socket, the wakeup socket or a connection
+		void arm(int fd);
+		//! Queue a sendmsg of everything waiting on a connection
+		void ringTransmit(int fd);
+		//! Process all completions waiting in the Ring
+		/*!
+		 * @return True if there were any
+		 */
+		bool ringHandler();
+#endif
+
+		//! Wait for descriptors to become ready and fill readyFds with them
+		/*!
+		 * @param[in] timeout Maximum amount of milliseconds to wait. -1 waits indefinitely.
+		 */
+		void collectEvents(int timeout);
+
+		//! Begin watching a file descriptor for incoming data
+		void addFd(int fd);
+
+		//! Start or stop watching a file descriptor for the ability to write to it
+		void setWriteInterest(int fd, bool interest);
+
+		//! Accept new connections on the listening socket
+		void accept();
+
+		//! Generation of the last accepted connection
+		unsigned int generation;
+
+		//! Set up the receive buffer of a newly accepted connection and begin watching it
+		void addConnection(int fd);
+
+		//! Receive data on a connection and pass any complete records on
+		/*!
+		 * As much data as is available is read in a single call and every complete record in it
+		 * is passed on. Only a record that is split between reads is copied out.
+		 *
+		 * @param[in] fd File descriptor to read from
+		 * @return True if the read was satisfied completely and more data may be waiting
+		 */
+		bool receive(int fd);
+
+		//! Pass on data received on a connection by other means than receive()
+		/*!
+		 * @param[in] fd File descriptor the data was received through
+		 * @param[in] data Pointer to the first byte of data
+		 * @param[in] size Size of the data
+		 */
+		void receive(int fd, const char* data, size_t size);
+
+		//! Retrieve where the next data received on a connection should be stored
+		/*!
+		 * @param[in] fd File descriptor data is to be received through
+		 * @param[out] data Set to the location to store data in
+		 * @return Maximum amount of bytes that may be stored
+		 */
+		size_t prepareReceive(int fd, char*& data);
+
+		//! Pass on any complete records once data has been stored where prepareReceive() said to
+		/*!
+		 * @param[in] fd File descriptor the data was received through
+		 * @param[in] size Amount of bytes stored
+		 */
+		void commitReceive(int fd, size_t size);
+
 		//! Store the last socket exception
 		boost::optional<Exceptions::Socket> m_lastSocketException;
 
@@ -331,16 +913,12 @@ namespace Fastcgipp
 		 * By calling this function you close the passed file descriptor
 		 * and free up it's associated buffers and resources. It is safe
 		 * to call this function at any time with any fd(even bad ones).
-		 * If requests still exists with this fd then they will be lost.
+		 * Requests that still exist with this fd are told about through a
+		 * message of type closedMessage.
 		 *
 		 * @param fd File descriptor to delete/free up
-		 * @param pollFds Epoll container
-		 * @param fdBuffers Container of fd/pipe buffers
 		 */
-		static void freeFd(int fd, std::vector<pollfd>& pollFds, std::map<int, fdBuffer>& fdBuffers);
-
-		//! Helper function for freeFd(int fd, std::vector<pollfd> pollFds, std::map<int, fdBuffer> fdBuffers)
-		void freeFd(int fd_) { freeFd(fd_, pollFds, fdBuffers);  }
+		void freeFd(int fd);
 
 		//! Reset the last socket exception to none.
 		void resetLastSocketException()
@@ -360,7 +938,7 @@ namespace Fastcgipp
 	};
 
 	//! Predicate for comparing the file descriptor of a pollfd
-	struct equalsFd : public std::unary_function<pollfd, bool>
+	struct equalsFd
 	{
 		int fd;
 		explicit equalsFd(int fd_): fd(fd_) {}
@@ -0,0 +1,85 @@
+//! \file utf8.hpp Declares the Fastcgipp::Utf8 conversion functions
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+#ifndef FASTCGIPP_UTF8_HPP
+#define FASTCGIPP_UTF8_HPP
+
+#include <cstddef>
+
+//! Topmost namespace for the fastcgi++ library
+namespace Fastcgipp
+{
+	//! Conversion between UTF-8 and the UTF-32 held in a wchar_t
+	/*!
+	 * These are plain functions working on caller supplied memory so converting
+	 * never involves a locale or facet. Runs of ASCII, by far the most common thing
+	 * to convert, are handled sixteen characters at a time with SSE2 where it is
+	 * available. Everything else goes through a scalar path that validates as it
+	 * converts.
+	 */
+	namespace Utf8
+	{
+		//! Returned by decode() and encode() when the input is invalid
+		const size_t invalid=size_t(-1);
+
+		//! Decode UTF-8 into wide characters
+		/*!
+		 * Malformed sequences, overlong forms, surrogates, code points beyond U+10FFFF
+		 * and sequences cut short by the end of the data are all invalid.
+		 *
+		 * @param[in] source First byte to decode
+		 * @param[in] size Amount of bytes to decode
+		 * @param[out] destination Where to write the characters. Must have room for size characters.
+		 * @return Amount of characters written. invalid if the data isn't valid UTF-8.
+		 */
+		size_t decode(const char* source, size_t size, wchar_t* destination);
+
+		//! Encode wide characters as UTF-8
+		/*!
+		 * Surrogates and values beyond U+10FFFF are invalid.
+		 *
+		 * @param[in] source First character to encode
+		 * @param[in] size Amount of characters to encode
+		 * @param[out] destination Where to write the bytes. Must have room for maxEncodedSize(size) bytes.
+		 * @return Amount of bytes written. invalid if a character can't be encoded.
+		 */
+		size_t encode(const wchar_t* source, size_t size, char* destination);
+
+		//! Encode as many wide characters as fit in a space as UTF-8
+		/*!
+		 * Encoding stops at the end of the characters, at the first character that
+		 * doesn't fit in what is left of the destination or at the first that can't be
+		 * encoded. A character that stops encoding with maxEncodedSize(1) or more bytes
+		 * left is thereby invalid.
+		 *
+		 * @param[in,out] source First character to encode. Set to the first character not encoded.
+		 * @param[in] end One past the last character to encode
+		 * @param[out] destination Where to write the bytes
+		 * @param[in] size Amount of bytes there is room for in destination
+		 * @return Amount of bytes written
+		 */
+		size_t encode(const wchar_t*& source, const wchar_t* end, char* destination, size_t size);
+
+		//! Most bytes encode() may write for an amount of characters
+		inline size_t maxEncodedSize(size_t size) { return size*4; }
+	}
+}
+
+#endif
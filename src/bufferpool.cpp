@@ -0,0 +1,365 @@
+//! \file bufferpool.cpp Defines member functions for Fastcgipp::BufferPool
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <new>
+
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/atomic.hpp>
+
+#include <fastcgi++/bufferpool.hpp>
+
+namespace
+{
+	//! Buffer sizes handed out by the pool
+	/*!
+	 * The two largest classes fit a maximum size FastCGI record (header, 65535 bytes of
+	 * content and 255 of padding) and the Transceiver's receive buffer respectively.
+	 */
+	const size_t sizeClasses[]={256, 1024, 4096, 8192, 16384, 32768, 66048, 131072};
+	const unsigned int classCount=sizeof(sizeClasses)/sizeof(size_t);
+
+	//! Maximum amount of memory a thread keeps cached for a single size class
+	const size_t maxCachedBytes=1048576;
+	//! Maximum amount of buffers a thread keeps cached for a single size class
+	const size_t maxCachedBuffers=256;
+	//! Size of the slots reference count blocks are recycled in
+	const size_t counterSize=64;
+
+	//! Counters shared by all threads
+	struct Counters
+	{
+		boost::atomic<unsigned long long> hits;
+		boost::atomic<unsigned long long> misses;
+		boost::atomic<unsigned long long> overflows;
+	};
+	//! One set of counters per size class plus one for oversized allocations
+	Counters classCounters[classCount+1];
+	boost::atomic<bool> statisticsEnabled(false);
+
+	inline void count(boost::atomic<unsigned long long>& counter)
+	{
+		if(statisticsEnabled.load(boost::memory_order_relaxed))
+			counter.fetch_add(1, boost::memory_order_relaxed);
+	}
+
+	size_t maxCached(unsigned int sizeClass)
+	{
+		const size_t count=maxCachedBytes/sizeClasses[sizeClass];
+		return count>maxCachedBuffers?maxCachedBuffers:(count<8?8:count);
+	}
+
+	//! Stack of memory blocks pushed by any thread and taken all at once by one
+	/*!
+	 * The first bytes of each block hold the pointer to the next. As blocks are only
+	 * ever taken off as a whole list there is no ABA problem.
+	 */
+	class RemoteList
+	{
+	public:
+		RemoteList(): m_head(0) {}
+
+		void push(void* block)
+		{
+			void* head=m_head.load(boost::memory_order_relaxed);
+			do
+				*static_cast<void**>(block)=head;
+			while(!m_head.compare_exchange_weak(head, block, boost::memory_order_release, boost::memory_order_relaxed));
+		}
+
+		//! Take every block, returning the first. Null if there are none.
+		void* take()
+		{
+			if(!m_head.load(boost::memory_order_relaxed))
+				return 0;
+			return m_head.exchange(0, boost::memory_order_acquire);
+		}
+
+		static void* next(void* block) { return *static_cast<void**>(block); }
+
+	private:
+		boost::atomic<void*> m_head;
+	};
+
+	//! Cache of released buffers and reference count blocks owned by a single thread
+	/*!
+	 * Buffers and reference count blocks remember the cache they were allocated from.
+	 * The owning thread releases them straight into it. Other threads, like workers
+	 * finishing requests whose records the I/O thread read, push them onto the remote
+	 * lists instead. The owner takes those over once its own cache runs dry, so memory
+	 * keeps flowing back to the thread that allocates it.
+	 *
+	 * Caches are never destroyed. When a thread exits it's cache is emptied and kept
+	 * for the next thread to start so blocks still in use always have somewhere to go.
+	 */
+	struct Cache
+	{
+		std::vector<char*> buffers[classCount];
+		std::vector<void*> counters;
+		RemoteList remoteBuffers[classCount];
+		RemoteList remoteCounters;
+
+		//! Move buffers released by other threads into the local cache
+		/*!
+		 * @return True if any buffer was moved
+		 */
+		bool collect(unsigned int sizeClass)
+		{
+			void* block=remoteBuffers[sizeClass].take();
+			if(!block)
+				return false;
+			std::vector<char*>& cached=buffers[sizeClass];
+			const size_t limit=maxCached(sizeClass);
+			while(block)
+			{{
+				char* const buffer=static_cast<char*>(block);
+				block=RemoteList::next(block);
+				if(cached.size()<limit)
+					cached.push_back(buffer);
+				else
+				{
+					count(classCounters[sizeClass].overflows);
+					delete [] buffer;
+				}
+			}}
+			return true;
+		}
+
+		//! Move reference count blocks released by other threads into the local cache
+		void collectCounters()
+		{
+			void* block=remoteCounters.take();
+			while(block)
+			{{
+				void* const counter=block;
+				block=RemoteList::next(block);
+				if(counters.size()<maxCachedBuffers)
+					counters.push_back(counter);
+				else
+					::operator delete(counter);
+			}}
+		}
+
+		void clear()
+		{
+			for(unsigned int i=0; i<classCount; ++i)
+			{{
+				collect(i);
+				for(std::vector<char*>::iterator it=buffers[i].begin(); it!=buffers[i].end(); ++it)
+					delete [] *it;
+				buffers[i].clear();
+			}}
+			collectCounters();
+			for(std::vector<void*>::iterator it=counters.begin(); it!=counters.end(); ++it)
+				::operator delete(*it);
+			counters.clear();
+		}
+	};
+
+	//! Caches of threads that have exited, waiting for new threads to take them over
+	std::vector<Cache*>& abandonedCaches()
+	{
+		static std::vector<Cache*>* const caches=new std::vector<Cache*>;
+		return *caches;
+	}
+	boost::mutex abandonedMutex;
+
+	//! Called by boost::thread_specific_ptr as a thread exits
+	void abandonCache(Cache* cache)
+	{
+		cache->clear();
+		boost::lock_guard<boost::mutex> lock(abandonedMutex);
+		abandonedCaches().push_back(cache);
+	}
+
+	//! Retrieve the cache for the calling thread
+	/*!
+	 * The thread_specific_ptr is never destroyed so that buffers released during
+	 * static destruction still have somewhere to go.
+	 */
+	Cache& localCache()
+	{
+		static boost::thread_specific_ptr<Cache>* const caches=new boost::thread_specific_ptr<Cache>(abandonCache);
+		Cache* cache=caches->get();
+		if(!cache)
+		{
+			{
+				boost::lock_guard<boost::mutex> lock(abandonedMutex);
+				if(!abandonedCaches().empty())
+				{
+					cache=abandonedCaches().back();
+					abandonedCaches().pop_back();
+				}
+			}
+			if(!cache)
+				cache=new Cache;
+			caches->reset(cache);
+		}
+		return *cache;
+	}
+
+	//! Returns buffers to the cache they were allocated from
+	struct Deleter
+	{
+		unsigned int sizeClass;
+		Cache* owner;
+		Deleter(unsigned int sizeClass_, Cache* owner_): sizeClass(sizeClass_), owner(owner_) {}
+
+		void operator()(char* buffer) const
+		{
+			if(sizeClass<classCount)
+			{
+				if(owner!=&localCache())
+				{
+					owner->remoteBuffers[sizeClass].push(buffer);
+					return;
+				}
+				std::vector<char*>& buffers=owner->buffers[sizeClass];
+				if(buffers.size()<maxCached(sizeClass))
+				{
+					buffers.push_back(buffer);
+					return;
+				}
+				count(classCounters[sizeClass].overflows);
+			}
+			delete [] buffer;
+		}
+	};
+
+	//! Allocator handed to boost::shared_array so its reference count block is recycled too
+	/*!
+	 * A copy of the allocator is kept in the reference count block so it remembers the
+	 * cache to return the block to.
+	 */
+	template<class T> struct CounterAllocator
+	{
+		typedef T value_type;
+		template<class U> struct rebind { typedef CounterAllocator<U> other; };
+
+		Cache* owner;
+
+		explicit CounterAllocator(Cache* owner_): owner(owner_) {}
+		template<class U> CounterAllocator(const CounterAllocator<U>& x): owner(x.owner) {}
+
+		T* allocate(size_t n)
+		{
+			if(n*sizeof(T) > counterSize)
+				return static_cast<T*>(::operator new(n*sizeof(T)));
+
+			std::vector<void*>& cached=owner->counters;
+			if(cached.empty())
+				owner->collectCounters();
+			if(cached.empty())
+				return static_cast<T*>(::operator new(counterSize));
+			void* counter=cached.back();
+			cached.pop_back();
+			return static_cast<T*>(counter);
+		}
+
+		void deallocate(T* p, size_t n)
+		{
+			if(n*sizeof(T) <= counterSize)
+			{
+				if(owner!=&localCache())
+				{
+					owner->remoteCounters.push(p);
+					return;
+				}
+				std::vector<void*>& cached=owner->counters;
+				if(cached.size()<maxCachedBuffers)
+				{
+					cached.push_back(p);
+					return;
+				}
+			}
+			::operator delete(p);
+		}
+	};
+
+	template<class T, class U> bool operator==(const CounterAllocator<T>& x, const CounterAllocator<U>& y) { return x.owner==y.owner; }
+	template<class T, class U> bool operator!=(const CounterAllocator<T>& x, const CounterAllocator<U>& y) { return x.owner!=y.owner; }
+}
+
+boost::shared_array<char> Fastcgipp::BufferPool::allocate(size_t size)
+{
+	unsigned int sizeClass=0;
+	while(sizeClass<classCount && sizeClasses[sizeClass]<size)
+		++sizeClass;
+
+	Cache& cache=localCache();
+	char* buffer;
+	if(sizeClass<classCount)
+	{
+		std::vector<char*>& buffers=cache.buffers[sizeClass];
+		if(buffers.empty() && !cache.collect(sizeClass))
+		{
+			count(classCounters[sizeClass].misses);
+			buffer=new char[sizeClasses[sizeClass]];
+		}
+		else
+		{
+			count(classCounters[sizeClass].hits);
+			buffer=buffers.back();
+			buffers.pop_back();
+		}
+	}
+	else
+	{
+		count(classCounters[sizeClass].misses);
+		buffer=new char[size];
+	}
+
+	return boost::shared_array<char>(buffer, Deleter(sizeClass, &cache), CounterAllocator<char>(&cache));
+}
+
+void Fastcgipp::BufferPool::enableStatistics(bool enable)
+{
+	statisticsEnabled.store(enable, boost::memory_order_relaxed);
+}
+
+std::vector<Fastcgipp::BufferPool::Statistics> Fastcgipp::BufferPool::statistics()
+{
+	std::vector<Statistics> result(classCount+1);
+	for(unsigned int i=0; i<=classCount; ++i)
+	{{
+		result[i].size=i<classCount?sizeClasses[i]:0;
+		result[i].hits=classCounters[i].hits.load(boost::memory_order_relaxed);
+		result[i].misses=classCounters[i].misses.load(boost::memory_order_relaxed);
+		result[i].overflows=classCounters[i].overflows.load(boost::memory_order_relaxed);
+	}}
+	return result;
+}
+
+void Fastcgipp::BufferPool::resetStatistics()
+{
+	for(unsigned int i=0; i<=classCount; ++i)
+	{{
+		classCounters[i].hits.store(0, boost::memory_order_relaxed);
+		classCounters[i].misses.store(0, boost::memory_order_relaxed);
+		classCounters[i].overflows.store(0, boost::memory_order_relaxed);
+	}}
+}
+
+void Fastcgipp::BufferPool::trim()
+{
+	localCache().clear();
+}
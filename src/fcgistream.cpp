@@ -1,136 +1,221 @@
 #include <cstring>
 #include <algorithm>
-#include <map>
-#include <iterator>
-#include <boost/iostreams/code_converter.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fastcgi++/fcgistream.hpp"
-#include "utf8_codecvt.hpp"
+#include "fastcgi++/utf8.hpp"
 
-template<typename charT> template<typename Sink> std::streamsize Fastcgipp::Fcgistream<charT>::Encoder::write(Sink& dest, const charT* s, std::streamsize n)
+namespace
 {
-	static std::map<charT, std::basic_string<charT> > htmlCharacters;
-	if(!htmlCharacters.size())
-	{
-		const char quot[]="&quot;";
-		std::copy(quot, quot+sizeof(quot)-1, std::back_inserter(htmlCharacters['"']));
-
-		const char gt[]="&gt;";
-		std::copy(gt, gt+sizeof(gt)-1, std::back_inserter(htmlCharacters['>']));
+	using namespace Fastcgipp;
 
-		const char lt[]="&lt;";
-		std::copy(lt, lt+sizeof(lt)-1, std::back_inserter(htmlCharacters['<']));
+	//! Amount of output encodings
+	const unsigned int encodings=URI_COMPONENT+1;
 
-		const char amp[]="&amp;";
-		std::copy(amp, amp+sizeof(amp)-1, std::back_inserter(htmlCharacters['&']));
-
-		const char apos[]="&apos;";
-		std::copy(apos, apos+sizeof(apos)-1, std::back_inserter(htmlCharacters['\'']));
-	}
-
-	static std::map<charT, std::basic_string<charT> > urlCharacters;
-	if(!urlCharacters.size())
+	//! What every character below 256 is replaced with in every output encoding
+	/*!
+	 * Built as the library is loaded, before any thread could look at it.
+	 */
+	struct EscapeTable
 	{
-		const char exclaim[]="%21";
-		std::copy(exclaim, exclaim+sizeof(exclaim)-1, std::back_inserter(urlCharacters['!']));
-
-		const char rightbrac[]="%5D";
-		std::copy(rightbrac, rightbrac+sizeof(rightbrac)-1, std::back_inserter(urlCharacters[']']));
-
-		const char leftbrac[]="%5B";
-		std::copy(leftbrac, leftbrac+sizeof(leftbrac)-1, std::back_inserter(urlCharacters['[']));
-
-		const char number[]="%23";
-		std::copy(number, number+sizeof(number)-1, std::back_inserter(urlCharacters['#']));
-
-		const char question[]="%3F";
-		std::copy(question, question+sizeof(question)-1, std::back_inserter(urlCharacters['?']));
-
-		const char slash[]="%2F";
-		std::copy(slash, slash+sizeof(slash)-1, std::back_inserter(urlCharacters['/']));
-
-		const char comma[]="%2C";
-		std::copy(comma, comma+sizeof(comma)-1, std::back_inserter(urlCharacters[',']));
-
-		const char money[]="%24";
-		std::copy(money, money+sizeof(money)-1, std::back_inserter(urlCharacters['$']));
-
-		const char plus[]="%2B";
-		std::copy(plus, plus+sizeof(plus)-1, std::back_inserter(urlCharacters['+']));
-
-		const char equal[]="%3D";
-		std::copy(equal, equal+sizeof(equal)-1, std::back_inserter(urlCharacters['=']));
+		EscapeTable();
 
-		const char andsym[]="%26";
-		std::copy(andsym, andsym+sizeof(andsym)-1, std::back_inserter(urlCharacters['&']));
+		//! Replacement strings. Only the first size characters are meaningful.
+		char replacements[encodings][256][8];
+		//! Size of the replacements. 0 means the character is written as is.
+		unsigned char sizes[encodings][256];
 
-		const char at[]="%40";
-		std::copy(at, at+sizeof(at)-1, std::back_inserter(urlCharacters['@']));
-
-		const char colon[]="%3A";
-		std::copy(colon, colon+sizeof(colon)-1, std::back_inserter(urlCharacters[':']));
-
-		const char semi[]="%3B";
-		std::copy(semi, semi+sizeof(semi)-1, std::back_inserter(urlCharacters[';']));
+	private:
+		void set(OutputEncoding encoding, unsigned char character, const char* replacement)
+		{
+			sizes[encoding][character]=std::strlen(replacement);
+			std::memcpy(replacements[encoding][character], replacement, sizes[encoding][character]);
+		}
+		void setHex(OutputEncoding encoding, unsigned char character, const char* prefix, const char* suffix)
+		{
+			const char hex[]="0123456789ABCDEF";
+			char replacement[8];
+			std::strcpy(replacement, prefix);
+			const size_t size=std::strlen(replacement);
+			replacement[size]=hex[character>>4];
+			replacement[size+1]=hex[character&0x0f];
+			std::strcpy(replacement+size+2, suffix);
+			set(encoding, character, replacement);
+		}
+	};
 
-		const char rightpar[]="%29";
-		std::copy(rightpar, rightpar+sizeof(rightpar)-1, std::back_inserter(urlCharacters[')']));
+	inline bool isAlphanumeric(unsigned int c) { return (c>='0' && c<='9') || (c>='A' && c<='Z') || (c>='a' && c<='z'); }
 
-		const char leftpar[]="%28";
-		std::copy(leftpar, leftpar+sizeof(leftpar)-1, std::back_inserter(urlCharacters['(']));
+	EscapeTable::EscapeTable()
+	{
+		std::memset(sizes, 0, sizeof(sizes));
+
+		set(HTML, '"', "&quot;");
+		set(HTML, '>', "&gt;");
+		set(HTML, '<', "&lt;");
+		set(HTML, '&', "&amp;");
+		set(HTML, '\'', "&apos;");
+
+		const char url[]="!][#?/,$+=&@:;)('*<>\" %";
+		for(const char* c=url; *c; ++c)
+			setHex(URL, *c, "%", "");
+
+		for(unsigned int c=0; c<0x20; ++c)
+			setHex(JSON, c, "\\u00", "");
+		set(JSON, '"', "\\\"");
+		set(JSON, '\\', "\\\\");
+		set(JSON, '\b', "\\b");
+		set(JSON, '\f', "\\f");
+		set(JSON, '\n', "\\n");
+		set(JSON, '\r', "\\r");
+		set(JSON, '\t', "\\t");
+		// Keeps strings from closing a surrounding script element
+		setHex(JSON, '<', "\\u00", "");
+		setHex(JSON, '>', "\\u00", "");
+		setHex(JSON, '&', "\\u00", "");
+
+		for(unsigned int c=0; c<0x80; ++c)
+			if(!isAlphanumeric(c))
+				setHex(HTML_ATTRIBUTE, c, "&#x", ";");
+
+		for(unsigned int c=0; c<0x100; ++c)
+			if(!isAlphanumeric(c) && c!='-' && c!='.' && c!='_' && c!='~')
+				setHex(URI_COMPONENT, c, "%", "");
+	}
 
-		const char apos[]="%27";
-		std::copy(apos, apos+sizeof(apos)-1, std::back_inserter(urlCharacters['\'']));
+	const EscapeTable escapeTable;
 
-		const char star[]="%2A";
-		std::copy(star, star+sizeof(star)-1, std::back_inserter(urlCharacters['*']));
+	//! True if a character needs replacing in an encoding
+	inline bool needsEscape(char c, OutputEncoding encoding) { return escapeTable.sizes[encoding][(unsigned char)c]; }
+	inline bool needsEscape(wchar_t c, OutputEncoding encoding)
+	{
+		if(c>=0 && c<0x80)
+			return escapeTable.sizes[encoding][c];
+		// Anything else is only escaped as the bytes of it's UTF-8 form
+		return encoding==URI_COMPONENT;
+	}
 
-		const char lt[]="%3C";
-		std::copy(lt, lt+sizeof(lt)-1, std::back_inserter(urlCharacters['<']));
+#ifdef __SSE2__
+	inline __m128i load(const char* s) { return _mm_loadu_si128((const __m128i*)s); }
+	//! Narrows characters to bytes, with anything beyond ASCII becoming a byte with the high bit set
+	inline __m128i load(const wchar_t* s)
+	{
+		const __m128i low=_mm_packs_epi32(_mm_loadu_si128((const __m128i*)s), _mm_loadu_si128((const __m128i*)(s+4)));
+		const __m128i high=_mm_packs_epi32(_mm_loadu_si128((const __m128i*)(s+8)), _mm_loadu_si128((const __m128i*)(s+12)));
+		return _mm_packus_epi16(low, high);
+	}
 
-		const char gt[]="%3E";
-		std::copy(gt, gt+sizeof(gt)-1, std::back_inserter(urlCharacters['>']));
+	inline __m128i equal(__m128i bytes, char c) { return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)); }
+	//! Bytes from low to high inclusive. Bytes with the high bit set are never in range.
+	inline __m128i range(__m128i bytes, char low, char high) { return _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(low-1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8(high+1))); }
+	inline __m128i alphanumeric(__m128i bytes) { return _mm_or_si128(_mm_or_si128(range(bytes, '0', '9'), range(bytes, 'A', 'Z')), range(bytes, 'a', 'z')); }
 
-		const char quot[]="%22";
-		std::copy(quot, quot+sizeof(quot)-1, std::back_inserter(urlCharacters['"']));
+	//! Flags bytes that may need escaping
+	/*!
+	 * This may flag bytes that turn out not to need it, but never misses one that does.
+	 */
+	inline __m128i escapeMask(__m128i bytes, OutputEncoding encoding)
+	{
+		switch(encoding)
+		{
+			case HTML:
+				return _mm_or_si128(_mm_or_si128(_mm_or_si128(equal(bytes, '"'), equal(bytes, '>')), _mm_or_si128(equal(bytes, '<'), equal(bytes, '&'))), equal(bytes, '\''));
+			case URL:
+				return _mm_or_si128(_mm_or_si128(_mm_or_si128(range(bytes, ' ', ','), equal(bytes, '/')), range(bytes, ':', '@')), _mm_or_si128(equal(bytes, '['), equal(bytes, ']')));
+			case JSON:
+				return _mm_or_si128(_mm_or_si128(_mm_or_si128(range(bytes, 0, 0x1f), equal(bytes, '"')), _mm_or_si128(equal(bytes, '\\'), equal(bytes, '<'))), _mm_or_si128(equal(bytes, '>'), equal(bytes, '&')));
+			case HTML_ATTRIBUTE:
+				return _mm_andnot_si128(alphanumeric(bytes), _mm_cmpgt_epi8(bytes, _mm_set1_epi8(-1)));
+			default:
+			{
+				const __m128i plain=_mm_or_si128(_mm_or_si128(alphanumeric(bytes), _mm_or_si128(equal(bytes, '-'), equal(bytes, '.'))), _mm_or_si128(equal(bytes, '_'), equal(bytes, '~')));
+				return _mm_cmpeq_epi8(plain, _mm_setzero_si128());
+			}
+		}
+	}
+#endif
 
-		const char space[]="%20";
-		std::copy(space, space+sizeof(space)-1, std::back_inserter(urlCharacters[' ']));
+	//! Length of the run of characters at the start of some text that need no escaping
+	template<class charT> size_t plainRun(const charT* s, size_t n, OutputEncoding encoding)
+	{
+		size_t i=0;
+#ifdef __SSE2__
+		while(i+16<=n)
+		{{
+			const int flagged=_mm_movemask_epi8(escapeMask(load(s+i), encoding));
+			if(!flagged)
+			{
+				i+=16;
+				continue;
+			}
+			i+=__builtin_ctz(flagged);
+			if(needsEscape(s[i], encoding))
+				return i;
+			++i;
+		}}
+#endif
+		while(i<n && !needsEscape(s[i], encoding))
+			++i;
+		return i;
+	}
 
-		const char percent[]="%25";
-		std::copy(percent, percent+sizeof(percent)-1, std::back_inserter(urlCharacters['%']));
+	//! Write a replacement made of narrow characters
+	template<class charT, class Sink> void writeReplacement(Sink& dest, const char* replacement, size_t size)
+	{
+		charT buffer[8];
+		std::copy(replacement, replacement+size, buffer);
+		boost::iostreams::write(dest, buffer, size);
 	}
 
-	if(m_state==NONE)
-		boost::iostreams::write(dest, s, n);
-	else
+	//! Write the escaped form of a single character
+	template<class Sink> void writeEscaped(Sink& dest, char c, OutputEncoding encoding)
 	{
-		std::map<charT, std::basic_string<charT> >* characters;
-		switch(m_state)
+		writeReplacement<char>(dest, escapeTable.replacements[encoding][(unsigned char)c], escapeTable.sizes[encoding][(unsigned char)c]);
+	}
+	template<class Sink> void writeEscaped(Sink& dest, wchar_t c, OutputEncoding encoding)
+	{
+		if(c>=0 && c<0x80)
 		{
-			case HTML:
-				characters = &htmlCharacters;
-				break;
-			case URL:
-				characters = &urlCharacters;
-				break;
+			writeReplacement<wchar_t>(dest, escapeTable.replacements[encoding][c], escapeTable.sizes[encoding][c]);
+			return;
 		}
 
-		const charT* start=s;
-		typename std::map<charT, std::basic_string<charT> >::const_iterator it;
-		for(const charT* i=s; i < s+n; ++i)
+		// Percent escape every byte of the UTF-8 form, or of U+FFFD if there is none
+		char bytes[4];
+		size_t size=Utf8::encode(&c, 1, bytes);
+		if(size==Utf8::invalid)
 		{
-			it=characters->find(*i);
-			if(it!=characters->end())
-			{
-				if(start<i) boost::iostreams::write(dest, start, start-i);
-				boost::iostreams::write(dest, it->second.data(), it->second.size());
-				start=i+1;
-			}
+			const char replacement[]="\xef\xbf\xbd";
+			std::memcpy(bytes, replacement, sizeof(replacement)-1);
+			size=sizeof(replacement)-1;
 		}
-		int size=s+n-start;
-		if(size) boost::iostreams::write(dest, start, size);
+		for(size_t i=0; i<size; ++i)
+			writeReplacement<wchar_t>(dest, escapeTable.replacements[URI_COMPONENT][(unsigned char)bytes[i]], escapeTable.sizes[URI_COMPONENT][(unsigned char)bytes[i]]);
 	}
+}
+
+template<typename charT> template<typename Sink> std::streamsize Fastcgipp::Fcgistream<charT>::Encoder::write(Sink& dest, const charT* s, std::streamsize n)
+{
+	if(m_state==NONE)
+	{
+		boost::iostreams::write(dest, s, n);
+		return n;
+	}
+
+	const charT* const end=s+n;
+	while(s<end)
+	{{
+		const size_t run=plainRun(s, end-s, m_state);
+		if(run)
+			boost::iostreams::write(dest, s, run);
+		s+=run;
+		if(s==end)
+			break;
+		writeEscaped(dest, *s++, m_state);
+	}}
 	return n;
 }
 
@@ -156,21 +241,104 @@ std::streamsize Fastcgipp::FcgistreamSink::write(const char* s, std::streamsize
 		s+=contentLength;
 		n-=contentLength;
 
-		uint8_t contentPadding=chunkSize-contentLength%chunkSize;
-		if(contentPadding==8) contentPadding=0;
-		
-		Header& header=*(Header*)dataBlock.data;
-		header.setVersion(Protocol::version);
-		header.setType(m_type);
-		header.setRequestId(m_id.fcgiId);
-		header.setContentLength(contentLength);
-		header.setPaddingLength(contentPadding);
-
-		m_transceiver->secureWrite(size, m_id, false);	
+		secureRecord(dataBlock.data, contentLength);
 	}}
 	return totalUsed;
 }
 
+void Fastcgipp::FcgistreamSink::secureRecord(char* record, uint16_t contentLength)
+{
+	using namespace Protocol;
+
+	uint8_t contentPadding=chunkSize-contentLength%chunkSize;
+	if(contentPadding==8) contentPadding=0;
+
+	Header& header=*(Header*)record;
+	header.setVersion(Protocol::version);
+	header.setType(m_type);
+	header.setRequestId(m_id.fcgiId);
+	header.setContentLength(contentLength);
+	header.setPaddingLength(contentPadding);
+
+	m_transceiver->secureWrite(sizeof(Header)+contentLength+contentPadding, m_id, false);
+	m_written+=contentLength;
+}
+
+std::streamsize Fastcgipp::Utf8FcgistreamSink::write(const wchar_t* s, std::streamsize n)
+{
+	using namespace std;
+	using namespace Protocol;
+	const wchar_t* const end=s+n;
+	while(s<end)
+	{{
+		// Ask for enough room to encode everything should every character take the most bytes possible
+		size_t size=sizeof(Header)+Utf8::maxEncodedSize(end-s);
+		size+=(chunkSize-size%chunkSize)%chunkSize;
+		if(size>numeric_limits<uint16_t>::max()) size=numeric_limits<uint16_t>::max();
+		Block dataBlock(transceiver().requestWrite(size));
+		size=(dataBlock.size/chunkSize)*chunkSize;
+
+		char* const content=dataBlock.data+sizeof(Header);
+		char* const contentEnd=dataBlock.data+size;
+		char* it=content;
+		while(s<end)
+		{{
+			it+=Utf8::encode(s, end, it, contentEnd-it);
+			if(s==end || size_t(contentEnd-it)<Utf8::maxEncodedSize(1))
+				break;
+
+			// Encoding stopped short with room to spare so the character is invalid
+			const char replacement[]="\xef\xbf\xbd";
+			memcpy(it, replacement, sizeof(replacement)-1);
+			it+=sizeof(replacement)-1;
+			++s;
+		}}
+
+		secureRecord(dataBlock.data, it-content);
+	}}
+	return n;
+}
+
+void Fastcgipp::RecordWriter::open()
+{
+	using namespace std;
+	using namespace Protocol;
+
+	secure();
+
+	Block block(m_sink.transceiver().requestWrite(numeric_limits<uint16_t>::max()));
+	m_record=block.data;
+	m_position=m_record+sizeof(Header);
+	// Room for the header and for padding the content to a multiple of chunkSize
+	m_end=m_record+(block.size/chunkSize)*chunkSize;
+}
+
+void Fastcgipp::RecordWriter::secure()
+{
+	using namespace Protocol;
+
+	// An empty record would end the stream
+	if(m_record && m_position!=m_record+sizeof(Header))
+		m_sink.secureRecord(m_record, m_position-m_record-sizeof(Header));
+	m_record=0;
+	m_position=0;
+	m_end=0;
+}
+
+void Fastcgipp::RecordWriter::write(const char* data, size_t size)
+{
+	while(size)
+	{{
+		if(!m_record || m_position==m_end)
+			open();
+		const size_t chunk=std::min(size, size_t(m_end-m_position));
+		std::memcpy(m_position, data, chunk);
+		m_position+=chunk;
+		data+=chunk;
+		size-=chunk;
+	}}
+}
+
 void Fastcgipp::FcgistreamSink::dump(std::basic_istream<char>& stream)
 {
 	const size_t bufferSize=32768;
@@ -191,8 +359,8 @@ template<typename T, typename toChar, typename fromChar> T& fixPush(boost::iostr
 
 template<> Fastcgipp::FcgistreamSink& fixPush<Fastcgipp::FcgistreamSink, char, wchar_t>(boost::iostreams::filtering_stream<boost::iostreams::output, wchar_t>& stream, const Fastcgipp::FcgistreamSink& t, int buffer_size)
 {
-	stream.push(boost::iostreams::code_converter<Fastcgipp::FcgistreamSink, utf8CodeCvt::utf8_codecvt_facet>(t, buffer_size));
-	return **stream.component<boost::iostreams::code_converter<Fastcgipp::FcgistreamSink, utf8CodeCvt::utf8_codecvt_facet> >(stream.size()-1);
+	stream.push(Fastcgipp::Utf8FcgistreamSink(t), buffer_size);
+	return *stream.component<Fastcgipp::Utf8FcgistreamSink>(stream.size()-1);
 }
 
 
@@ -218,3 +386,51 @@ template<class charT, class Traits> std::basic_ostream<charT, Traits>& Fastcgipp
 
 	return os;
 }
+
+size_t Fastcgipp::number::format(int precision, char* destination) const
+{
+	switch(m_type)
+	{
+		case SIGNED:
+			return Format::integer(m_signed, destination);
+		case UNSIGNED:
+			return Format::integer(m_unsigned, destination);
+		default:
+			return Format::floating(m_floating, precision, destination);
+	}
+}
+
+namespace
+{
+	//! Insert formatted ASCII into a stream
+	template<class charT, class Traits> void writeFormatted(std::basic_ostream<charT, Traits>& os, const char* data, size_t size)
+	{
+		charT widened[Fastcgipp::Format::maxFloatingSize];
+		for(size_t i=0; i<size; ++i)
+			widened[i]=data[i];
+		os.write(widened, size);
+	}
+
+	template<class Traits> void writeFormatted(std::basic_ostream<char, Traits>& os, const char* data, size_t size)
+	{
+		os.write(data, size);
+	}
+}
+
+template std::basic_ostream<char, std::char_traits<char> >& Fastcgipp::operator<< <char, std::char_traits<char> >(std::basic_ostream<char, std::char_traits<char> >& os, const number& value);
+template std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& Fastcgipp::operator<< <wchar_t, std::char_traits<wchar_t> >(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& os, const number& value);
+template<class charT, class Traits> std::basic_ostream<charT, Traits>& Fastcgipp::operator<<(std::basic_ostream<charT, Traits>& os, const number& value)
+{
+	char text[Format::maxFloatingSize];
+	writeFormatted(os, text, value.format(os.precision(), text));
+	return os;
+}
+
+template std::basic_ostream<char, std::char_traits<char> >& Fastcgipp::operator<< <char, std::char_traits<char> >(std::basic_ostream<char, std::char_traits<char> >& os, const httpDate& date);
+template std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& Fastcgipp::operator<< <wchar_t, std::char_traits<wchar_t> >(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& os, const httpDate& date);
+template<class charT, class Traits> std::basic_ostream<charT, Traits>& Fastcgipp::operator<<(std::basic_ostream<charT, Traits>& os, const httpDate& date)
+{
+	char text[Format::httpDateSize];
+	writeFormatted(os, text, Format::httpDate(date.m_time, text));
+	return os;
+}
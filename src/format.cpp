@@ -0,0 +1,174 @@
+//! \file format.cpp Defines the Fastcgipp::Format number and date formatting functions
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <clocale>
+#include <cstdio>
+#include <cstring>
+#include <boost/thread/tss.hpp>
+
+#include <fastcgi++/format.hpp>
+
+namespace
+{
+	//! "00" through "99" for writing integers two digits at a time
+	const char digitPairs[]=
+		"00010203040506070809"
+		"10111213141516171819"
+		"20212223242526272829"
+		"30313233343536373839"
+		"40414243444546474849"
+		"50515253545556575859"
+		"60616263646566676869"
+		"70717273747576777879"
+		"80818283848586878889"
+		"90919293949596979899";
+
+	const char weekDays[7][4]={ "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+	const char months[12][4]={ "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	//! The last date a thread formatted
+	struct HttpDateCache
+	{
+		std::time_t time;
+		char text[Fastcgipp::Format::httpDateSize];
+	};
+	boost::thread_specific_ptr<HttpDateCache> httpDateCache;
+
+	//! Write two digits
+	inline void writePair(char* destination, unsigned int value)
+	{
+		std::memcpy(destination, digitPairs+value*2, 2);
+	}
+}
+
+size_t Fastcgipp::Format::integer(unsigned long long value, char* destination)
+{
+	size_t size=1;
+	for(unsigned long long i=value; i>=10; i/=10)
+		++size;
+
+	char* it=destination+size;
+	while(value>=100)
+	{{
+		it-=2;
+		writePair(it, value%100);
+		value/=100;
+	}}
+	if(value>=10)
+		writePair(it-2, value);
+	else
+		*--it='0'+value;
+
+	return size;
+}
+
+size_t Fastcgipp::Format::integer(long long value, char* destination)
+{
+	if(value>=0)
+		return integer((unsigned long long)value, destination);
+	*destination='-';
+	// Negating as unsigned keeps the most negative value in range
+	return integer(0-(unsigned long long)value, destination+1)+1;
+}
+
+size_t Fastcgipp::Format::floating(double value, int precision, char* destination)
+{
+	if(precision>17)
+		precision=17;
+	if(precision<0)
+		precision=6;
+	int size=std::snprintf(destination, maxFloatingSize, "%.*g", precision, value);
+	if(size<0)
+		return 0;
+
+	// printf follows LC_NUMERIC so a program that set a locale may get something else than a '.'
+	const char* const point=std::localeconv()->decimal_point;
+	if(point[0]!='.' || point[1])
+	{
+		const size_t pointSize=std::strlen(point);
+		char* const found=pointSize?std::strstr(destination, point):0;
+		if(found)
+		{
+			*found='.';
+			std::memmove(found+1, found+pointSize, destination+size-(found+pointSize)+1);
+			size-=pointSize-1;
+		}
+	}
+	return size;
+}
+
+size_t Fastcgipp::Format::httpDate(std::time_t time, char* destination)
+{
+	HttpDateCache* cache=httpDateCache.get();
+	if(!cache)
+	{
+		cache=new HttpDateCache;
+		cache->time=time-1;
+		httpDateCache.reset(cache);
+	}
+
+	if(cache->time!=time)
+	{
+		long long days=time/86400;
+		long long seconds=time%86400;
+		if(seconds<0)
+		{
+			seconds+=86400;
+			--days;
+		}
+
+		// Civil date from days since the epoch, counting years from March so leap
+		// days fall at the end of them
+		const long long shifted=days+719468;
+		const long long era=(shifted>=0?shifted:shifted-146096)/146097;
+		const unsigned int dayOfEra=shifted-era*146097;
+		const unsigned int yearOfEra=(dayOfEra-dayOfEra/1460+dayOfEra/36524-dayOfEra/146096)/365;
+		const unsigned int dayOfYear=dayOfEra-(365*yearOfEra+yearOfEra/4-yearOfEra/100);
+		const unsigned int shiftedMonth=(5*dayOfYear+2)/153;
+		const unsigned int day=dayOfYear-(153*shiftedMonth+2)/5+1;
+		const unsigned int month=shiftedMonth<10?shiftedMonth+2:shiftedMonth-10;
+		const long long year=yearOfEra+era*400+(month<2);
+
+		char* it=cache->text;
+		std::memcpy(it, weekDays[((days%7)+7)%7], 3);
+		std::memcpy(it+3, ", ", 2);
+		writePair(it+5, day);
+		*(it+7)=' ';
+		std::memcpy(it+8, months[month], 3);
+		*(it+11)=' ';
+		// Years outside of four digits aren't valid in HTTP anyway
+		const unsigned int clampedYear=year<0?0:year>9999?9999:year;
+		writePair(it+12, clampedYear/100);
+		writePair(it+14, clampedYear%100);
+		*(it+16)=' ';
+		writePair(it+17, seconds/3600);
+		*(it+19)=':';
+		writePair(it+20, seconds/60%60);
+		*(it+22)=':';
+		writePair(it+23, seconds%60);
+		std::memcpy(it+25, " GMT", 4);
+
+		cache->time=time;
+	}
+
+	std::memcpy(destination, cache->text, httpDateSize);
+	return httpDateSize;
+}
@@ -24,28 +24,22 @@
 #include <fastcgi++/http.hpp>
 #include <fastcgi++/protocol.hpp>
 
-#include "utf8_codecvt.hpp"
+#include <fastcgi++/utf8.hpp>
 
 void Fastcgipp::Http::charToString(const char* data, size_t size, std::wstring& string)
 {
-	const size_t bufferSize=512;
-	wchar_t buffer[bufferSize];
-	using namespace std;
-
 	if(size)
 	{
-		codecvt_base::result cr=codecvt_base::partial;
-		while(cr==codecvt_base::partial)
-		{{
-			wchar_t* it;
-			const char* tmpData;
-			mbstate_t conversionState = mbstate_t();
-			cr=use_facet<codecvt<wchar_t, char, mbstate_t> >(locale(locale::classic(), new utf8CodeCvt::utf8_codecvt_facet)).in(conversionState, data, data+size, tmpData, buffer, buffer+bufferSize, it);
-			string.append(buffer, it);
-			size-=tmpData-data;
-			data=tmpData;
-		}}
-		if(cr==codecvt_base::error) throw Exceptions::CodeCvt();
+		// UTF-8 never decodes to more characters than it has bytes
+		const size_t start=string.size();
+		string.resize(start+size);
+		const size_t decoded=Utf8::decode(data, size, &string[start]);
+		if(decoded==Utf8::invalid)
+		{
+			string.resize(start);
+			throw Exceptions::CodeCvt();
+		}
+		string.resize(start+decoded);
 	}
 }
 
@@ -100,6 +94,41 @@ size_t Fastcgipp::Http::percentEscapedToRealBytes(const char* source, char* dest
 	return destination-start;
 }
 
+template void Fastcgipp::Http::Environment<char>::clear();
+template void Fastcgipp::Http::Environment<wchar_t>::clear();
+template<class charT> void Fastcgipp::Http::Environment<charT>::clear()
+{
+	host.clear();
+	userAgent.clear();
+	acceptContentTypes.clear();
+	acceptLanguages.clear();
+	acceptCharsets.clear();
+	referer.clear();
+	contentType.clear();
+	root.clear();
+	scriptName.clear();
+	requestMethod=HTTP_METHOD_ERROR;
+	requestUri.clear();
+	pathInfo.clear();
+	etag=0;
+	keepAlive=0;
+	contentLength=0;
+	serverAddress.zero();
+	remoteAddress.zero();
+	serverPort=0;
+	remotePort=0;
+	ifModifiedSince=boost::posix_time::ptime();
+	requestEnvVariables.clear();
+	cookies.clear();
+	gets.clear();
+	posts.clear();
+	boundary.reset();
+	boundarySize=0;
+	clearPostBuffer();
+	m_parameters.clear();
+	m_parameterData.clear();
+}
+
 template void Fastcgipp::Http::Environment<char>::fill(const char* data, size_t size);
 template void Fastcgipp::Http::Environment<wchar_t>::fill(const char* data, size_t size);
 template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char* data, size_t size)
@@ -107,6 +136,14 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char*
 	using namespace std;
 	using namespace boost;
 
+	if(m_lazy && size)
+	{
+		// Parameters are read out of our own copy so they outlive the record
+		const size_t offset=m_parameterData.size();
+		m_parameterData.insert(m_parameterData.end(), data, data+size);
+		data=&m_parameterData[offset];
+	}
+
 	while(size)
 	{{
 		size_t nameSize;
@@ -117,6 +154,15 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char*
 		size-=value-data+valueSize;
 		data=value+valueSize;
 
+		if(m_lazy)
+		{
+			m_parameters.push_back(Parameter(name-&m_parameterData[0], nameSize, value-&m_parameterData[0], valueSize));
+
+			// Only what is needed to receive post data is parsed straight away
+			if(!(nameSize==14 && (!memcmp(name, "REQUEST_METHOD", 14) || !memcmp(name, "CONTENT_LENGTH", 14))) && !(nameSize==12 && !memcmp(name, "CONTENT_TYPE", 12)))
+				continue;
+		}
+
 		switch(nameSize)
 		{
 		case 9:
@@ -246,16 +292,155 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::fill(const char*
 		}
 
                 // copy all request environment variables to requestEnvVariables
-                if (!memcmp(name, "HTTP_", 5))
+                if (!m_lazy && nameSize>=5 && !memcmp(name, "HTTP_", 5))
                 {
-			std::basic_string<charT> strName, strValue;
-			charToString(name, nameSize, strName);
-			charToString(value, valueSize, strValue);
-			requestEnvVariables.insert(std::make_pair(strName, strValue));
+			typename RequestEnvVariables::value_type& variable=requestEnvVariables.append();
+			charToString(name, nameSize, variable.first);
+			charToString(value, valueSize, variable.second);
                 }
 	}}
 }
 
+template boost::string_ref Fastcgipp::Http::Environment<char>::parameter(const char* name) const;
+template boost::string_ref Fastcgipp::Http::Environment<wchar_t>::parameter(const char* name) const;
+template<class charT> boost::string_ref Fastcgipp::Http::Environment<charT>::parameter(const char* name) const
+{
+	// Requests carry a few dozen parameters at most so a linear search beats anything fancier
+	const size_t nameSize=std::strlen(name);
+	for(typename std::vector<Parameter>::const_iterator it=m_parameters.begin(); it!=m_parameters.end(); ++it)
+		if(it->nameSize==nameSize && !std::memcmp(&m_parameterData[it->name], name, nameSize))
+			return boost::string_ref(&m_parameterData[it->value], it->valueSize);
+	return boost::string_ref();
+}
+
+template bool Fastcgipp::Http::Environment<char>::parameter(const char* name, std::basic_string<char>& value) const;
+template bool Fastcgipp::Http::Environment<wchar_t>::parameter(const char* name, std::basic_string<wchar_t>& value) const;
+template<class charT> bool Fastcgipp::Http::Environment<charT>::parameter(const char* name, std::basic_string<charT>& value) const
+{
+	if(!checkForParameter(name))
+		return false;
+	const boost::string_ref raw=parameter(name);
+	// The wide charToString() appends
+	value.clear();
+	charToString(raw.data(), raw.size(), value);
+	return true;
+}
+
+template int Fastcgipp::Http::Environment<char>::parameterInt(const char* name) const;
+template int Fastcgipp::Http::Environment<wchar_t>::parameterInt(const char* name) const;
+template<class charT> int Fastcgipp::Http::Environment<charT>::parameterInt(const char* name) const
+{
+	const boost::string_ref value=parameter(name);
+	return value.empty()?0:atoi(value.data(), value.data()+value.size());
+}
+
+template Fastcgipp::Http::Address Fastcgipp::Http::Environment<char>::parameterAddress(const char* name) const;
+template Fastcgipp::Http::Address Fastcgipp::Http::Environment<wchar_t>::parameterAddress(const char* name) const;
+template<class charT> Fastcgipp::Http::Address Fastcgipp::Http::Environment<charT>::parameterAddress(const char* name) const
+{
+	Address address;
+	address.zero();
+	const boost::string_ref value=parameter(name);
+	if(!value.empty())
+		address.assign(value.data(), value.data()+value.size());
+	return address;
+}
+
+template bool Fastcgipp::Http::Environment<char>::checkForParameter(const char* name) const;
+template bool Fastcgipp::Http::Environment<wchar_t>::checkForParameter(const char* name) const;
+template<class charT> bool Fastcgipp::Http::Environment<charT>::checkForParameter(const char* name) const
+{
+	const size_t nameSize=std::strlen(name);
+	for(typename std::vector<Parameter>::const_iterator it=m_parameters.begin(); it!=m_parameters.end(); ++it)
+		if(it->nameSize==nameSize && !std::memcmp(&m_parameterData[it->name], name, nameSize))
+			return true;
+	return false;
+}
+
+namespace Fastcgipp
+{
+	namespace Http
+	{
+		//! Find a single value in url-encoded data and decode it
+		/*!
+		 * Field names are compared after decoding them byte by byte so nothing is
+		 * allocated for fields that don't match.
+		 *
+		 * @param[in] data Url-encoded data
+		 * @param[in] size Size of data
+		 * @param[in] key Name of the value to find
+		 * @param[out] value Set to the decoded value if found
+		 * @param[in] fieldSeperator Character separating fields
+		 * @return True if the value was found
+		 */
+		template<class charT> bool findUrlEncoded(const char* data, size_t size, const char* key, std::basic_string<charT>& value, const char fieldSeperator)
+		{
+			const char* const end=data+size;
+			while(data<end)
+			{{
+				const char* fieldEnd=(const char*)std::memchr(data, fieldSeperator, end-data);
+				if(!fieldEnd)
+					fieldEnd=end;
+				while(data<fieldEnd && *data==' ')
+					++data;
+
+				const char* separator=(const char*)std::memchr(data, '=', fieldEnd-data);
+				if(separator)
+				{
+					const char* k=key;
+					const char* i=data;
+					bool match=true;
+					while(match && i<separator && *k)
+					{{
+						char c;
+						if(*i=='%' && separator-i>2)
+						{
+							percentEscapedToRealBytes(i, &c, 3);
+							i+=3;
+						}
+						else
+						{
+							c=*i=='+'?' ':*i;
+							++i;
+						}
+						match=c==*k++;
+					}}
+
+					if(match && i==separator && !*k)
+					{
+						const size_t escapedSize=fieldEnd-(separator+1);
+						char stackBuffer[256];
+						boost::scoped_array<char> heapBuffer(escapedSize>sizeof(stackBuffer)?new char[escapedSize]:0);
+						char* const buffer=heapBuffer?heapBuffer.get():stackBuffer;
+						value.clear();
+						charToString(buffer, percentEscapedToRealBytes(separator+1, buffer, escapedSize), value);
+						return true;
+					}
+				}
+
+				data=fieldEnd+1;
+			}}
+			return false;
+		}
+	}
+}
+
+template bool Fastcgipp::Http::Environment<char>::findGet(const char* key, std::basic_string<char>& value) const;
+template bool Fastcgipp::Http::Environment<wchar_t>::findGet(const char* key, std::basic_string<wchar_t>& value) const;
+template<class charT> bool Fastcgipp::Http::Environment<charT>::findGet(const char* key, std::basic_string<charT>& value) const
+{
+	const boost::string_ref query=parameter("QUERY_STRING");
+	return findUrlEncoded(query.data(), query.size(), key, value, '&');
+}
+
+template bool Fastcgipp::Http::Environment<char>::findCookie(const char* key, std::basic_string<char>& value) const;
+template bool Fastcgipp::Http::Environment<wchar_t>::findCookie(const char* key, std::basic_string<wchar_t>& value) const;
+template<class charT> bool Fastcgipp::Http::Environment<charT>::findCookie(const char* key, std::basic_string<charT>& value) const
+{
+	const boost::string_ref cookie=parameter("HTTP_COOKIE");
+	return findUrlEncoded(cookie.data(), cookie.size(), key, value, ';');
+}
+
 template bool Fastcgipp::Http::Environment<char>::fillPostBuffer(const char* data, size_t size);
 template bool Fastcgipp::Http::Environment<wchar_t>::fillPostBuffer(const char* data, size_t size);
 template<class charT> bool Fastcgipp::Http::Environment<charT>::fillPostBuffer(const char* data, size_t size)
@@ -397,10 +582,10 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsMultip
 
 					if(nameSize != -1)
 					{
-						basic_string<charT> name;
-						charToString(nameStart, nameSize, name);
+						typename Posts::value_type& post=posts.append();
+						charToString(nameStart, nameSize, post.first);
 
-						Post<charT>& thePost=posts[name];
+						Post<charT>& thePost=post.second;
 						if(contentTypeSize != -1)
 						{
 							thePost.type=Post<charT>::file;
@@ -445,7 +630,7 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsUrlEnc
 		return;
 
 	char* nameStart=m_postBuffer.get();
-	size_t nameSize;
+	size_t nameSize=0;
 	char* valueStart=0;
 	size_t valueSize;
 
@@ -460,10 +645,10 @@ template<class charT> void Fastcgipp::Http::Environment<charT>::parsePostsUrlEnc
 		{
 			valueSize=percentEscapedToRealBytes(valueStart, valueStart, i-valueStart);
 
-			std::basic_string<charT> name;
-			charToString(nameStart, nameSize, name);
+			typename Posts::value_type& post=posts.append();
+			charToString(nameStart, nameSize, post.first);
 			nameStart=i+1;
-			Post<charT>& thePost=posts[name];
+			Post<charT>& thePost=post.second;
 			thePost.type=Post<charT>::form;
 			charToString(valueStart, valueSize, thePost.value);
 			valueStart=0;
@@ -496,9 +681,9 @@ template<class charT> const Fastcgipp::Http::SessionId& Fastcgipp::Http::Session
 	return *this;
 }
 
-template void Fastcgipp::Http::decodeUrlEncoded<char>(const char* data, size_t size, std::map<std::basic_string<char>, std::basic_string<char> >& output, const char fieldSeperator);
-template void Fastcgipp::Http::decodeUrlEncoded<wchar_t>(const char* data, size_t size, std::map<std::basic_string<wchar_t>, std::basic_string<wchar_t> >& output, const char fieldSeperator);
-template<class charT> void Fastcgipp::Http::decodeUrlEncoded(const char* data, size_t size, std::map<std::basic_string<charT>, std::basic_string<charT> >& output, const char fieldSeperator)
+template void Fastcgipp::Http::decodeUrlEncoded<char>(const char* data, size_t size, FlatMap<char, std::basic_string<char> >& output, const char fieldSeperator);
+template void Fastcgipp::Http::decodeUrlEncoded<wchar_t>(const char* data, size_t size, FlatMap<wchar_t, std::basic_string<wchar_t> >& output, const char fieldSeperator);
+template<class charT> void Fastcgipp::Http::decodeUrlEncoded(const char* data, size_t size, FlatMap<charT, std::basic_string<charT> >& output, const char fieldSeperator)
 {
 	using namespace std;
 
@@ -506,7 +691,7 @@ template<class charT> void Fastcgipp::Http::decodeUrlEncoded(const char* data, s
 	memcpy(buffer.get(), data, size);
 
 	char* nameStart=buffer.get();
-	size_t nameSize;
+	size_t nameSize=0;
 	char* valueStart=0;
 	size_t valueSize;
 	for(char* i=buffer.get(); i<=buffer.get()+size; ++i)
@@ -517,11 +702,10 @@ template<class charT> void Fastcgipp::Http::decodeUrlEncoded(const char* data, s
 			{
 				valueSize=percentEscapedToRealBytes(valueStart, valueStart, i-valueStart);
 
-				basic_string<charT> name;
-				charToString(nameStart, nameSize, name);
+				typename FlatMap<charT, basic_string<charT> >::value_type& field=output.append();
+				charToString(nameStart, nameSize, field.first);
 				nameStart=i+1;
-				basic_string<charT>& value=output[name];
-				charToString(valueStart, valueSize, value);
+				charToString(valueStart, valueSize, field.second);
 				valueStart=0;
 			}
 		}
@@ -0,0 +1,121 @@
+//! \file loadshedder.cpp Defines member functions for Fastcgipp::LoadShedder
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+
+#include <time.h>
+#include <cmath>
+
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/loadshedder.hpp>
+
+Fastcgipp::LoadShedder::LoadShedder(): target(0), interval(100000), firstAbove(0), m_overloaded(false), shedNext(0), shedRun(0), lastShedRun(0), m_shed(0)
+{
+	for(unsigned int i=0; i<buckets; ++i)
+		counts[i].store(0, boost::memory_order_relaxed);
+}
+
+long long Fastcgipp::LoadShedder::now()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (long long)time.tv_sec*1000000+time.tv_nsec/1000;
+}
+
+void Fastcgipp::LoadShedder::setParameters(long long target_, long long interval_)
+{
+	boost::lock_guard<boost::mutex> lock(stateMutex);
+	target.store(target_, boost::memory_order_relaxed);
+	interval.store(interval_, boost::memory_order_relaxed);
+	firstAbove.store(0, boost::memory_order_relaxed);
+	m_overloaded.store(false, boost::memory_order_relaxed);
+	shedNext=0;
+	shedRun=0;
+	lastShedRun=0;
+}
+
+bool Fastcgipp::LoadShedder::dequeued(long long queued)
+{
+	const long long time=now();
+	const long long sojourn=time-queued;
+
+	unsigned int bucket=sojourn>0? 64-__builtin_clzll(sojourn): 0;
+	if(bucket>=buckets)
+		bucket=buckets-1;
+	counts[bucket].fetch_add(1, boost::memory_order_relaxed);
+
+	const long long targetSojourn=target.load(boost::memory_order_relaxed);
+	if(!targetSojourn)
+		return false;
+
+	if(sojourn<targetSojourn)
+	{
+		// The queue drained far enough for this task so it isn't standing
+		if(firstAbove.load(boost::memory_order_relaxed) || m_overloaded.load(boost::memory_order_relaxed))
+		{
+			boost::lock_guard<boost::mutex> lock(stateMutex);
+			firstAbove.store(0, boost::memory_order_relaxed);
+			m_overloaded.store(false, boost::memory_order_relaxed);
+		}
+		return false;
+	}
+
+	boost::lock_guard<boost::mutex> lock(stateMutex);
+	const long long intervalLength=interval.load(boost::memory_order_relaxed);
+
+	if(!firstAbove.load(boost::memory_order_relaxed))
+	{
+		firstAbove.store(time+intervalLength, boost::memory_order_relaxed);
+		return false;
+	}
+
+	if(m_overloaded.load(boost::memory_order_relaxed))
+		return time>=shedNext;
+
+	if(time<firstAbove.load(boost::memory_order_relaxed))
+		return false;
+
+	// Should the last overload have ended recently, carry on at close to the rate it reached
+	const unsigned int delta=shedRun>lastShedRun? shedRun-lastShedRun: 0;
+	shedRun=(delta>1 && time-shedNext<16*intervalLength)? delta-1: 0;
+	lastShedRun=shedRun+1;
+	shedNext=time;
+	m_overloaded.store(true, boost::memory_order_relaxed);
+	return true;
+}
+
+void Fastcgipp::LoadShedder::shed()
+{
+	m_shed.fetch_add(1, boost::memory_order_relaxed);
+
+	boost::lock_guard<boost::mutex> lock(stateMutex);
+	if(!m_overloaded.load(boost::memory_order_relaxed))
+		return;
+	++shedRun;
+	shedNext=now()+(long long)(interval.load(boost::memory_order_relaxed)/std::sqrt((double)shedRun));
+}
+
+void Fastcgipp::LoadShedder::histogram(std::vector<unsigned long long>& counts_) const
+{
+	counts_.resize(buckets);
+	for(unsigned int i=0; i<buckets; ++i)
+		counts_[i]=counts[i].load(boost::memory_order_relaxed);
+}
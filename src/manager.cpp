@@ -1,9 +1,14 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
 #include <fastcgi++/manager.hpp>
 
 
 Fastcgipp::ManagerPar* Fastcgipp::ManagerPar::instance=0;
 
-Fastcgipp::ManagerPar::ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals): transceiver(fd, sendMessage_), asleep(false), stopBool(false), terminateBool(false)
+Fastcgipp::ManagerPar::ManagerPar(int fd, const boost::function<void(Protocol::FullId, Message)>& sendMessage_, bool doSetupSignals, EventBackend backend): transceiver(fd, sendMessage_, backend), maxConns(0), maxReqs(0), mpxsConns(true), asleep(false), stopBool(false), terminateBool(false)
 {
 	if(doSetupSignals) setupSignals();
 	instance=this;
@@ -11,26 +16,14 @@ Fastcgipp::ManagerPar::ManagerPar(int fd, const boost::function<void(Protocol::F
 
 void Fastcgipp::ManagerPar::terminate()
 {
-	boost::lock_guard<boost::mutex> terminateLock(terminateMutex);
-	boost::lock_guard<boost::mutex> sleepLock(sleepMutex);
 	terminateBool=true;
-	if(asleep)
-	{
-		transceiver.wake();
-		asleep=false;
-	}
+	wake();
 }
 
 void Fastcgipp::ManagerPar::stop()
 {
-	boost::lock_guard<boost::mutex> stopLock(stopMutex);
-	boost::lock_guard<boost::mutex> sleepLock(sleepMutex);
 	stopBool=true;
-	if(asleep)
-	{
-		transceiver.wake();
-		asleep=false;
-	}
+	wake();
 }
 
 void Fastcgipp::ManagerPar::signalHandler(int signum)
@@ -66,7 +59,8 @@ void Fastcgipp::ManagerPar::localHandler(Protocol::FullId id)
 {
 	using namespace std;
 	using namespace Protocol;
-	Message message(messages.front());
+	Message message;
+	message.swap(messages.front());
 	messages.pop();
 	
 	if(!message.type)
@@ -76,29 +70,81 @@ void Fastcgipp::ManagerPar::localHandler(Protocol::FullId id)
 		{
 			case GET_VALUES:
 			{
-				size_t nameSize;
-				size_t valueSize;
-				const char* name;
-				const char* value;
-				processParamHeader(message.data.get()+sizeof(Header), header.getContentLength(), name, nameSize, value, valueSize);
-				if(nameSize==14 && !memcmp(name, "FCGI_MAX_CONNS", 14))
-				{
-					Block buffer(transceiver.requestWrite(sizeof(maxConnsReply)));
-					memcpy(buffer.data, (const char*)&maxConnsReply, sizeof(maxConnsReply));
-					transceiver.secureWrite(sizeof(maxConnsReply), id, false);
-				}
-				else if(nameSize==13 && !memcmp(name, "FCGI_MAX_REQS", 13))
-				{
-					Block buffer(transceiver.requestWrite(sizeof(maxReqsReply)));
-					memcpy(buffer.data, (const char*)&maxReqsReply, sizeof(maxReqsReply));
-					transceiver.secureWrite(sizeof(maxReqsReply), id, false);
-				}
-				else if(nameSize==15 && !memcmp(name, "FCGI_MPXS_CONNS", 15))
-				{
-					Block buffer(transceiver.requestWrite(sizeof(mpxsConnsReply)));
-					memcpy(buffer.data, (const char*)&mpxsConnsReply, sizeof(mpxsConnsReply));
-					transceiver.secureWrite(sizeof(mpxsConnsReply), id, false);
-				}
+				// Every name known, answered once, fits in a record along with its value
+				Block buffer(transceiver.requestWrite(sizeof(Header)+3*(2+15+10)+chunkSize));
+				char* pair=buffer.data+sizeof(Header);
+				unsigned int answered=0;
+
+				const char* data=message.data.get()+sizeof(Header);
+				const char* const end=data+header.getContentLength();
+				while(data<end)
+				{{
+					size_t nameSize;
+					size_t valueSize;
+					const char* name;
+					const char* value;
+
+					// Each length takes one byte, or four should its top bit be set
+					const ptrdiff_t nameLengthSize=(*data&0x80)?4:1;
+					if(end-data < nameLengthSize+1)
+						break;
+					const ptrdiff_t lengthsSize=nameLengthSize+((data[nameLengthSize]&0x80)?4:1);
+					if(end-data < lengthsSize)
+						break;
+
+					processParamHeader(data, end-data, name, nameSize, value, valueSize);
+					if(size_t(end-name)<nameSize || size_t(end-name)-nameSize<valueSize)
+						break;
+					data=value+valueSize;
+
+					// Unlimited values are left out of the reply so the other side assumes nothing
+					unsigned int setting;
+					unsigned int known;
+					if(nameSize==14 && !memcmp(name, "FCGI_MAX_CONNS", 14))
+					{
+						setting=maxConns;
+						known=1;
+					}
+					else if(nameSize==13 && !memcmp(name, "FCGI_MAX_REQS", 13))
+					{
+						setting=maxReqs;
+						known=2;
+					}
+					else if(nameSize==15 && !memcmp(name, "FCGI_MPXS_CONNS", 15))
+					{
+						setting=mpxsConns;
+						known=4;
+					}
+					else
+						continue;
+					if(answered&known || (!setting && known!=4))
+						continue;
+					answered|=known;
+
+					char digits[10];
+					char* digit=digits+sizeof(digits);
+					do *--digit='0'+setting%10; while(setting/=10);
+
+					*pair++=nameSize;
+					*pair++=digits+sizeof(digits)-digit;
+					memcpy(pair, name, nameSize);
+					pair+=nameSize;
+					memcpy(pair, digit, digits+sizeof(digits)-digit);
+					pair+=digits+sizeof(digits)-digit;
+				}}
+
+				const size_t contentLength=pair-buffer.data-sizeof(Header);
+				const size_t paddingLength=(chunkSize-contentLength%chunkSize)%chunkSize;
+				memset(pair, 0, paddingLength);
+
+				Header& sendHeader=*(Header*)buffer.data;
+				sendHeader.setVersion(Protocol::version);
+				sendHeader.setType(GET_VALUES_RESULT);
+				sendHeader.setRequestId(0);
+				sendHeader.setContentLength(contentLength);
+				sendHeader.setPaddingLength(paddingLength);
+
+				transceiver.secureWrite(sizeof(Header)+contentLength+paddingLength, id, false);
 
 				break;
 			}
@@ -124,3 +170,184 @@ void Fastcgipp::ManagerPar::localHandler(Protocol::FullId id)
 		}
 	}
 }
+
+void Fastcgipp::ManagerPar::reject(Protocol::FullId id, Protocol::ProtocolStatus status, bool kill)
+{
+	using namespace Protocol;
+
+	Block buffer(transceiver.requestWrite(sizeof(Header)+sizeof(EndRequest)));
+
+	Header& header=*(Header*)buffer.data;
+	header.setVersion(Protocol::version);
+	header.setType(END_REQUEST);
+	header.setRequestId(id.fcgiId);
+	header.setContentLength(sizeof(EndRequest));
+	header.setPaddingLength(0);
+
+	EndRequest& body=*(EndRequest*)(buffer.data+sizeof(Header));
+	body.setAppStatus(0);
+	body.setProtocolStatus(status);
+
+	transceiver.secureWrite(sizeof(Header)+sizeof(EndRequest), id, kill);
+	transceiver.flush(id.fd);
+}
+
+Fastcgipp::ShardedManagerPar* Fastcgipp::ShardedManagerPar::instance=0;
+
+Fastcgipp::ShardedManagerPar::ShardedManagerPar(int fd, unsigned int count, bool doSetupSignals): m_pin(true)
+{
+	if(!count)
+		count=boost::thread::hardware_concurrency();
+	if(!count)
+		count=1;
+
+	fds.push_back(fd);
+	while(fds.size()<count)
+	{{
+		const int shardFd=reusePort(fd);
+		if(shardFd<0)
+			fds.push_back(fd);
+		else
+		{
+			fds.push_back(shardFd);
+			ownFds.push_back(shardFd);
+		}
+	}}
+
+	if(doSetupSignals) setupSignals();
+	instance=this;
+}
+
+Fastcgipp::ShardedManagerPar::~ShardedManagerPar()
+{
+	if(instance==this)
+		instance=0;
+	for(std::vector<int>::iterator it=ownFds.begin(); it!=ownFds.end(); ++it)
+		close(*it);
+}
+
+int Fastcgipp::ShardedManagerPar::reusePort(int fd)
+{
+#ifdef SO_REUSEPORT
+	int option=0;
+	socklen_t optionLength=sizeof(option);
+	// Sockets can only share a port if they all had SO_REUSEPORT set before binding
+	if(getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &option, &optionLength)<0 || !option)
+		return -1;
+
+	int type;
+	optionLength=sizeof(type);
+	if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optionLength)<0)
+		return -1;
+
+	sockaddr_storage address;
+	socklen_t addressLength=sizeof(address);
+	if(getsockname(fd, (sockaddr*)&address, &addressLength)<0)
+		return -1;
+
+	const int shardFd=::socket(address.ss_family, type, 0);
+	if(shardFd<0)
+		return -1;
+
+	option=1;
+	if(setsockopt(shardFd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option))<0
+			|| bind(shardFd, (sockaddr*)&address, addressLength)<0
+			|| listen(shardFd, SOMAXCONN)<0)
+	{
+		close(shardFd);
+		return -1;
+	}
+
+	return shardFd;
+#else
+	return -1;
+#endif
+}
+
+void Fastcgipp::ShardedManagerPar::handler()
+{
+	std::vector<int> cpus;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if(m_pin)
+	{
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if(!sched_getaffinity(0, sizeof(allowed), &allowed))
+			for(int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+				if(CPU_ISSET(cpu, &allowed))
+					cpus.push_back(cpu);
+	}
+#endif
+
+	boost::thread_group threads;
+	for(unsigned int i=0; i<handlers.size(); ++i)
+		threads.create_thread(boost::bind(&ShardedManagerPar::run, this, i, cpus.empty()?-1:cpus[i%cpus.size()]));
+	threads.join_all();
+}
+
+void Fastcgipp::ShardedManagerPar::run(unsigned int shard, int cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if(cpu>=0)
+	{
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(cpu, &cpuSet);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+	}
+#endif
+	handlers[shard]();
+}
+
+void Fastcgipp::ShardedManagerPar::stop()
+{
+	for(std::vector<ManagerPar*>::iterator it=shards.begin(); it!=shards.end(); ++it)
+		(*it)->stop();
+}
+
+void Fastcgipp::ShardedManagerPar::terminate()
+{
+	for(std::vector<ManagerPar*>::iterator it=shards.begin(); it!=shards.end(); ++it)
+		(*it)->terminate();
+}
+
+void Fastcgipp::ShardedManagerPar::setDeferredFlush(bool deferFlush)
+{
+	for(std::vector<ManagerPar*>::iterator it=shards.begin(); it!=shards.end(); ++it)
+		(*it)->setDeferredFlush(deferFlush);
+}
+
+void Fastcgipp::ShardedManagerPar::setChunkParameters(const ChunkParameters& parameters)
+{
+	for(std::vector<ManagerPar*>::iterator it=shards.begin(); it!=shards.end(); ++it)
+		(*it)->setChunkParameters(parameters);
+}
+
+void Fastcgipp::ShardedManagerPar::signalHandler(int signum)
+{
+	switch(signum)
+	{
+		case SIGUSR1:
+		{
+			if(instance) instance->terminate();
+			break;
+		}
+		case SIGTERM:
+		{
+			if(instance) instance->stop();
+			break;
+		}
+	}
+}
+
+void Fastcgipp::ShardedManagerPar::setupSignals()
+{
+	struct sigaction sigAction;
+	sigAction.sa_handler=Fastcgipp::ShardedManagerPar::signalHandler;
+	sigemptyset(&sigAction.sa_mask);
+	sigAction.sa_flags=0;
+
+	sigaction(SIGPIPE, &sigAction, NULL);
+	sigaction(SIGUSR1, &sigAction, NULL);
+	sigaction(SIGTERM, &sigAction, NULL);
+}
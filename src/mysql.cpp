@@ -20,22 +20,24 @@
 
 
 #include <asql/mysql.hpp>
-#include <utf8_codecvt.hpp>
+#include <fastcgi++/utf8.hpp>
 #include <cstdlib>
+#include <cstdio>
 
 void ASql::MySQL::Connection::connect(const char* host, const char* user, const char* passwd, const char* db, unsigned int port, const char* unix_socket, unsigned long client_flag, const char* const charset)
 {
 	if(m_initialized)
 	{
-		for(unsigned int i=0; i<threads(); ++i)
+		for(int i=0; i<threads(); ++i)
 		{
 			mysql_stmt_close(foundRowsStatement[i]);
 			mysql_close(&m_connection[i]);
 		}
+		mysql_close(&interruptConnection);
 		m_initialized = false;
 	}
 
-	for(unsigned int i=0; i<threads(); ++i)
+	for(int i=0; i<threads(); ++i)
 	{
 		if(!mysql_init(&m_connection[i]))
 			throw Error(&m_connection[i]);
@@ -58,8 +60,20 @@ void ASql::MySQL::Connection::connect(const char* host, const char* user, const
 		std::memset(&foundRowsBinding[i], 0, sizeof(MYSQL_BIND));
 		foundRowsBinding[i].buffer_type = MYSQL_TYPE_LONGLONG;
 		foundRowsBinding[i].is_unsigned = 1;
+
+		threadIds[i] = mysql_thread_id(&m_connection[i]);
 	}
 
+	if(!mysql_init(&interruptConnection))
+		throw Error(&interruptConnection);
+
+	// Lets mysql_ping() bring the connection back should the server have dropped it
+	my_bool reconnect=1;
+	mysql_options(&interruptConnection, MYSQL_OPT_RECONNECT, &reconnect);
+
+	if(!mysql_real_connect(&interruptConnection, host, user, passwd, db, port, unix_socket, client_flag))
+		throw Error(&interruptConnection);
+
 	m_initialized = true;
 }
 
@@ -67,14 +81,25 @@ ASql::MySQL::Connection::~Connection()
 {
 	if(m_initialized)
 	{
-		for(unsigned int i=0; i<threads(); ++i)
+		for(int i=0; i<threads(); ++i)
 		{
 			mysql_stmt_close(foundRowsStatement[i]);
 			mysql_close(&m_connection[i]);
 		}
+		mysql_close(&interruptConnection);
 	}
 }
 
+void ASql::MySQL::Connection::interrupt(const unsigned int thread)
+{
+	char query[32];
+	const int size=std::snprintf(query, sizeof(query), "KILL QUERY %lu", threadIds[thread]);
+
+	// Should either fail the query simply runs to completion
+	if(!mysql_ping(&interruptConnection))
+		mysql_real_query(&interruptConnection, query, size);
+}
+
 void ASql::MySQL::Connection::getFoundRows(unsigned long long* const& rows, const unsigned int thread)
 {
 	if(mysql_stmt_bind_param(foundRowsStatement[thread], 0))
@@ -98,7 +123,7 @@ void ASql::MySQL::Statement::init(const char* const& queryString, const size_t&
 {
 	if(m_initialized)
 	{
-		for(unsigned int i=0; i<connection.threads(); ++i)
+		for(int i=0; i<connection.threads(); ++i)
 			mysql_stmt_close(stmt[i]);
 		m_initialized = false;
 	}
@@ -144,7 +169,7 @@ void ASql::MySQL::Statement::init(const char* const& queryString, const size_t&
 		if(inPlaceholder) paramOrder.push_back(std::atoi(intBuffer));
 	}
 	
-	for(unsigned int i=0; i<connection.threads(); ++i)
+	for(int i=0; i<connection.threads(); ++i)
 	{
 		m_stop[i]=&ConnectionPar<Statement>::s_false;
 		stmt[i]=mysql_stmt_init(&connection.connection(i));
@@ -534,12 +559,10 @@ void ASql::MySQL::TypedConversion<ASql::Data::Wtext>::convertResult()
 
 	if(conversionBuffer.size())
 	{
-		wchar_t* it;
-		const char* tmp;
-		mbstate_t conversionState = mbstate_t();
-		if(std::use_facet<std::codecvt<wchar_t, char, mbstate_t> >(std::locale(std::locale::classic(), new utf8CodeCvt::utf8_codecvt_facet)).in(conversionState, (const char*)&conversionBuffer.front(), (const char*)&conversionBuffer.front() + conversionBuffer.size(), tmp, &output[0], &output[0] + output.size(), it)!=std::codecvt_base::ok)
+		const size_t size=Fastcgipp::Utf8::decode(&conversionBuffer.front(), conversionBuffer.size(), &output[0]);
+		if(size==Fastcgipp::Utf8::invalid)
 			throw ASql::Error(CodeConversionErrorMsg, -1);
-		output.resize(it-&output[0]);
+		output.resize(size);
 		conversionBuffer.clear();
 	}
 }
@@ -550,15 +573,13 @@ void ASql::MySQL::TypedConversion<ASql::Data::Wtext>::convertParam()
 
 	wstring& data = *(wstring*)external;
 
-	inputBuffer.resize(data.size()*sizeof(wchar_t));
+	inputBuffer.resize(Fastcgipp::Utf8::maxEncodedSize(data.size()));
 
 	if(inputBuffer.size())
 	{
-		const wchar_t* tmp;
-		char* it;
-		mbstate_t conversionState = mbstate_t();
-		if(use_facet<codecvt<wchar_t, char, mbstate_t> >(locale(locale::classic(), new utf8CodeCvt::utf8_codecvt_facet)).out(conversionState, (const wchar_t*)&data[0], (const wchar_t*)&data[0] + data.size(), tmp, &inputBuffer.front(), &inputBuffer.front() + inputBuffer.size(), it)!=codecvt_base::ok) throw ASql::Error(CodeConversionErrorMsg, -1);
-		inputBuffer.resize(it-&inputBuffer[0]);
+		const size_t size=Fastcgipp::Utf8::encode(data.data(), data.size(), &inputBuffer.front());
+		if(size==Fastcgipp::Utf8::invalid) throw ASql::Error(CodeConversionErrorMsg, -1);
+		inputBuffer.resize(size);
 	}
 
 	buffer=&inputBuffer.front();
@@ -584,7 +605,7 @@ ASql::MySQL::Statement::~Statement()
 {
 	if(m_initialized)
 	{
-		for(unsigned int i=0; i<connection.threads(); ++i)
+		for(int i=0; i<connection.threads(); ++i)
 			mysql_stmt_close(stmt[i]);
 	}
 }
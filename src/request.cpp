@@ -18,8 +18,16 @@
 * along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
 ****************************************************************************/
 
+#include <cstring>
+
 #include <fastcgi++/request.hpp>
 
+namespace
+{
+	//! Response sent to requests that are shed
+	const char shedResponse[]="Status: 503 Service Unavailable\r\nContent-Type: text/plain\r\nRetry-After: 1\r\n\r\n503 Service Unavailable\n";
+}
+
 template void Fastcgipp::Request<char>::complete();
 template void Fastcgipp::Request<wchar_t>::complete();
 template<class charT> void Fastcgipp::Request<charT>::complete()
@@ -41,7 +49,84 @@ template<class charT> void Fastcgipp::Request<charT>::complete()
 	body.setAppStatus(0);
 	body.setProtocolStatus(REQUEST_COMPLETE);
 
+	if(m_table)
+		m_table->release(this);
 	transceiver->secureWrite(sizeof(Header)+sizeof(EndRequest), id, killCon);
+	transceiver->flush(id.fd);
+	state=END_REQUEST;
+}
+
+template void Fastcgipp::Request<char>::shed();
+template void Fastcgipp::Request<wchar_t>::shed();
+template<class charT> void Fastcgipp::Request<charT>::shed()
+{
+	using namespace Protocol;
+
+	const size_t contentLength=sizeof(shedResponse)-1;
+	const size_t paddingLength=(chunkSize-contentLength%chunkSize)%chunkSize;
+
+	Block buffer(transceiver->requestWrite(sizeof(Header)+contentLength+paddingLength));
+
+	Header& header=*(Header*)buffer.data;
+	header.setVersion(Protocol::version);
+	header.setType(OUT);
+	header.setRequestId(id.fcgiId);
+	header.setContentLength(contentLength);
+	header.setPaddingLength(paddingLength);
+
+	memcpy(buffer.data+sizeof(Header), shedResponse, contentLength);
+	memset(buffer.data+sizeof(Header)+contentLength, 0, paddingLength);
+
+	transceiver->secureWrite(sizeof(Header)+contentLength+paddingLength, id, false);
+	complete();
+}
+
+template bool Fastcgipp::Request<char>::recycle();
+template bool Fastcgipp::Request<wchar_t>::recycle();
+template<class charT> bool Fastcgipp::Request<charT>::recycle()
+{
+	// Output of an aborted request may still be sitting in the stream buffers
+	if(state!=Protocol::END_REQUEST)
+		return false;
+
+	m_environment.clear();
+	out.reset();
+	err.reset();
+	m_message=Message();
+	while(!messages.empty())
+		messages.pop();
+	state=Protocol::PARAMS;
+	pendingTasks=0;
+	timers->cancel(wakeTimer);
+	timers->cancel(deadlineTimer);
+	{
+		boost::lock_guard<boost::mutex> lock(cancellers);
+		cancellers.clear();
+	}
+
+	try
+	{
+		reset();
+	}
+	catch(...)
+	{
+		return false;
+	}
+	return true;
+}
+
+template void Fastcgipp::Request<char>::cancel();
+template void Fastcgipp::Request<wchar_t>::cancel();
+template<class charT> void Fastcgipp::Request<charT>::cancel()
+{
+	std::vector<boost::function<void()> > cancelling;
+	{
+		boost::lock_guard<boost::mutex> lock(cancellers);
+		cancelling.swap(cancellers);
+	}
+
+	for(std::vector<boost::function<void()> >::iterator it=cancelling.begin(); it!=cancelling.end(); ++it)
+		(*it)();
 }
 
 template bool Fastcgipp::Request<char>::handler();
@@ -68,6 +153,8 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 			body.setAppStatus(0);
 			body.setProtocolStatus(UNKNOWN_ROLE);
 
+			if(m_table)
+				m_table->release(this);
 			transceiver->secureWrite(sizeof(Header)+sizeof(EndRequest), id, killCon);
 			return true;
 		}
@@ -76,7 +163,7 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 			boost::lock_guard<boost::mutex> lock(messages);
 			if (messages.size() > 0)
 			{
-				m_message=messages.front();
+				m_message.swap(messages.front());
 				messages.pop();
 			}
 			else
@@ -85,6 +172,14 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 			}
 		}
 
+		if(message().type==deadlineMessage)
+		{
+			cancel();
+			timeoutHandler();
+			complete();
+			return true;
+		}
+
 		if(message().type==0)
 		{
 			const Header& header=*(Header*)message().data.get();
@@ -102,6 +197,21 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 							complete();
 							return true;
 						}
+						if(deadlineVariable)
+						{
+							// The deadline may only be shortened by the other side
+							long long deadline=0;
+							if(m_environment.lazy())
+								deadline=m_environment.parameterInt(deadlineVariable->c_str());
+							else
+							{
+								typename Http::Environment<charT>::RequestEnvVariables::const_iterator it=m_environment.requestEnvVariables.find(std::basic_string<charT>(deadlineVariable->begin(), deadlineVariable->end()));
+								if(it!=m_environment.requestEnvVariables.end())
+									deadline=std::atoll(std::string(it->second.begin(), it->second.end()).c_str());
+							}
+							if(deadline>0 && (!maxDeadline || deadline<maxDeadline))
+								setDeadline(boost::posix_time::milliseconds(deadline));
+						}
 						state=IN;
 						break;
 					}
@@ -157,9 +267,16 @@ template<class charT> bool Fastcgipp::Request<charT>::handler()
 
 				case ABORT_REQUEST:
 				{
+					cancel();
 					return true;
 				}
+
+				default:
+					break;
 			}
+
+			// Record data may share a receive buffer with other records so let it go
+			m_message.data.reset();
 		}
 		else if(response())
 		{
@@ -227,3 +344,45 @@ template<class charT> void Fastcgipp::Request<charT>::bigPostErrorHandler()
 	"</body>"\
 "</html>";
 }
+
+template void Fastcgipp::Request<char>::timeoutHandler();
+template void Fastcgipp::Request<wchar_t>::timeoutHandler();
+template<class charT> void Fastcgipp::Request<charT>::timeoutHandler()
+{
+		// Once anything has gone out it's too late for a status line of our own
+		if(out.written())
+			return;
+
+		out << \
+"Status: 504 Gateway Timeout\n"\
+"Content-Type: text/html; charset=ISO-8859-1\r\n\r\n"\
+"<!DOCTYPE html>"\
+"<html lang='en'>"\
+	"<head>"\
+		"<title>504 Gateway Timeout</title>"\
+	"</head>"\
+	"<body>"\
+		"<h1>504 Gateway Timeout</h1>"\
+	"</body>"\
+"</html>";
+}
+
+template void Fastcgipp::Request<char>::wakeAfter(const boost::posix_time::time_duration& delay, const Message& message);
+template void Fastcgipp::Request<wchar_t>::wakeAfter(const boost::posix_time::time_duration& delay, const Message& message);
+template<class charT> void Fastcgipp::Request<charT>::wakeAfter(const boost::posix_time::time_duration& delay, const Message& message)
+{
+	if(delay.is_special())
+		timers->cancel(wakeTimer);
+	else if(timers->schedule(wakeTimer, delay.total_milliseconds(), Task(id, generation), message))
+		transceiver->wake();
+}
+
+template void Fastcgipp::Request<char>::setDeadline(const boost::posix_time::time_duration& timeout);
+template void Fastcgipp::Request<wchar_t>::setDeadline(const boost::posix_time::time_duration& timeout);
+template<class charT> void Fastcgipp::Request<charT>::setDeadline(const boost::posix_time::time_duration& timeout)
+{
+	if(timeout.is_special())
+		timers->cancel(deadlineTimer);
+	else if(timers->schedule(deadlineTimer, timeout.total_milliseconds(), Task(id, generation), Message(deadlineMessage)))
+		transceiver->wake();
+}
@@ -0,0 +1,105 @@
+//! \file taskqueue.cpp Defines member functions for Fastcgipp::TaskQueue
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/taskqueue.hpp>
+
+namespace
+{
+	size_t roundCapacity(size_t capacity)
+	{
+		size_t size=2;
+		while(size<capacity)
+			size<<=1;
+		return size;
+	}
+}
+
+Fastcgipp::TaskQueue::TaskQueue(size_t capacity): cells(new Cell[roundCapacity(capacity)]), mask(roundCapacity(capacity)-1), pushPosition(0), popPosition(0), overflowSize(0)
+{
+	for(size_t i=0; i<=mask; ++i)
+		cells[i].sequence.store(i, boost::memory_order_relaxed);
+}
+
+Fastcgipp::TaskQueue::~TaskQueue()
+{
+	delete [] cells;
+}
+
+void Fastcgipp::TaskQueue::push(const Task& task)
+{
+	const long long queued=LoadShedder::now();
+
+	size_t position=pushPosition.load(boost::memory_order_relaxed);
+	while(1)
+	{{
+		Cell& cell=cells[position&mask];
+		const ptrdiff_t difference=(ptrdiff_t)cell.sequence.load(boost::memory_order_acquire)-(ptrdiff_t)position;
+		if(difference==0)
+		{
+			if(pushPosition.compare_exchange_weak(position, position+1, boost::memory_order_relaxed))
+			{
+				cell.task=task;
+				cell.task.queued=queued;
+				cell.sequence.store(position+1, boost::memory_order_release);
+				return;
+			}
+		}
+		else if(difference<0)
+			break;
+		else
+			position=pushPosition.load(boost::memory_order_relaxed);
+	}}
+
+	// The ring is full
+	boost::lock_guard<boost::mutex> overflowLock(overflowMutex);
+	overflow.push_back(task);
+	overflow.back().queued=queued;
+	overflowSize.fetch_add(1, boost::memory_order_release);
+}
+
+bool Fastcgipp::TaskQueue::pop(Task& task)
+{
+	Cell& cell=cells[popPosition&mask];
+	if(cell.sequence.load(boost::memory_order_acquire)==popPosition+1)
+	{
+		task=cell.task;
+		cell.sequence.store(popPosition+mask+1, boost::memory_order_release);
+		++popPosition;
+		return true;
+	}
+
+	if(!overflowSize.load(boost::memory_order_acquire))
+		return false;
+
+	boost::lock_guard<boost::mutex> overflowLock(overflowMutex);
+	task=overflow.front();
+	overflow.pop_front();
+	overflowSize.fetch_sub(1, boost::memory_order_relaxed);
+	return true;
+}
+
+bool Fastcgipp::TaskQueue::empty() const
+{
+	return cells[popPosition&mask].sequence.load(boost::memory_order_acquire)!=popPosition+1
+		&& !overflowSize.load(boost::memory_order_acquire);
+}
@@ -0,0 +1,207 @@
+//! \file timerwheel.cpp Defines member functions for Fastcgipp::TimerWheel
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <climits>
+#include <time.h>
+
+#include <boost/thread/locks.hpp>
+
+#include <fastcgi++/timerwheel.hpp>
+
+Fastcgipp::TimerWheel::TimerWheel(): current(now()), deadline(LLONG_MAX), m_size(0)
+{
+	for(unsigned int i=0; i<levels; ++i)
+	{{
+		for(unsigned int j=0; j<slots; ++j)
+			wheel[i][j]=0;
+		occupied[i]=0;
+	}}
+}
+
+long long Fastcgipp::TimerWheel::now()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (long long)time.tv_sec*1000+time.tv_nsec/1000000;
+}
+
+bool Fastcgipp::TimerWheel::schedule(Timer& timer, long long delay, const Task& task, const Message& message)
+{
+	boost::lock_guard<boost::mutex> wheelLock(mutex);
+
+	if(timer.scheduled)
+		unlink(timer);
+	else
+		m_size.fetch_add(1, boost::memory_order_relaxed);
+
+	const long long expiry=now()+delay;
+	// The slot of the current tick has already been collected
+	timer.expiry=expiry>current?expiry:current+1;
+	timer.task=task;
+	timer.message=message;
+	timer.scheduled=true;
+	link(timer);
+
+	return timer.expiry<deadline;
+}
+
+void Fastcgipp::TimerWheel::cancel(Timer& timer)
+{
+	boost::lock_guard<boost::mutex> wheelLock(mutex);
+
+	if(!timer.scheduled)
+		return;
+
+	unlink(timer);
+	timer.scheduled=false;
+	timer.message=Message();
+	m_size.fetch_sub(1, boost::memory_order_relaxed);
+}
+
+void Fastcgipp::TimerWheel::link(Timer& timer)
+{
+	// The highest group of slot bits the expiry differs from the current tick in picks the level
+	const unsigned long long difference=timer.expiry^current;
+	unsigned int level=0;
+	while(level<levels-1 && difference>>(slotBits*(level+1)))
+		++level;
+
+	// Expiries beyond the span of the wheel are parked in the first top level slot, which
+	// is next visited once the round after the current one begins
+	const unsigned int slot=difference>>(slotBits*levels)?0:(timer.expiry>>(slotBits*level))&(slots-1);
+
+	timer.level=level;
+	timer.slot=slot;
+	timer.prev=0;
+	timer.next=wheel[level][slot];
+	if(timer.next)
+		timer.next->prev=&timer;
+	wheel[level][slot]=&timer;
+	occupied[level]|=1ULL<<slot;
+}
+
+void Fastcgipp::TimerWheel::unlink(Timer& timer)
+{
+	if(timer.prev)
+		timer.prev->next=timer.next;
+	else
+	{
+		wheel[timer.level][timer.slot]=timer.next;
+		if(!timer.next)
+			occupied[timer.level]&=~(1ULL<<timer.slot);
+	}
+	if(timer.next)
+		timer.next->prev=timer.prev;
+	timer.next=0;
+	timer.prev=0;
+}
+
+bool Fastcgipp::TimerWheel::next(long long& tick) const
+{
+	if(!m_size.load(boost::memory_order_relaxed))
+		return false;
+
+	// Slots at or behind the current one at a level have already been visited this round so
+	// the first level with an occupied slot ahead has the earliest one
+	for(unsigned int level=0; level<levels; ++level)
+	{{
+		const unsigned int shift=slotBits*level;
+		const unsigned int position=(current>>shift)&(slots-1);
+		const unsigned long long ahead=occupied[level]&~((2ULL<<position)-1);
+		if(ahead)
+		{
+			tick=(current>>(shift+slotBits)<<(shift+slotBits)) | (long long)__builtin_ctzll(ahead)<<shift;
+			return true;
+		}
+	}}
+
+	// What is left was parked beyond the span of the wheel
+	tick=((current>>(slotBits*levels))+1)<<(slotBits*levels);
+	return true;
+}
+
+int Fastcgipp::TimerWheel::timeout()
+{
+	boost::lock_guard<boost::mutex> wheelLock(mutex);
+
+	long long tick;
+	if(!next(tick))
+	{
+		deadline=LLONG_MAX;
+		return -1;
+	}
+	deadline=tick;
+
+	const long long time=now();
+	if(tick<=time)
+		return 0;
+	return tick-time<INT_MAX?tick-time:INT_MAX;
+}
+
+void Fastcgipp::TimerWheel::collect(Expired& expired)
+{
+	boost::lock_guard<boost::mutex> wheelLock(mutex);
+
+	const long long time=now();
+	long long tick;
+	while(next(tick) && tick<=time)
+	{{
+		current=tick;
+
+		// Move timers down from every level whose slot starts at this tick, highest first
+		for(unsigned int level=levels-1; level>0; --level)
+		{{
+			const unsigned int shift=slotBits*level;
+			if(tick&((1LL<<shift)-1))
+				continue;
+
+			const unsigned int slot=(tick>>shift)&(slots-1);
+			Timer* timer=wheel[level][slot];
+			wheel[level][slot]=0;
+			occupied[level]&=~(1ULL<<slot);
+			while(timer)
+			{{
+				Timer* const nextTimer=timer->next;
+				link(*timer);
+				timer=nextTimer;
+			}}
+		}}
+
+		const unsigned int slot=tick&(slots-1);
+		Timer* timer=wheel[0][slot];
+		wheel[0][slot]=0;
+		occupied[0]&=~(1ULL<<slot);
+		while(timer)
+		{{
+			Timer* const nextTimer=timer->next;
+			timer->next=0;
+			timer->prev=0;
+			timer->scheduled=false;
+			expired.push_back(std::make_pair(timer->task, Message()));
+			std::swap(expired.back().second, timer->message);
+			m_size.fetch_sub(1, boost::memory_order_relaxed);
+			timer=nextTimer;
+		}}
+	}}
+
+	if(time>current)
+		current=time;
+}
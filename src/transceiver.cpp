@@ -22,175 +22,1100 @@
 #include <fastcgi++/transceiver.hpp>
 #include <boost/utility/in_place_factory.hpp>
 
+#include <new>
+#include <cstring>
+#include <time.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#endif
+
 int Fastcgipp::Transceiver::transmit()
 {
+	int fd;
+	while((fd=buffer.nextFd())!=-1)
+		transmit(fd);
+
+	return buffer.empty();
+}
+
+void Fastcgipp::Transceiver::transmit(int fd)
+{
+#ifdef HAVE_IO_URING
+	if(m_backend==IO_URING)
+	{
+		ringTransmit(fd);
+		return;
+	}
+#endif
+
+	iovec vectors[maxIovecs];
+
 	while(1)
 	{{
-		Buffer::SendBlock sendBlock(buffer.requestRead());
-		if(sendBlock.size)
+		const int count=buffer.requestRead(fd, vectors, maxIovecs);
+		if(!count)
+			break;
+
+		size_t size=0;
+		for(int i=0; i<count; ++i)
+			size+=vectors[i].iov_len;
+
+		ssize_t sent = count==1?write(fd, vectors[0].iov_base, size):writev(fd, vectors, count);
+		if(sent<0)
 		{
-			ssize_t sent = write(sendBlock.fd, sendBlock.data, sendBlock.size);
-			if(sent<0)
+			if(errno==EINTR)
+				continue;
+			if(errno==EAGAIN || errno==EWOULDBLOCK)
 			{
-				if(errno!=EAGAIN)
-				{
-					freeFd(sendBlock.fd);
-					sent=sendBlock.size;
-
-					Exceptions::SocketWrite e(sendBlock.fd, errno);
-					m_lastSocketException = boost::in_place(e);
-				}
+				buffer.block(fd);
+				setWriteInterest(fd, true);
+				break;
 			}
 
-			buffer.freeRead(sent);
-			if(sent!=(ssize_t)sendBlock.size)
-				break;
+			Exceptions::SocketWrite e(fd, errno);
+			m_lastSocketException = boost::in_place(e);
+			freeFd(fd);
+			break;
 		}
-		else
+
+		if(buffer.freeRead(fd, sent))
 			break;
+
+		// A short write means the socket buffer is full
+		if(sent!=(ssize_t)size)
+		{
+			buffer.block(fd);
+			setWriteInterest(fd, true);
+			break;
+		}
 	}}
+}
 
-	return buffer.empty();
+Fastcgipp::Transceiver::Buffer::Frame Fastcgipp::Transceiver::Buffer::makeFrame(size_t size, Protocol::FullId id, bool kill)
+{
+	Chunk& chunk=currentChunk();
+	const Frame frame(chunk.end, size, kill, id, chunk.data);
+
+	chunk.end+=size;
+	if(minBlockSize>(chunk.data.get()+chunk.size-chunk.end))
+		chunk.reset(chunkPool);
+
+	return frame;
+}
+
+size_t Fastcgipp::Transceiver::Buffer::enqueue(const Frame& frame, bool schedule)
+{
+	Queue& queue=queues[frame.id.fd];
+	queue.bytes+=frame.size;
+	if(frame.closeFd)
+		queue.closing.push_back(frame);
+	else
+	{
+		Stream& stream=queue.streams[frame.id.fcgiId];
+		if(stream.empty())
+			queue.turns.push_back(frame.id.fcgiId);
+
+		if(!stream.empty()
+				&& stream.back().chunk==frame.chunk
+				&& stream.back().data+stream.back().size==frame.data)
+			// Contiguous with the last frame for this request so we just grow it
+			stream.back().size+=frame.size;
+		else
+			stream.push_back(frame);
+	}
+
+	if(schedule && !queue.blocked && !queue.pending)
+	{
+		queue.pending=true;
+		pendingFds.push_back(frame.id.fd);
+	}
+
+	return queue.bytes;
+}
+
+bool Fastcgipp::Transceiver::Buffer::submit(size_t size, Protocol::FullId id, bool kill)
+{
+	Submission* submission=new Submission(makeFrame(size, id, kill));
+	Submission* head=submissions.load(boost::memory_order_relaxed);
+	do submission->next=head;
+	while(!submissions.compare_exchange_weak(head, submission, boost::memory_order_release, boost::memory_order_relaxed));
+	return !head;
+}
+
+void Fastcgipp::Transceiver::Buffer::collectSubmissions()
+{
+	Submission* submission=submissions.exchange(0, boost::memory_order_acquire);
+
+	// The stack gives us the most recent submission first
+	Submission* ordered=0;
+	while(submission)
+	{{
+		Submission* next=submission->next;
+		submission->next=ordered;
+		ordered=submission;
+		submission=next;
+	}}
+
+	while(ordered)
+	{{
+		enqueue(ordered->frame);
+		Submission* next=ordered->next;
+		delete ordered;
+		ordered=next;
+	}}
+}
+
+Fastcgipp::Transceiver::Buffer::~Buffer()
+{
+	Submission* submission=submissions.exchange(0, boost::memory_order_acquire);
+	while(submission)
+	{{
+		Submission* next=submission->next;
+		delete submission;
+		submission=next;
+	}}
+	localChunks.reset();
+}
+
+long long Fastcgipp::Transceiver::Buffer::ChunkPool::now()
+{
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (long long)time.tv_sec*1000+time.tv_nsec/1000000;
+}
+
+void Fastcgipp::Transceiver::Buffer::ChunkPool::free(const FreeChunk& chunk)
+{
+	if(chunk.mapped)
+		munmap(chunk.data, chunk.size);
+	else
+		delete [] chunk.data;
+}
+
+Fastcgipp::Transceiver::Buffer::ChunkPool::State::~State()
+{
+	for(std::vector<FreeChunk>::iterator it=freeChunks.begin(); it!=freeChunks.end(); ++it)
+		free(*it);
+}
+
+boost::shared_array<char> Fastcgipp::Transceiver::Buffer::ChunkPool::allocate(size_t& size)
+{
+	bool hugePages;
+	{
+		boost::lock_guard<boost::mutex> lock(*state);
+		size=state->parameters.chunkSize;
+		hugePages=state->parameters.hugePages;
+		if(!state->freeChunks.empty())
+		{
+			const FreeChunk chunk=state->freeChunks.back();
+			state->freeChunks.pop_back();
+			state->lowWater=std::min(state->lowWater, state->freeChunks.size());
+			return boost::shared_array<char>(chunk.data, Deleter(state, chunk.size, chunk.mapped));
+		}
+	}
+
+	if(!hugePages)
+		return boost::shared_array<char>(new char[size], Deleter(state, size, false));
+
+	void* data=MAP_FAILED;
+#ifdef MAP_HUGETLB
+	const size_t hugePageSize=2097152;
+	if(size%hugePageSize == 0)
+		data=mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+	if(data==MAP_FAILED)
+	{
+		data=mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(data==MAP_FAILED)
+			throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+		madvise(data, size, MADV_HUGEPAGE);
+#endif
+	}
+	return boost::shared_array<char>((char*)data, Deleter(state, size, true));
+}
+
+void Fastcgipp::Transceiver::Buffer::ChunkPool::Deleter::operator()(char* data) const
+{
+	{
+		boost::lock_guard<boost::mutex> lock(*state);
+		// Chunks made under different parameters are not worth keeping
+		if(size==state->parameters.chunkSize
+				&& mapped==state->parameters.hugePages
+				&& state->freeChunks.size()<state->parameters.maxFreeChunks)
+		{
+			state->freeChunks.push_back(FreeChunk(data, size, mapped));
+			return;
+		}
+	}
+	free(FreeChunk(data, size, mapped));
 }
 
-void Fastcgipp::Transceiver::Buffer::secureWrite(size_t size, Protocol::FullId id, bool kill)
+int Fastcgipp::Transceiver::Buffer::ChunkPool::release()
 {
-	writeIt->end+=size;
-	if(minBlockSize>(writeIt->data.get()+Chunk::size-writeIt->end) && ++writeIt==chunks.end())
+	std::vector<FreeChunk> surplus;
+	int remaining=-1;
 	{
-		chunks.push_back(Chunk());
-		--writeIt;
+		boost::lock_guard<boost::mutex> lock(*state);
+		const long long time=now();
+		const size_t minFreeChunks=state->parameters.minFreeChunks;
+		if(state->freeChunks.size()<=minFreeChunks)
+		{
+			state->periodStart=time;
+			state->lowWater=state->freeChunks.size();
+			return -1;
+		}
+
+		const long long left=state->periodStart+state->parameters.idleTimeout-time;
+		if(left>0)
+			return (int)left;
+
+		// Whatever stayed below the low water mark wasn't needed for the whole period. Chunks
+		// are reused from the back so the front holds the ones that sat the longest.
+		const size_t count=std::min(state->lowWater, state->freeChunks.size()-minFreeChunks);
+		surplus.assign(state->freeChunks.begin(), state->freeChunks.begin()+count);
+		state->freeChunks.erase(state->freeChunks.begin(), state->freeChunks.begin()+count);
+		state->periodStart=time;
+		state->lowWater=state->freeChunks.size();
+		if(state->freeChunks.size()>minFreeChunks)
+			remaining=state->parameters.idleTimeout;
+	}
+
+	for(std::vector<FreeChunk>::iterator it=surplus.begin(); it!=surplus.end(); ++it)
+		free(*it);
+	return remaining;
+}
+
+void Fastcgipp::Transceiver::Buffer::ChunkPool::setParameters(const ChunkParameters& parameters)
+{
+	std::vector<FreeChunk> stale;
+	{
+		boost::lock_guard<boost::mutex> lock(*state);
+		state->parameters=parameters;
+		if(state->parameters.chunkSize<4096)
+			state->parameters.chunkSize=4096;
+		stale.swap(state->freeChunks);
+		state->lowWater=0;
+	}
+
+	for(std::vector<FreeChunk>::iterator it=stale.begin(); it!=stale.end(); ++it)
+		free(*it);
+}
+
+Fastcgipp::ChunkParameters Fastcgipp::Transceiver::Buffer::ChunkPool::parameters() const
+{
+	boost::lock_guard<boost::mutex> lock(*state);
+	return state->parameters;
+}
+
+void Fastcgipp::Transceiver::Buffer::interleave(Queue& queue, size_t frames)
+{
+	while(queue.size()<frames && !queue.turns.empty())
+	{{
+		const Protocol::RequestId id=queue.turns.front();
+		queue.turns.pop_front();
+		std::map<Protocol::RequestId, Stream>::iterator it=queue.streams.find(id);
+		Stream& stream=it->second;
+
+		stream.deficit+=quantum;
+		while(!stream.empty() && stream.front().size<=stream.deficit && queue.size()<frames)
+		{{
+			stream.deficit-=stream.front().size;
+			queue.push_back(stream.front());
+			stream.pop_front();
+		}}
+
+		if(stream.empty())
+			queue.streams.erase(it);
+		else
+			queue.turns.push_back(id);
+	}}
+
+	if(queue.turns.empty())
+		while(!queue.closing.empty() && queue.size()<frames)
+		{{
+			queue.push_back(queue.closing.front());
+			queue.closing.pop_front();
+		}}
+}
+
+int Fastcgipp::Transceiver::Buffer::requestRead(int fd, iovec* vectors, int maxVectors, std::vector<boost::shared_array<char> >* chunks)
+{
+	std::map<int, Queue>::iterator it=queues.find(fd);
+	if(it==queues.end() || it->second.blocked)
+		return 0;
+	interleave(it->second, maxVectors);
+
+	int count=0;
+	for(Queue::iterator frame=it->second.begin(); frame!=it->second.end() && count<maxVectors; ++frame)
+	{
+		vectors[count].iov_base=const_cast<char*>(frame->data);
+		vectors[count].iov_len=frame->size;
+		if(chunks)
+			chunks->push_back(frame->chunk);
+		++count;
+		if(frame->closeFd)
+			break;
+	}
+	return count;
+}
+
+int Fastcgipp::Transceiver::Buffer::nextFd()
+{
+	while(!pendingFds.empty())
+	{
+		const int fd=pendingFds.front();
+		pendingFds.pop_front();
+
+		std::map<int, Queue>::iterator it=queues.find(fd);
+		if(it==queues.end() || !it->second.pending)
+			continue;
+		it->second.pending=false;
+		if(!it->second.blocked && !it->second.idle())
+			return fd;
+	}
+	return -1;
+}
+
+void Fastcgipp::Transceiver::Buffer::block(int fd)
+{
+	std::map<int, Queue>::iterator it=queues.find(fd);
+	if(it!=queues.end())
+		it->second.blocked=true;
+}
+
+void Fastcgipp::Transceiver::Buffer::unblock(int fd)
+{
+	std::map<int, Queue>::iterator it=queues.find(fd);
+	if(it==queues.end() || !it->second.blocked)
+		return;
+	it->second.blocked=false;
+	if(!it->second.idle() && !it->second.pending)
+	{
+		it->second.pending=true;
+		pendingFds.push_back(fd);
 	}
-	frames.push(Frame(size, kill, id));
 }
 
 bool Fastcgipp::Transceiver::handler()
 {
 	using namespace std;
-	using namespace Protocol;
 
-        bool transmitEmpty = transmit();
+	buffer.collectSubmissions();
+	bool transmitEmpty = transmit();
+	buffer.releaseChunks();
 
-	int retVal=poll(&pollFds.front(), pollFds.size(), 0);
-	if(retVal==0)
+#ifdef HAVE_IO_URING
+	if(m_backend==IO_URING)
 	{
-		if(transmitEmpty) return true;
-		else return false;
+		ring.enter(0);
+		if(!ringHandler())
+			return transmitEmpty;
+		transmit();
+		return false;
 	}
-	if(retVal<0) throw Exceptions::SocketPoll(errno);
+#endif
+
+	if(readyFds.empty())
+		collectEvents(0);
+	if(readyFds.empty())
+		return transmitEmpty;
+
+	// freeFd() may invalidate entries further along so we index instead of iterating
+	for(size_t i=0; i<readyFds.size(); ++i)
+	{{
+		const int fd=readyFds[i].fd;
+		const short revents=readyFds[i].revents;
+		if(fd<0) continue;
+
+		if(fd==socket)
+		{
+			accept();
+			continue;
+		}
+		else if(fd==wakeUpFdIn)
+		{
+			char x[64];
+			ssize_t actual;
+			do actual=read(wakeUpFdIn, x, sizeof(x));
+			while(actual==ssize_t(sizeof(x)));
+			continue;
+		}
 
-	std::vector<pollfd>::iterator pollFd = find_if(pollFds.begin(), pollFds.end(), reventsZero);
+		if(revents & POLLOUT)
+		{
+			buffer.unblock(fd);
+			setWriteInterest(fd, false);
+		}
 
-	if(pollFd->revents & (POLLHUP|POLLERR|POLLNVAL) )
+		if(revents & POLLIN)
+		{
+			// Edge triggered descriptors will not be reported again until they have been drained
+			if(m_backend==EPOLL_EDGE)
+				while(receive(fd)) {}
+			else
+				receive(fd);
+		}
+		else if(revents & (POLLHUP|POLLERR|POLLNVAL))
+			freeFd(fd);
+	}}
+	readyFds.clear();
+
+	transmit();
+	return false;
+}
+
+void Fastcgipp::Transceiver::collectEvents(int timeout)
+{
+	readyFds.clear();
+
+#ifdef HAVE_IO_URING
+	// Completions are left in the ring for handler() to process
+	if(m_backend==IO_URING)
 	{
-		fdBuffers.erase(pollFd->fd);
-		pollFds.erase(pollFd);
-		return false;
+		ring.enter(timeout);
+		return;
 	}
+#endif
 
-	int fd=pollFd->fd;
-	if(fd==socket)
+#ifdef HAVE_SYS_EPOLL_H
+	if(m_backend!=POLL)
 	{
+		int retVal=epoll_wait(epollFd, &epollEvents.front(), epollEvents.size(), timeout);
+		if(retVal<0)
+		{
+			if(errno==EINTR) return;
+			throw Exceptions::SocketPoll(errno);
+		}
+
+		for(int i=0; i<retVal; ++i)
+		{
+			readyFds.push_back(pollfd());
+			readyFds.back().fd=epollEvents[i].data.fd;
+			readyFds.back().events=0;
+			readyFds.back().revents=
+				(epollEvents[i].events&EPOLLIN?POLLIN:0)
+				| (epollEvents[i].events&EPOLLOUT?POLLOUT:0)
+				| (epollEvents[i].events&EPOLLHUP?POLLHUP:0)
+				| (epollEvents[i].events&EPOLLERR?POLLERR:0);
+		}
+
+		// A full event array means there may well be more waiting next time
+		if(retVal==int(epollEvents.size()))
+			epollEvents.resize(epollEvents.size()*2);
+
+		return;
+	}
+#endif
+
+	int retVal=poll(&pollFds.front(), pollFds.size(), timeout);
+	if(retVal<0)
+	{
+		if(errno==EINTR) return;
+		throw Exceptions::SocketPoll(errno);
+	}
+
+	for(std::vector<pollfd>::iterator it=pollFds.begin(); retVal && it!=pollFds.end(); ++it)
+		if(it->revents)
+		{
+			readyFds.push_back(*it);
+			--retVal;
+		}
+}
+
+void Fastcgipp::Transceiver::addFd(int fd)
+{
+#ifdef HAVE_IO_URING
+	if(m_backend==IO_URING)
+	{
+		arm(fd);
+		return;
+	}
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+	if(m_backend!=POLL)
+	{
+		epoll_event event;
+		event.data.u64=0;
+		event.data.fd=fd;
+		event.events=EPOLLIN;
+		// Edge triggered descriptors only report transitions so they can always be watched for writing
+		if(m_backend==EPOLL_EDGE)
+			event.events|=EPOLLOUT|EPOLLET;
+#ifdef EPOLLEXCLUSIVE
+		// A listening socket may be shared with other transceivers so only wake one of them per connection
+		if(fd==socket)
+		{
+			event.events|=EPOLLEXCLUSIVE;
+			if(!epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event))
+				return;
+			event.events&=~EPOLLEXCLUSIVE;
+		}
+#endif
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+		return;
+	}
+#endif
+
+	pollFds.push_back(pollfd());
+	pollFds.back().fd = fd;
+	pollFds.back().events = POLLIN|POLLHUP|POLLERR|POLLNVAL;
+}
+
+void Fastcgipp::Transceiver::setWriteInterest(int fd, bool interest)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if(m_backend==EPOLL_EDGE || m_backend==IO_URING)
+		return;
+	if(m_backend==EPOLL_LEVEL)
+	{
+		epoll_event event;
+		event.data.u64=0;
+		event.data.fd=fd;
+		event.events=interest?EPOLLIN|EPOLLOUT:EPOLLIN;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+		return;
+	}
+#endif
+
+	std::vector<pollfd>::iterator it=std::find_if(pollFds.begin(), pollFds.end(), equalsFd(fd));
+	if(it != pollFds.end())
+	{
+		if(interest)
+			it->events|=POLLOUT;
+		else
+			it->events&=~POLLOUT;
+	}
+}
+
+void Fastcgipp::Transceiver::accept()
+{
+	while(1)
+	{{
 		sockaddr_un addr;
 		socklen_t addrlen=sizeof(sockaddr_un);
-		fd=accept(fd, (sockaddr*)&addr, &addrlen);
-		fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL)|O_NONBLOCK)^O_NONBLOCK);
+		const int fd=::accept(socket, (sockaddr*)&addr, &addrlen);
+		if(fd<0)
+			return;
 
-		pollFds.push_back(pollfd());
-		pollFds.back().fd = fd;
-		pollFds.back().events = POLLIN|POLLHUP|POLLERR|POLLNVAL;
+		// Writes must never block or one slow connection would hold up every other one
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
 
-		Message& messageBuffer=fdBuffers[fd].messageBuffer;
-		messageBuffer.size=0;
-		messageBuffer.type=0;
-	}
-	else if(fd==wakeUpFdIn)
+		addConnection(fd);
+
+		// Only an edge triggered listening socket needs to be drained
+		if(m_backend!=EPOLL_EDGE)
+			return;
+	}}
+}
+
+void Fastcgipp::Transceiver::addConnection(int fd)
+{
+	fdBuffer& connection=fdBuffers[fd];
+	connection.messageBuffer.size=0;
+	connection.messageBuffer.type=0;
+	connection.messageBuffer.data.reset();
+	connection.generation=++generation;
+
+	addFd(fd);
+}
+
+bool Fastcgipp::Transceiver::receive(int fd)
+{
+	char* data;
+	const size_t space=prepareReceive(fd, data);
+	const ssize_t actual=read(fd, data, space);
+	if ((actual<0 && errno != EAGAIN) || actual == 0)
 	{
-		char x;
-		read(wakeUpFdIn, &x, 1);
+		// An unrecoverable socket read error occurred; remove the socket
+		freeFd(fd);
 		return false;
 	}
+	if(actual<0) return false;
+
+	commitReceive(fd, actual);
+	return actual==(ssize_t)space;
+}
+
+void Fastcgipp::Transceiver::receive(int fd, const char* data, size_t size)
+{
+	while(size)
+	{{
+		char* destination;
+		const size_t chunk=std::min(size, prepareReceive(fd, destination));
+		memcpy(destination, data, chunk);
+		commitReceive(fd, chunk);
+		data+=chunk;
+		size-=chunk;
+	}}
+}
+
+size_t Fastcgipp::Transceiver::prepareReceive(int fd, char*& data)
+{
+	using namespace Protocol;
+
+	Message& messageBuffer=fdBuffers[fd].messageBuffer;
+	Header& headerBuffer=fdBuffers[fd].headerBuffer;
+
+	// Are we in the process of recieving the body of a record that was split between reads?
+	if(messageBuffer.data)
+	{
+		data=messageBuffer.data.get()+messageBuffer.size;
+		return headerBuffer.getContentLength()+headerBuffer.getPaddingLength()+sizeof(Header)-messageBuffer.size;
+	}
+
+	// Nothing references the receive buffer anymore so we can start over at the top of it
+	if(receiveBuffer.unique())
+		receiveEnd=receiveBuffer.get();
+	else if(receiveBuffer.get()+receiveBufferSize-receiveEnd < (ssize_t)minReceiveSize)
+	{
+		receiveBuffer=BufferPool::allocate(receiveBufferSize);
+		receiveEnd=receiveBuffer.get();
+	}
+
+	// Any header bytes left over from the last read go in front of the new data
+	memcpy(receiveEnd, &headerBuffer, messageBuffer.size);
+	data=receiveEnd+messageBuffer.size;
+	return receiveBuffer.get()+receiveBufferSize-data;
+}
+
+void Fastcgipp::Transceiver::commitReceive(int fd, size_t size)
+{
+	using namespace Protocol;
 
 	Message& messageBuffer=fdBuffers[fd].messageBuffer;
 	Header& headerBuffer=fdBuffers[fd].headerBuffer;
 
-	ssize_t actual;
-	// Are we in the process of recieving some part of a frame?
-	if(!messageBuffer.data)
+	if(messageBuffer.data)
 	{
-		// Are we recieving a partial header or new?
-		actual=read(fd, (char*)&headerBuffer+messageBuffer.size, sizeof(Header)-messageBuffer.size);
-		if ((actual<0 && errno != EAGAIN) || actual == 0)
+		messageBuffer.size+=size;
+		if(messageBuffer.size==sizeof(Header)+headerBuffer.getContentLength()+headerBuffer.getPaddingLength())
 		{
-			// An unrecoverable socket read error occurred; remove the socket
-			freeFd(fd);
-			return false;
+			sendMessage(FullId(headerBuffer.getRequestId(), fd), messageBuffer);
+			messageBuffer.size=0;
+			messageBuffer.data.reset();
+		}
+		return;
+	}
+
+	const char* const end=receiveEnd+messageBuffer.size+size;
+	char* record=receiveEnd;
+	while(end-record >= (ssize_t)sizeof(Header))
+	{
+		const Header& header=*(const Header*)record;
+		const size_t recordSize=sizeof(Header)+header.getContentLength()+header.getPaddingLength();
+		if(end-record < (ssize_t)recordSize)
+			break;
+
+		Message message;
+		message.size=recordSize;
+		if(recordSize<minAliasedSize)
+		{
+			// Small records get their own buffer so they can't pin the whole receive buffer
+			message.data=BufferPool::allocate(recordSize);
+			memcpy(message.data.get(), record, recordSize);
 		}
-		if(actual>0) messageBuffer.size+=actual;
+		else
+			message.data=boost::shared_array<char>(receiveBuffer, record);
+		sendMessage(FullId(header.getRequestId(), fd), message);
+		record+=recordSize;
+	}
+
+	// Complete records stay put, anything after them is moved out of the way
+	receiveEnd=record;
+	messageBuffer.size=end-record;
+	if(messageBuffer.size >= sizeof(Header))
+	{
+		memcpy(&headerBuffer, record, sizeof(Header));
+		messageBuffer.data=BufferPool::allocate(sizeof(Header)+headerBuffer.getContentLength()+headerBuffer.getPaddingLength());
+		memcpy(messageBuffer.data.get(), record, messageBuffer.size);
+	}
+	else
+		memcpy(&headerBuffer, record, messageBuffer.size);
+}
 
-		if(messageBuffer.size!=sizeof(Header))
+bool Fastcgipp::Transceiver::Buffer::freeRead(int fd, size_t size)
+{
+	std::map<int, Queue>::iterator it=queues.find(fd);
+	if(it==queues.end())
+		return true;
+	Queue& queue=it->second;
+	queue.bytes-=size;
+
+	while(size && !queue.empty())
+	{
+		Frame& frame=queue.front();
+		if(size<frame.size)
 		{
-			if(transmitEmpty) return true;
-			else return false;
+			frame.data+=size;
+			frame.size-=size;
+			break;
 		}
 
-		messageBuffer.data.reset(new char[sizeof(Header)+headerBuffer.getContentLength()+headerBuffer.getPaddingLength()]);
-		memcpy(static_cast<void*>(messageBuffer.data.get()), static_cast<const void*>(&headerBuffer), sizeof(Header));
+		size-=frame.size;
+		if(frame.closeFd)
+		{
+			transceiver.freeFd(fd);
+			return true;
+		}
+		queue.pop_front();
 	}
 
-	const Header& header=*(const Header*)messageBuffer.data.get();
-	size_t needed=header.getContentLength()+header.getPaddingLength()+sizeof(Header)-messageBuffer.size;
-	actual=read(fd, messageBuffer.data.get()+messageBuffer.size, needed);
-	if(actual<0 && errno != EAGAIN)
+	if(queue.idle() && !queue.blocked)
+		queues.erase(it);
+	return false;
+}
+
+#ifdef HAVE_IO_URING
+bool Fastcgipp::Transceiver::Ring::setup()
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags=IORING_SETUP_CQSIZE;
+	params.cq_entries=4096;
+	fd=syscall(__NR_io_uring_setup, 256, &params);
+	if(fd<0)
+		return false;
+
+	const unsigned requiredFeatures=IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG;
+	if((params.features&requiredFeatures) != requiredFeatures)
 	{
-		// An unrecoverable socket read error occurred; remove the socket
-		freeFd(fd);
+		close();
+		return false;
+	}
+
+	// Multishot receive came along with zero copy send so that is what we probe for
+	std::vector<char> probeSpace(sizeof(io_uring_probe)+256*sizeof(io_uring_probe_op), 0);
+	io_uring_probe& probe=*(io_uring_probe*)&probeSpace.front();
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &probe, 256)<0
+			|| probe.last_op<IORING_OP_SEND_ZC
+			|| !(probe.ops[IORING_OP_SEND_ZC].flags&IO_URING_OP_SUPPORTED))
+	{
+		close();
+		return false;
+	}
+
+	sqRingSize=std::max(params.sq_off.array+params.sq_entries*sizeof(unsigned), params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe));
+	sqRing=mmap(0, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(sqRing==MAP_FAILED)
+	{
+		sqRing=0;
+		close();
+		return false;
+	}
+
+	sqesSize=params.sq_entries*sizeof(io_uring_sqe);
+	sqes=(io_uring_sqe*)mmap(0, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(sqes==MAP_FAILED)
+	{
+		sqes=0;
+		close();
+		return false;
+	}
+
+	char* const rings=(char*)sqRing;
+	sqHead=(unsigned*)(rings+params.sq_off.head);
+	sqTail=(unsigned*)(rings+params.sq_off.tail);
+	sqFlags=(unsigned*)(rings+params.sq_off.flags);
+	sqArray=(unsigned*)(rings+params.sq_off.array);
+	sqMask=*(unsigned*)(rings+params.sq_off.ring_mask);
+	sqEntries=*(unsigned*)(rings+params.sq_off.ring_entries);
+	sqLocalTail=*sqTail;
+	cqHead=(unsigned*)(rings+params.cq_off.head);
+	cqTail=(unsigned*)(rings+params.cq_off.tail);
+	cqMask=*(unsigned*)(rings+params.cq_off.ring_mask);
+	cqes=(io_uring_cqe*)(rings+params.cq_off.cqes);
+
+	// Both the buffers and the ring describing them are mapped so that the kernel can only ever fault on them once released
+	buffers=(char*)mmap(0, bufferCount*bufferSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(buffers==MAP_FAILED)
+	{
+		buffers=0;
+		close();
+		return false;
+	}
+	bufferRing=(io_uring_buf_ring*)mmap(0, bufferCount*sizeof(io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(bufferRing==MAP_FAILED)
+	{
+		bufferRing=0;
+		close();
 		return false;
 	}
-	if(actual>0) messageBuffer.size+=actual;
 
-	// Did we recieve a full frame?
-	if(actual==(ssize_t)needed)
+	io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr=(unsigned long)bufferRing;
+	registration.ring_entries=bufferCount;
+	registration.bgid=bufferGroup;
+	if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1)<0)
 	{
-		sendMessage(FullId(headerBuffer.getRequestId(), fd), messageBuffer);
-		messageBuffer.size=0;
-		messageBuffer.data.reset();
+		close();
 		return false;
 	}
-	if(transmitEmpty) return true;
-	else return false;
+
+	for(unsigned int i=0; i<bufferCount; ++i)
+		recycle(i);
+
+	return true;
+}
+
+void Fastcgipp::Transceiver::Ring::close()
+{
+	// The instance goes first so nothing is in flight when the memory goes
+	if(fd>=0)
+		::close(fd);
+	fd=-1;
+	if(sqRing)
+		munmap(sqRing, sqRingSize);
+	sqRing=0;
+	if(sqes)
+		munmap(sqes, sqesSize);
+	sqes=0;
+	if(buffers)
+		munmap(buffers, bufferCount*bufferSize);
+	buffers=0;
+	if(bufferRing)
+		munmap(bufferRing, bufferCount*sizeof(io_uring_buf));
+	bufferRing=0;
 }
 
-void Fastcgipp::Transceiver::Buffer::freeRead(size_t size)
+io_uring_sqe* Fastcgipp::Transceiver::Ring::sqe()
 {
-	pRead+=size;
-	if(pRead>=chunks.begin()->end)
+	if(sqLocalTail-__atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+		enter(0);
+
+	const unsigned index=sqLocalTail&sqMask;
+	io_uring_sqe* entry=sqes+index;
+	memset(entry, 0, sizeof(io_uring_sqe));
+	sqArray[index]=index;
+	++sqLocalTail;
+	return entry;
+}
+
+void Fastcgipp::Transceiver::Ring::enter(int timeout)
+{
+	__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+	const unsigned submit=sqLocalTail-__atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+
+	unsigned flags=0;
+	unsigned wait=0;
+	timespec time;
+	io_uring_getevents_arg argument;
+	void* argumentPointer=0;
+	size_t argumentSize=0;
+
+	if(timeout)
 	{
-		if(writeIt==chunks.begin())
+		flags|=IORING_ENTER_GETEVENTS;
+		wait=1;
+		if(timeout>0)
 		{
-			pRead=writeIt->data.get();
-			writeIt->end=pRead;
+			time.tv_sec=timeout/1000;
+			time.tv_nsec=(timeout%1000)*1000000;
+			memset(&argument, 0, sizeof(argument));
+			argument.ts=(unsigned long)&time;
+			flags|=IORING_ENTER_EXT_ARG;
+			argumentPointer=&argument;
+			argumentSize=sizeof(argument);
 		}
-		else
+	}
+	// Completions that did not fit in the queue are only flushed into it by the kernel when asked for
+	else if(__atomic_load_n(sqFlags, __ATOMIC_RELAXED)&IORING_SQ_CQ_OVERFLOW)
+		flags|=IORING_ENTER_GETEVENTS;
+
+	if(!submit && !flags)
+		return;
+
+	if(syscall(__NR_io_uring_enter, fd, submit, wait, flags, argumentPointer, argumentSize)<0
+			&& errno!=EINTR && errno!=ETIME && errno!=EAGAIN && errno!=EBUSY)
+		throw Exceptions::SocketPoll(errno);
+}
+
+io_uring_cqe* Fastcgipp::Transceiver::Ring::cqe()
+{
+	const unsigned head=*cqHead;
+	if(head==__atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		return 0;
+	return cqes+(head&cqMask);
+}
+
+void Fastcgipp::Transceiver::Ring::seen()
+{
+	__atomic_store_n(cqHead, *cqHead+1, __ATOMIC_RELEASE);
+}
+
+void Fastcgipp::Transceiver::Ring::recycle(unsigned short id)
+{
+	// The ring is indexed by hand as the bufs member is misplaced when the kernel header is compiled as C++
+	io_uring_buf& entry=((io_uring_buf*)bufferRing)[bufferTail&(bufferCount-1)];
+	entry.addr=(unsigned long)(buffers+id*bufferSize);
+	entry.len=bufferSize;
+	entry.bid=id;
+	++bufferTail;
+	__atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
+
+void Fastcgipp::Transceiver::arm(int fd)
+{
+	std::map<int, fdBuffer>::const_iterator it=fdBuffers.find(fd);
+	// A connection that has been freed should not be read from anymore
+	if(fd!=socket && fd!=wakeUpFdIn && it==fdBuffers.end())
+		return;
+
+	io_uring_sqe* sqe=ring.sqe();
+	sqe->fd=fd;
+
+	if(fd==socket)
+	{
+		sqe->opcode=IORING_OP_ACCEPT;
+		sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags=SOCK_NONBLOCK;
+		sqe->user_data=ringData(RING_ACCEPT, 0, fd);
+	}
+	else if(fd==wakeUpFdIn)
+	{
+		sqe->opcode=IORING_OP_POLL_ADD;
+		sqe->len=IORING_POLL_ADD_MULTI;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		// The kernel expects the halves of the event mask swapped on big endian machines
+		sqe->poll32_events=(unsigned)POLLIN<<16;
+#else
+		sqe->poll32_events=POLLIN;
+#endif
+		sqe->user_data=ringData(RING_WAKE, 0, fd);
+	}
+	else
+	{
+		sqe->opcode=IORING_OP_RECV;
+		sqe->ioprio=IORING_RECV_MULTISHOT;
+		sqe->flags=IOSQE_BUFFER_SELECT;
+		sqe->buf_group=Ring::bufferGroup;
+		sqe->user_data=ringData(RING_RECEIVE, it->second.generation, fd);
+	}
+}
+
+void Fastcgipp::Transceiver::ringTransmit(int fd)
+{
+	std::map<int, fdBuffer>::iterator it=fdBuffers.find(fd);
+	if(it==fdBuffers.end())
+		return;
+
+	iovec vectors[maxIovecs];
+	std::vector<boost::shared_array<char> > chunks;
+	const int count=buffer.requestRead(fd, vectors, maxIovecs, &chunks);
+	if(!count)
+		return;
+
+	const unsigned long long data=ringData(RING_SEND, it->second.generation, fd);
+	RingSend& send=ringSends[data];
+	std::copy(vectors, vectors+count, send.vectors);
+	send.chunks.swap(chunks);
+	memset(&send.header, 0, sizeof(send.header));
+	send.header.msg_iov=send.vectors;
+	send.header.msg_iovlen=count;
+
+	io_uring_sqe* sqe=ring.sqe();
+	sqe->opcode=IORING_OP_SENDMSG;
+	sqe->fd=fd;
+	sqe->addr=(unsigned long)&send.header;
+	sqe->len=1;
+	sqe->msg_flags=MSG_NOSIGNAL;
+	sqe->user_data=data;
+
+	// Nothing more goes out on this connection until the send completes
+	buffer.block(fd);
+}
+
+bool Fastcgipp::Transceiver::ringHandler()
+{
+	bool any=false;
+
+	while(io_uring_cqe* cqe=ring.cqe())
+	{{
+		any=true;
+		const unsigned long long data=cqe->user_data;
+		const int result=cqe->res;
+		const unsigned int flags=cqe->flags;
+		ring.seen();
+
+		const int fd=int(data&0xffffffff);
+		std::map<int, fdBuffer>::iterator it=fdBuffers.find(fd);
+		// The descriptor may have been freed, or even reused, since the operation was submitted
+		const bool current=it!=fdBuffers.end() && it->second.generation==((data>>32)&0xffffff);
+
+		switch(data>>56)
 		{
-			if(writeIt==--chunks.end())
+			case RING_ACCEPT:
 			{
-				chunks.begin()->end=chunks.begin()->data.get();
-				chunks.splice(chunks.end(), chunks, chunks.begin());
+				if(result>=0)
+					addConnection(result);
+				if(!(flags&IORING_CQE_F_MORE))
+					arm(socket);
+				break;
+			}
+
+			case RING_WAKE:
+			{
+				char x[64];
+				ssize_t actual;
+				do actual=read(wakeUpFdIn, x, sizeof(x));
+				while(actual==ssize_t(sizeof(x)));
+				if(!(flags&IORING_CQE_F_MORE))
+					arm(wakeUpFdIn);
+				break;
+			}
+
+			case RING_RECEIVE:
+			{
+				if(flags&IORING_CQE_F_BUFFER)
+				{
+					const unsigned short id=flags>>IORING_CQE_BUFFER_SHIFT;
+					if(current && result>0)
+						receive(fd, ring.buffer(id), result);
+					ring.recycle(id);
+				}
+
+				if(!current)
+					break;
+				if(result==0 || (result<0 && result!=-ENOBUFS))
+					freeFd(fd);
+				else if(!(flags&IORING_CQE_F_MORE))
+					arm(fd);
+				break;
+			}
+
+			case RING_SEND:
+			{
+				ringSends.erase(data);
+				if(!current)
+					break;
+
+				if(result<0)
+				{
+					errno=-result;
+					Exceptions::SocketWrite e(fd, errno);
+					m_lastSocketException = boost::in_place(e);
+					freeFd(fd);
+				}
+				else if(!buffer.freeRead(fd, result))
+					buffer.unblock(fd);
+				break;
+			}
+
+			case RING_CANCEL:
+			{
+				cancellingFds.erase(fd);
+				close(fd);
+				break;
 			}
-			else
-				chunks.pop_front();
-			pRead=chunks.begin()->data.get();
 		}
-	}
-	if((frames.front().size-=size)==0)
-	{
-		if(frames.front().closeFd)
-			freeFd(frames.front().id.fd);
-		frames.pop();
-	}
+	}}
 
+	return any;
 }
+#endif
 
 void Fastcgipp::Transceiver::wake()
 {
@@ -198,23 +1123,57 @@ void Fastcgipp::Transceiver::wake()
 	write(wakeUpFdOut, &x, 1);
 }
 
-Fastcgipp::Transceiver::Transceiver(int fd_, boost::function<void(Protocol::FullId, Message)> sendMessage_)
-:buffer(pollFds, fdBuffers), sendMessage(sendMessage_), pollFds(2), socket(fd_)
+Fastcgipp::Transceiver::Transceiver(int fd_, boost::function<void(Protocol::FullId, Message)> sendMessage_, EventBackend backend_)
+:buffer(*this), sendMessage(sendMessage_), m_backend(backend_), epollFd(-1), socket(fd_), receiveBuffer(BufferPool::allocate(receiveBufferSize)), receiveEnd(receiveBuffer.get()), m_deferFlush(false), generation(0)
 {
 	socket=fd_;
 
+	if(m_backend==IO_URING)
+	{
+#ifdef HAVE_IO_URING
+		if(!ring.setup())
+#endif
+			m_backend=EPOLL_LEVEL;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	if(m_backend==EPOLL_LEVEL || m_backend==EPOLL_EDGE)
+	{
+		epollFd=epoll_create1(EPOLL_CLOEXEC);
+		if(epollFd<0)
+			m_backend=POLL;
+		else
+			epollEvents.resize(64);
+	}
+#else
+	if(m_backend!=IO_URING)
+		m_backend=POLL;
+#endif
+
 	// Let's setup a in/out socket for waking up poll()
 	int socPair[2];
 	socketpair(AF_UNIX, SOCK_STREAM, 0, socPair);
 	wakeUpFdIn=socPair[0];
-	fcntl(wakeUpFdIn, F_SETFL, (fcntl(wakeUpFdIn, F_GETFL)|O_NONBLOCK)^O_NONBLOCK);
 	wakeUpFdOut=socPair[1];
 
-	fcntl(socket, F_SETFL, (fcntl(socket, F_GETFL)|O_NONBLOCK)^O_NONBLOCK);
-	pollFds[0].events = POLLIN|POLLHUP;
-	pollFds[0].fd = socket;
-	pollFds[1].events = POLLIN|POLLHUP;
-	pollFds[1].fd = wakeUpFdIn;
+	fcntl(wakeUpFdIn, F_SETFL, fcntl(wakeUpFdIn, F_GETFL)|O_NONBLOCK);
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL)|O_NONBLOCK);
+
+	addFd(socket);
+	addFd(wakeUpFdIn);
+}
+
+Fastcgipp::Transceiver::~Transceiver()
+{
+#ifdef HAVE_IO_URING
+	// Cancellations that never completed still own their descriptors
+	for(std::set<int>::const_iterator it=cancellingFds.begin(); it!=cancellingFds.end(); ++it)
+		close(*it);
+#endif
+	if(epollFd>=0)
+		close(epollFd);
+	close(wakeUpFdIn);
+	close(wakeUpFdOut);
 }
 
 Fastcgipp::Exceptions::SocketWrite::SocketWrite(int fd_, int erno_): Socket(fd_, erno_)
@@ -331,13 +1290,54 @@ Fastcgipp::Exceptions::SocketPoll::SocketPoll(int erno_): CodedException(0, erno
 	}
 }
 
-void Fastcgipp::Transceiver::freeFd(int fd, std::vector<pollfd>& pollFds, std::map<int, fdBuffer>& fdBuffers)
+void Fastcgipp::Transceiver::freeFd(int fd)
 {
-	std::vector<pollfd>::iterator it=std::find_if(pollFds.begin(), pollFds.end(), equalsFd(fd));
-	if(it != pollFds.end())
+	buffer.clear(fd);
+
+#ifdef HAVE_IO_URING
+	if(m_backend==IO_URING)
 	{
+		std::map<int, fdBuffer>::iterator it=fdBuffers.find(fd);
+		if(it == fdBuffers.end())
+			return;
+
+		// The descriptor is only closed once the cancellation completes so its number
+		// can't be reused while operations on it are still in flight
+		fdBuffers.erase(it);
+		cancellingFds.insert(fd);
+		io_uring_sqe* sqe=ring.sqe();
+		sqe->opcode=IORING_OP_ASYNC_CANCEL;
+		sqe->fd=fd;
+		sqe->cancel_flags=IORING_ASYNC_CANCEL_FD|IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data=ringData(RING_CANCEL, 0, fd);
+		sendMessage(Protocol::FullId(0, fd), Message(closedMessage));
+		return;
+	}
+	else
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+	if(m_backend!=POLL)
+	{
+		std::map<int, fdBuffer>::iterator it=fdBuffers.find(fd);
+		if(it == fdBuffers.end())
+			return;
+		fdBuffers.erase(it);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, 0);
+	}
+	else
+#endif
+	{
+		std::vector<pollfd>::iterator it=std::find_if(pollFds.begin(), pollFds.end(), equalsFd(fd));
+		if(it == pollFds.end())
+			return;
 		pollFds.erase(it);
-		close(fd);
 		fdBuffers.erase(fd);
 	}
+	close(fd);
+
+	// The descriptor number may be reused before the pending events are serviced
+	for(std::vector<pollfd>::iterator it=readyFds.begin(); it!=readyFds.end(); ++it)
+		if(it->fd==fd) it->fd=-1;
+
+	sendMessage(Protocol::FullId(0, fd), Message(closedMessage));
 }
@@ -0,0 +1,198 @@
+//! \file utf8.cpp Defines the Fastcgipp::Utf8 conversion functions
+/***************************************************************************
+* Copyright (C) 2007 Eddie Carle [eddie@erctech.org]                       *
+*                                                                          *
+* This file is part of fastcgi++.                                          *
+*                                                                          *
+* fastcgi++ is free software: you can redistribute it and/or modify it     *
+* under the terms of the GNU Lesser General Public License as  published   *
+* by the Free Software Foundation, either version 3 of the License, or (at *
+* your option) any later version.                                          *
+*                                                                          *
+* fastcgi++ is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or    *
+* FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public     *
+* License for more details.                                                *
+*                                                                          *
+* You should have received a copy of the GNU Lesser General Public License *
+* along with fastcgi++.  If not, see <http://www.gnu.org/licenses/>.       *
+****************************************************************************/
+
+
+#include <boost/static_assert.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <fastcgi++/utf8.hpp>
+
+// Characters are taken to be UTF-32 code points
+BOOST_STATIC_ASSERT(sizeof(wchar_t)==4);
+
+size_t Fastcgipp::Utf8::decode(const char* source, size_t size, wchar_t* destination)
+{
+	const unsigned char* data=(const unsigned char*)source;
+	const unsigned char* const end=data+size;
+	wchar_t* const start=destination;
+
+	while(data<end)
+	{{
+#ifdef __SSE2__
+		// Widen sixteen bytes at a time for as long as none have the high bit set
+		const __m128i zero=_mm_setzero_si128();
+		while(end-data>=16)
+		{{
+			const __m128i chunk=_mm_loadu_si128((const __m128i*)data);
+			if(_mm_movemask_epi8(chunk))
+				break;
+			const __m128i low=_mm_unpacklo_epi8(chunk, zero);
+			const __m128i high=_mm_unpackhi_epi8(chunk, zero);
+			_mm_storeu_si128((__m128i*)destination, _mm_unpacklo_epi16(low, zero));
+			_mm_storeu_si128((__m128i*)(destination+4), _mm_unpackhi_epi16(low, zero));
+			_mm_storeu_si128((__m128i*)(destination+8), _mm_unpacklo_epi16(high, zero));
+			_mm_storeu_si128((__m128i*)(destination+12), _mm_unpackhi_epi16(high, zero));
+			data+=16;
+			destination+=16;
+		}}
+		if(data==end)
+			break;
+#endif
+
+		// Bytes around multibyte sequences are taken one at a time for a while before trying
+		// the vector path again, or text with few ASCII runs would keep failing it
+		const unsigned char* const batchEnd=end-data>16?data+16:end;
+		while(data<batchEnd)
+		{{
+			const unsigned int lead=*data;
+			if(lead<0x80)
+			{
+				*destination++=lead;
+				++data;
+				continue;
+			}
+
+			unsigned int length;
+			unsigned int codePoint;
+			unsigned int minimum;
+			if((lead&0xe0)==0xc0)
+			{
+				length=2;
+				codePoint=lead&0x1f;
+				minimum=0x80;
+			}
+			else if((lead&0xf0)==0xe0)
+			{
+				length=3;
+				codePoint=lead&0x0f;
+				minimum=0x800;
+			}
+			else if((lead&0xf8)==0xf0)
+			{
+				length=4;
+				codePoint=lead&0x07;
+				minimum=0x10000;
+			}
+			else
+				return invalid;
+
+			if(size_t(end-data)<length)
+				return invalid;
+			for(unsigned int i=1; i<length; ++i)
+			{{
+				if((data[i]&0xc0)!=0x80)
+					return invalid;
+				codePoint=codePoint<<6 | (data[i]&0x3f);
+			}}
+			if(codePoint<minimum || codePoint>0x10ffff || (codePoint>=0xd800 && codePoint<=0xdfff))
+				return invalid;
+
+			*destination++=codePoint;
+			data+=length;
+		}}
+	}}
+
+	return destination-start;
+}
+
+size_t Fastcgipp::Utf8::encode(const wchar_t* source, size_t size, char* destination)
+{
+	const wchar_t* it=source;
+	const size_t written=encode(it, source+size, destination, maxEncodedSize(size));
+	return it==source+size?written:invalid;
+}
+
+size_t Fastcgipp::Utf8::encode(const wchar_t*& source, const wchar_t* end, char* destination, size_t size)
+{
+	char* const start=destination;
+	char* const destinationEnd=destination+size;
+
+	while(source<end)
+	{{
+#ifdef __SSE2__
+		// Narrow sixteen characters at a time for as long as all are ASCII
+		const __m128i nonAscii=_mm_set1_epi32(~0x7f);
+		while(end-source>=16 && destinationEnd-destination>=16)
+		{{
+			const __m128i a=_mm_loadu_si128((const __m128i*)source);
+			const __m128i b=_mm_loadu_si128((const __m128i*)(source+4));
+			const __m128i c=_mm_loadu_si128((const __m128i*)(source+8));
+			const __m128i d=_mm_loadu_si128((const __m128i*)(source+12));
+			const __m128i any=_mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), nonAscii);
+			if(_mm_movemask_epi8(_mm_cmpeq_epi32(any, _mm_setzero_si128()))!=0xffff)
+				break;
+			_mm_storeu_si128((__m128i*)destination, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+			source+=16;
+			destination+=16;
+		}}
+		if(source==end)
+			break;
+#endif
+
+		// Characters around non-ASCII ones are taken one at a time for a while before trying
+		// the vector path again, or text with few ASCII runs would keep failing it
+		const wchar_t* const batchEnd=end-source>16?source+16:end;
+		while(source<batchEnd)
+		{{
+			const unsigned int codePoint=*source;
+			const size_t room=destinationEnd-destination;
+			if(codePoint<0x80)
+			{
+				if(room<1)
+					break;
+				*destination++=codePoint;
+			}
+			else if(codePoint<0x800)
+			{
+				if(room<2)
+					break;
+				*destination++=0xc0 | codePoint>>6;
+				*destination++=0x80 | (codePoint&0x3f);
+			}
+			else if(codePoint<0x10000)
+			{
+				if(room<3 || (codePoint>=0xd800 && codePoint<=0xdfff))
+					break;
+				*destination++=0xe0 | codePoint>>12;
+				*destination++=0x80 | (codePoint>>6&0x3f);
+				*destination++=0x80 | (codePoint&0x3f);
+			}
+			else if(codePoint<=0x10ffff)
+			{
+				if(room<4)
+					break;
+				*destination++=0xf0 | codePoint>>18;
+				*destination++=0x80 | (codePoint>>12&0x3f);
+				*destination++=0x80 | (codePoint>>6&0x3f);
+				*destination++=0x80 | (codePoint&0x3f);
+			}
+			else
+				break;
+			++source;
+		}}
+		if(source!=batchEnd)
+			break;
+	}}
+
+	return destination-start;
+}